@@ -0,0 +1,56 @@
+/*Process CPU time shared by the C++ projects
+CpuUsage.h
+Measures how busy a program keeps the CPU, for comparing an animating
+mode with an idle one:
+
+    double seconds = cpuusage::processSeconds();   CPU time of every thread so far
+    cpuusage::ModeMeter meter;
+    meter.report("animating", wallSeconds);        print the share of one core since the last report
+
+100% is one fully busy core; a program that sleeps while nothing changes
+should report close to 0% in its idle mode.
+*/
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <ctime>
+#endif
+
+namespace cpuusage {
+
+// CPU time of the whole process (all threads), in seconds
+inline double processSeconds() {
+#ifdef _WIN32
+    FILETIME creation, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exited, &kernel, &user)) return 0.0;
+    auto seconds = [](const FILETIME& time) { return (((uint64_t)time.dwHighDateTime << 32) | time.dwLowDateTime) * 1.0e-7; };
+    return seconds(kernel) + seconds(user);
+#else
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1.0e-9;
+#endif
+}
+
+// CPU share per mode of a program: each report() closes the mode that
+// ran since the previous one and starts the next
+struct ModeMeter {
+    double startWall = 0.0; // seconds, when the current mode began
+    double startCpu = 0.0;
+
+    void report(const char* mode, double wall) {
+        double cpu = processSeconds();
+        if (wall > startWall) {
+            std::cout << "CPU while " << mode << ": " << (int)(100.0 * (cpu - startCpu) / (wall - startWall) + 0.5)
+                << "% over " << wall - startWall << " s" << std::endl;
+        }
+        startWall = wall;
+        startCpu = cpu;
+    }
+};
+
+} // namespace cpuusage
@@ -0,0 +1,309 @@
+/*Index and vertex order optimization shared by the C++ projects
+MeshOptimizer.h
+Reorders indexed triangle lists so the GPU does less work for the same
+mesh:
+
+    optimizeVertexCache(indices, vertexCount);      triangle order for the post-transform cache (Forsyth)
+    optimizeOverdraw(indices, vertices);            cluster order for early depth rejection (Tipsify-style)
+    optimizeVertexFetch(vertices, indices);         vertex order for pre-transform fetch locality
+    analyzeVertexCache(indices, vertexCount);       ACMR/ATVR of an index order on a FIFO cache
+
+Run them in that order: overdraw only moves whole clusters of the cache
+order, and the fetch pass renumbers vertices without changing triangles.
+Vertex types need a position member with x, y and z (glm::vec3 works).
+*/
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+namespace meshopt {
+
+// Cache size the optimizer targets. Real post-transform caches are FIFOs
+// of roughly 16-32 entries; ordering for an LRU of 32 holds up well on all
+// of them.
+const int OPTIMIZER_CACHE_SIZE = 32;
+// FIFO size analyzeVertexCache simulates by default
+const int ANALYZE_CACHE_SIZE = 16;
+
+struct CacheStats {
+    size_t transformed = 0; // vertex shader invocations
+    size_t triangles = 0;
+    size_t vertices = 0;    // distinct vertices referenced
+    float acmr = 0.0f;      // transformed per triangle: 0.5 is ideal for a large grid, 3 is no reuse
+    float atvr = 0.0f;      // transformed per vertex: 1 is ideal
+};
+
+// Every index below 65536 fits an unsigned short index buffer
+inline bool fitsShortIndices(size_t vertexCount) {
+    return vertexCount <= 65536;
+}
+
+inline CacheStats analyzeVertexCache(const std::vector<unsigned int>& indices, size_t vertexCount, int cacheSize = ANALYZE_CACHE_SIZE) {
+    CacheStats stats;
+    std::vector<size_t> insertedAt(vertexCount, 0); // 1 + FIFO write count when last inserted, 0 if never
+    size_t writes = 0;
+
+    for (unsigned int index : indices) {
+        bool cached = insertedAt[index] && writes - (insertedAt[index] - 1) <= (size_t)cacheSize;
+        if (cached) continue;
+        if (!insertedAt[index]) stats.vertices++;
+        insertedAt[index] = ++writes;
+    }
+
+    stats.transformed = writes;
+    stats.triangles = indices.size() / 3;
+    stats.acmr = stats.triangles ? (float)stats.transformed / stats.triangles : 0.0f;
+    stats.atvr = stats.vertices ? (float)stats.transformed / stats.vertices : 0.0f;
+    return stats;
+}
+
+namespace detail {
+
+// Tom Forsyth, "Linear-Speed Vertex Cache Optimisation" (2006)
+inline float vertexScore(int cachePosition, int remainingTriangles) {
+    if (remainingTriangles == 0) return -1.0f;
+
+    float score = 0.0f;
+    if (cachePosition >= 0) {
+        if (cachePosition < 3) {
+            score = 0.75f; // the last triangle's vertices: mild penalty so strips do not double back
+        }
+        else {
+            float scaled = 1.0f - (float)(cachePosition - 3) / (OPTIMIZER_CACHE_SIZE - 3);
+            score = powf(scaled, 1.5f);
+        }
+    }
+    // Favour vertices with few triangles left so they leave the mesh early
+    score += 2.0f / sqrtf((float)remainingTriangles);
+    return score;
+}
+
+struct Float3 {
+    float x, y, z;
+};
+
+inline Float3 operator-(Float3 a, Float3 b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+inline Float3 cross(Float3 a, Float3 b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+inline float dot(Float3 a, Float3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+template <typename Vertex>
+Float3 positionOf(const Vertex& vertex) {
+    return { (float)vertex.position.x, (float)vertex.position.y, (float)vertex.position.z };
+}
+
+} // namespace detail
+
+// Greedy triangle reorder: repeatedly emit the best-scoring triangle that
+// touches the simulated cache, falling back to the next unemitted one
+inline void optimizeVertexCache(std::vector<unsigned int>& indices, size_t vertexCount) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0) return;
+
+    // Vertex -> triangle adjacency, compacted as triangles are emitted
+    std::vector<int> remaining(vertexCount, 0);
+    for (unsigned int index : indices) remaining[index]++;
+    std::vector<size_t> adjacencyStart(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; ++v) adjacencyStart[v + 1] = adjacencyStart[v] + remaining[v];
+    std::vector<unsigned int> adjacency(indices.size());
+    std::vector<size_t> filled(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    for (size_t t = 0; t < triangleCount; ++t) {
+        for (int corner = 0; corner < 3; ++corner) adjacency[filled[indices[t * 3 + corner]]++] = (unsigned int)t;
+    }
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScores(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v) vertexScores[v] = detail::vertexScore(-1, remaining[v]);
+
+    std::vector<bool> emitted(triangleCount, false);
+
+    std::vector<unsigned int> output;
+    output.reserve(indices.size());
+    std::vector<unsigned int> cache, nextCache;
+    cache.reserve(OPTIMIZER_CACHE_SIZE + 3);
+    nextCache.reserve(OPTIMIZER_CACHE_SIZE + 3);
+
+    size_t scanCursor = 0; // every triangle before it has been emitted
+    long best = -1;
+    for (size_t emittedCount = 0; emittedCount < triangleCount; ++emittedCount) {
+        if (best < 0) {
+            while (emitted[scanCursor]) scanCursor++;
+            best = (long)scanCursor;
+        }
+
+        emitted[best] = true;
+        const unsigned int* triangle = &indices[best * 3];
+        nextCache.assign(triangle, triangle + 3);
+        for (int corner = 0; corner < 3; ++corner) {
+            unsigned int v = triangle[corner];
+            output.push_back(v);
+
+            // Drop the triangle from the vertex's live adjacency
+            size_t begin = adjacencyStart[v], end = begin + remaining[v];
+            for (size_t a = begin; a < end; ++a) {
+                if (adjacency[a] == (unsigned int)best) {
+                    adjacency[a] = adjacency[end - 1];
+                    break;
+                }
+            }
+            remaining[v]--;
+        }
+        for (unsigned int v : cache) {
+            if (v != triangle[0] && v != triangle[1] && v != triangle[2]) nextCache.push_back(v);
+        }
+        cache.swap(nextCache);
+
+        // Rescore everything in the cache, including vertices it just evicted
+        for (size_t position = 0; position < cache.size(); ++position) {
+            unsigned int v = cache[position];
+            cachePosition[v] = position < (size_t)OPTIMIZER_CACHE_SIZE ? (int)position : -1;
+            vertexScores[v] = detail::vertexScore(cachePosition[v], remaining[v]);
+        }
+
+        best = -1;
+        float bestScore = -1.0f;
+        for (unsigned int v : cache) {
+            for (size_t a = adjacencyStart[v], end = a + remaining[v]; a < end; ++a) {
+                unsigned int t = adjacency[a];
+                float score = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+                if (score > bestScore) {
+                    bestScore = score;
+                    best = (long)t;
+                }
+            }
+        }
+        if (cache.size() > (size_t)OPTIMIZER_CACHE_SIZE) cache.resize(OPTIMIZER_CACHE_SIZE);
+    }
+
+    indices.swap(output);
+}
+
+// Tipsify-style overdraw pass (Sander, Nehab and Barczak, 2007): cut the
+// cache-optimized order into clusters wherever a restart costs at most
+// threshold x the cluster's ACMR, then draw clusters facing away from the
+// mesh centre first, so on convex-ish meshes the faces nearest the viewer
+// tend to come first and hide the rest
+template <typename Vertex>
+void optimizeOverdraw(std::vector<unsigned int>& indices, const std::vector<Vertex>& vertices, float threshold = 1.05f) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount < 2) return;
+
+    // Hard boundaries: triangles where the FIFO misses all three vertices
+    std::vector<size_t> clusters;
+    {
+        std::vector<size_t> insertedAt(vertices.size(), 0);
+        size_t writes = 0;
+        for (size_t t = 0; t < triangleCount; ++t) {
+            int misses = 0;
+            for (int corner = 0; corner < 3; ++corner) {
+                unsigned int v = indices[t * 3 + corner];
+                if (insertedAt[v] && writes - (insertedAt[v] - 1) <= (size_t)ANALYZE_CACHE_SIZE) continue;
+                insertedAt[v] = ++writes;
+                misses++;
+            }
+            if (misses == 3 || t == 0) clusters.push_back(t);
+        }
+    }
+    clusters.push_back(triangleCount);
+
+    // Soft boundaries inside each hard cluster, simulated with a cold cache
+    // from every cut so the split cost is counted
+    std::vector<size_t> softClusters;
+    for (size_t c = 0; c + 1 < clusters.size(); ++c) {
+        size_t begin = clusters[c], end = clusters[c + 1];
+        std::vector<unsigned int> cluster(indices.begin() + begin * 3, indices.begin() + end * 3);
+        float targetAcmr = analyzeVertexCache(cluster, vertices.size()).acmr * threshold;
+
+        std::vector<size_t> insertedAt(vertices.size(), 0);
+        size_t writes = 0, start = begin;
+        softClusters.push_back(begin);
+        for (size_t t = begin; t < end; ++t) {
+            for (int corner = 0; corner < 3; ++corner) {
+                unsigned int v = indices[t * 3 + corner];
+                if (insertedAt[v] && writes - (insertedAt[v] - 1) <= (size_t)ANALYZE_CACHE_SIZE) continue;
+                insertedAt[v] = ++writes;
+            }
+            if (t + 1 < end && (float)writes / (t + 1 - start) <= targetAcmr) {
+                softClusters.push_back(t + 1);
+                std::fill(insertedAt.begin(), insertedAt.end(), 0);
+                writes = 0;
+                start = t + 1;
+            }
+        }
+    }
+    softClusters.push_back(triangleCount);
+    if (softClusters.size() <= 2) return;
+
+    // Area-weighted centroid and normal per cluster
+    struct Cluster {
+        size_t begin, end;
+        float sortKey;
+    };
+    std::vector<Cluster> order;
+    std::vector<detail::Float3> centroids, normals;
+    detail::Float3 meshCentroid = { 0, 0, 0 };
+    float meshArea = 0.0f;
+    for (size_t c = 0; c + 1 < softClusters.size(); ++c) {
+        detail::Float3 centroid = { 0, 0, 0 }, normal = { 0, 0, 0 };
+        float area = 0.0f;
+        for (size_t t = softClusters[c]; t < softClusters[c + 1]; ++t) {
+            detail::Float3 a = detail::positionOf(vertices[indices[t * 3]]);
+            detail::Float3 b = detail::positionOf(vertices[indices[t * 3 + 1]]);
+            detail::Float3 p = detail::positionOf(vertices[indices[t * 3 + 2]]);
+            detail::Float3 n = detail::cross(b - a, p - a);
+            float weight = sqrtf(detail::dot(n, n));
+            centroid.x += (a.x + b.x + p.x) / 3.0f * weight;
+            centroid.y += (a.y + b.y + p.y) / 3.0f * weight;
+            centroid.z += (a.z + b.z + p.z) / 3.0f * weight;
+            normal.x += n.x;
+            normal.y += n.y;
+            normal.z += n.z;
+            area += weight;
+        }
+        meshCentroid.x += centroid.x;
+        meshCentroid.y += centroid.y;
+        meshCentroid.z += centroid.z;
+        meshArea += area;
+        if (area > 0.0f) centroid = { centroid.x / area, centroid.y / area, centroid.z / area };
+        float length = sqrtf(detail::dot(normal, normal));
+        if (length > 0.0f) normal = { normal.x / length, normal.y / length, normal.z / length };
+        centroids.push_back(centroid);
+        normals.push_back(normal);
+    }
+    if (meshArea > 0.0f) meshCentroid = { meshCentroid.x / meshArea, meshCentroid.y / meshArea, meshCentroid.z / meshArea };
+
+    for (size_t c = 0; c + 1 < softClusters.size(); ++c) {
+        order.push_back({ softClusters[c], softClusters[c + 1], detail::dot(centroids[c] - meshCentroid, normals[c]) });
+    }
+    std::stable_sort(order.begin(), order.end(), [](const Cluster& a, const Cluster& b) {
+        return a.sortKey > b.sortKey;
+    });
+
+    std::vector<unsigned int> output;
+    output.reserve(indices.size());
+    for (const Cluster& cluster : order) {
+        output.insert(output.end(), indices.begin() + cluster.begin * 3, indices.begin() + cluster.end * 3);
+    }
+    indices.swap(output);
+}
+
+// Renumber vertices in order of first use, so the vertex fetch walks the
+// buffer forwards; vertices no triangle references are dropped
+template <typename Vertex>
+void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+    std::vector<unsigned int> remap(vertices.size(), ~0u);
+    std::vector<Vertex> reordered;
+    reordered.reserve(vertices.size());
+    for (unsigned int& index : indices) {
+        if (remap[index] == ~0u) {
+            remap[index] = (unsigned int)reordered.size();
+            reordered.push_back(vertices[index]);
+        }
+        index = remap[index];
+    }
+    vertices.swap(reordered);
+}
+
+} // namespace meshopt
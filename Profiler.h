@@ -0,0 +1,193 @@
+/*Scoped CPU profiler shared by the C++ projects
+Profiler.h
+Zones are recorded into per-thread ring buffers with steady_clock
+timestamps and dumped in the Chrome trace-event format, which
+chrome://tracing, Perfetto and Speedscope load directly.
+
+    PROFILE_SCOPE("name");         time the enclosing block
+    PROFILE_FUNCTION();            same, named after the function
+    PROFILE_THREAD_NAME("main");   label the calling thread's lane
+    PROFILE_TRACE_AT_EXIT(path);   write the trace when the program exits
+
+The trace goes to the PROFILER_TRACE environment variable if it is set,
+otherwise to path (no trace when both are empty). Build with
+-DPROFILER_ENABLED=0 to compile every macro away.
+*/
+#pragma once
+
+#ifndef PROFILER_ENABLED
+#define PROFILER_ENABLED 1
+#endif
+
+#if PROFILER_ENABLED
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace profiler {
+
+struct Zone {
+    const char* name; // string literals only; the pointer is kept until the dump
+    int64_t start;    // nanoseconds since the profiler started
+    int64_t end;
+};
+
+// One lane per buffer. A buffer belongs to one live thread at a time;
+// when a thread exits its buffer goes back to the pool, so short-lived
+// workers (e.g. one set per frame) reuse a few lanes instead of growing
+// memory. Once full, the oldest zones are overwritten.
+struct ThreadBuffer {
+    static const size_t CAPACITY = 1 << 16;
+
+    int lane = 0;
+    std::string name;
+    std::vector<Zone> zones = std::vector<Zone>(CAPACITY);
+    std::atomic<uint64_t> count{ 0 }; // zones ever written; the ring index is count % CAPACITY
+
+    void record(const char* zoneName, int64_t start, int64_t end) {
+        uint64_t index = count.load(std::memory_order_relaxed);
+        zones[index % CAPACITY] = { zoneName, start, end };
+        count.store(index + 1, std::memory_order_release);
+    }
+};
+
+class Registry {
+public:
+    static Registry& instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    ThreadBuffer* acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!freeBuffers.empty()) {
+            ThreadBuffer* buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+            return buffer;
+        }
+        buffers.push_back(std::make_unique<ThreadBuffer>());
+        ThreadBuffer* buffer = buffers.back().get();
+        buffer->lane = (int)buffers.size();
+        buffer->name = "thread " + std::to_string(buffer->lane);
+        return buffer;
+    }
+
+    void release(ThreadBuffer* buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        freeBuffers.push_back(buffer);
+    }
+
+    void setName(ThreadBuffer* buffer, const char* name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffer->name = name;
+    }
+
+    // Zones still being written by other threads may be missed or torn;
+    // dump once workers are idle (at exit) for an exact trace
+    bool dump(const char* path) {
+        FILE* file = fopen(path, "w");
+        if (!file) return false;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        fprintf(file, "{\"traceEvents\":[\n");
+        bool first = true;
+        for (const auto& buffer : buffers) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", buffer->lane, escape(buffer->name.c_str()).c_str());
+            first = false;
+
+            uint64_t count = buffer->count.load(std::memory_order_acquire);
+            uint64_t begin = count > ThreadBuffer::CAPACITY ? count - ThreadBuffer::CAPACITY : 0;
+            for (uint64_t i = begin; i < count; ++i) {
+                const Zone& zone = buffer->zones[i % ThreadBuffer::CAPACITY];
+                fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    escape(zone.name).c_str(), buffer->lane, zone.start / 1000.0, (zone.end - zone.start) / 1000.0);
+            }
+        }
+        fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        return fclose(file) == 0;
+    }
+
+private:
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::vector<ThreadBuffer*> freeBuffers;
+
+    static std::string escape(const char* text) {
+        std::string escaped;
+        for (; *text; ++text) {
+            if (*text == '"' || *text == '\\') escaped += '\\';
+            if ((unsigned char)*text >= 0x20) escaped += *text;
+        }
+        return escaped;
+    }
+};
+
+// Hands the calling thread a buffer on first use and returns it on exit
+struct ThreadSlot {
+    ThreadBuffer* buffer = Registry::instance().acquire();
+    ~ThreadSlot() { Registry::instance().release(buffer); }
+};
+
+inline ThreadBuffer* threadBuffer() {
+    thread_local ThreadSlot slot;
+    return slot.buffer;
+}
+
+class ScopedZone {
+public:
+    explicit ScopedZone(const char* zoneName) : name(zoneName), start(Registry::instance().now()) {
+    }
+
+    ~ScopedZone() {
+        threadBuffer()->record(name, start, Registry::instance().now());
+    }
+
+private:
+    const char* name;
+    int64_t start;
+};
+
+inline void traceAtExit(const char* path) {
+    static std::string tracePath;
+    const char* environment = getenv("PROFILER_TRACE");
+    tracePath = environment && *environment ? environment : (path ? path : "");
+    if (tracePath.empty()) return;
+
+    Registry::instance(); // constructed before the handler, so it outlives it
+    atexit([] {
+        if (!Registry::instance().dump(tracePath.c_str())) {
+            fprintf(stderr, "Failed to write profiler trace %s\n", tracePath.c_str());
+        }
+    });
+}
+
+} // namespace profiler
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) profiler::ScopedZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_FUNCTION() PROFILE_SCOPE(__func__)
+#define PROFILE_THREAD_NAME(name) profiler::Registry::instance().setName(profiler::threadBuffer(), name)
+#define PROFILE_TRACE_AT_EXIT(path) profiler::traceAtExit(path)
+
+#else
+
+#define PROFILE_SCOPE(name) ((void)0)
+#define PROFILE_FUNCTION() ((void)0)
+#define PROFILE_THREAD_NAME(name) ((void)0)
+#define PROFILE_TRACE_AT_EXIT(path) ((void)0)
+
+#endif
@@ -11,6 +11,8 @@ Trivial illustration of texture mapping, with interactive controls.
 #endif
 #include <cstdlib>
 
+#include "../CpuUsage.h"
+
 // 2×2 checkered pattern (red / yellow)
 #define red     {0xff, 0x00, 0x00}
 #define yellow  {0xff, 0xff, 0x00}
@@ -25,6 +27,12 @@ static bool  spinning = true;
 static float xtrans = 0.0f;
 static float ytrans = 0.0f;
 static float zoom = 1.0f;
+static cpuusage::ModeMeter cpuMeter; // restarted whenever spinning starts or stops
+
+// Print the share of one core used since spinning last changed
+void reportCpu(const char* mode) {
+    cpuMeter.report(mode, glutGet(GLUT_ELAPSED_TIME) / 1000.0);
+}
 
 // Called on window reshape: sets up projection, view, and texture
 void reshape(int width, int height) {
@@ -88,20 +96,27 @@ void display() {
     glFlush();
 }
 
-// Idle callback: advance the spin if enabled
+// Idle callback: advance the spin. Only registered while spinning, so a
+// paused scene sleeps until input instead of calling this in a busy loop.
 void idle() {
-    if (spinning) {
-        angle += 0.2f;              // tweak speed here
-        if (angle >= 360.0f) angle -= 360.0f;
-        glutPostRedisplay();
-    }
+    angle += 0.2f;              // tweak speed here
+    if (angle >= 360.0f) angle -= 360.0f;
+    glutPostRedisplay();
 }
 
 // Keyboard callback: controls for pause/continue, move, zoom
 void keyboard(unsigned char key, int x, int y) {
     switch (key) {
-    case 'p':  spinning = false;          break;
-    case 'c':  spinning = true;           break;
+    case 'p':
+        if (spinning) reportCpu("spinning");
+        spinning = false;
+        glutIdleFunc(NULL);
+        break;
+    case 'c':
+        if (!spinning) reportCpu("paused");
+        spinning = true;
+        glutIdleFunc(idle);
+        break;
     case 'u':  ytrans += 0.1f;          break;
     case 'd':  ytrans -= 0.1f;          break;
     case 'L':  xtrans -= 0.1f;          break;
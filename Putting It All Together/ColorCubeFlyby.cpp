@@ -13,6 +13,9 @@ Enhanced RGB Color Cubes with FIXED keyboard controls and user-friendly interfac
 #include <cmath>
 #include <iostream>
 
+#include "../Profiler.h"
+#include "../CpuUsage.h"
+
 // ---- Global state variables ----
 bool isAnimating = true;        // Camera flyby animation
 bool cubesBouncing = true;      // Cube bouncing physics
@@ -21,6 +24,7 @@ float yOffset = 0.0f;           // Vertical scene offset (U/D keys)
 float zoomFactor = 1.0f;        // Scene zoom (+/- keys)
 
 static float cameraU = 0.0f;    // Camera orbit parameter
+bool timerRunning = false;      // the ~60 FPS timer chain is only alive while something moves
 
 // Three cubes with positions and velocities
 float cubePositions[3][3] = {
@@ -179,8 +183,17 @@ void drawWalls() {
     glEnable(GL_LIGHTING);
 }
 
+// ---- CPU utilization per mode ----
+cpuusage::ModeMeter cpuMeter;
+
+// Print the share of one core used since the last mode change, then start a new mode
+void reportCpu(const char* mode) {
+    cpuMeter.report(mode, glutGet(GLUT_ELAPSED_TIME) / 1000.0);
+}
+
 // ---- Update cube physics ----
 void updateCubePositions() {
+    PROFILE_FUNCTION();
     if (!cubesBouncing) return;
 
     for (int i = 0; i < 3; i++) {
@@ -224,6 +237,7 @@ void updateCubePositions() {
 
 // ---- Display function ----
 void display() {
+    PROFILE_FUNCTION();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     glMatrixMode(GL_MODELVIEW);
@@ -275,7 +289,10 @@ void display() {
 }
 
 // ---- Timer function ----
+// Redraws only while the camera or the cubes move. Once both are stopped
+// the chain ends and GLUT sleeps until input; keyboard() redraws itself.
 void timer(int value) {
+    PROFILE_FUNCTION();
     // Update camera animation
     if (isAnimating) {
         cameraU += 0.008f;  // Slower camera for better viewing
@@ -285,7 +302,14 @@ void timer(int value) {
     updateCubePositions();
 
     glutPostRedisplay();
-    glutTimerFunc(16, timer, 0); // ~60 FPS
+    timerRunning = isAnimating || cubesBouncing;
+    if (timerRunning) glutTimerFunc(16, timer, 0); // ~60 FPS
+}
+
+void startTimer() {
+    if (timerRunning) return;
+    timerRunning = true;
+    glutTimerFunc(0, timer, 0);
 }
 
 // ---- Window reshape ----
@@ -309,6 +333,7 @@ void keyboard(unsigned char key, int x, int y) {
 
     case 's':
     case 'S':
+        if (isAnimating || cubesBouncing) reportCpu("animating");
         isAnimating = false;
         cubesBouncing = false;
         std::cout << "Animation STOPPED" << std::endl;
@@ -316,8 +341,10 @@ void keyboard(unsigned char key, int x, int y) {
 
     case 'c':
     case 'C':
+        if (!isAnimating && !cubesBouncing) reportCpu("stopped");
         isAnimating = true;
         cubesBouncing = true;
+        startTimer();
         std::cout << "Animation CONTINUED" << std::endl;
         break;
 
@@ -352,8 +379,8 @@ void keyboard(unsigned char key, int x, int y) {
         // Print help
         std::cout << "\n=== CONTROLS HELP ===" << std::endl;
         std::cout << "R - Rotate scene by 15°" << std::endl;
-        std::cout << "S - Stop all animation" << std::endl;
-        std::cout << "C - Continue animation" << std::endl;
+        std::cout << "S - Stop all animation (prints CPU use while animating)" << std::endl;
+        std::cout << "C - Continue animation (prints CPU use while stopped)" << std::endl;
         std::cout << "U - Move scene up" << std::endl;
         std::cout << "D - Move scene down" << std::endl;
         std::cout << "+ - Zoom in" << std::endl;
@@ -405,6 +432,9 @@ void init() {
 
 // ---- Main function ----
 int main(int argc, char** argv) {
+    PROFILE_THREAD_NAME("main");
+    PROFILE_TRACE_AT_EXIT(nullptr); // set PROFILER_TRACE=file.json to record a trace
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(1000, 800);
@@ -413,7 +443,7 @@ int main(int argc, char** argv) {
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
-    glutTimerFunc(0, timer, 0);
+    startTimer();
 
     init();
 
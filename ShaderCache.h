@@ -0,0 +1,296 @@
+/*Program binary cache and parallel shader compilation shared by the C++ projects
+ShaderCache.h
+Builds every GLSL program of a project up front and keeps the linked
+binaries on disk, so later launches skip compiling altogether:
+
+    cache.open(path);                            load the binaries of earlier runs (empty path: no file)
+    GLuint p = cache.request(vertex, fragment);  queue a compile and link, or a binary load
+    GLuint c = cache.requestCompute(source);     same for a compute program
+    cache.ready(p);                              poll without blocking, for programs built mid-run
+    cache.finish(p);                             first use: wait for p, check it, keep its binary
+    cache.finishAll(); cache.save();             after startup: settle the rest, write the file
+
+request() never waits. With KHR_parallel_shader_compile the driver
+builds the queued programs on its own threads, so request every program
+first and only then finish() and configure them one by one. A program
+must be finished before its first glUseProgram or glGetUniformLocation
+call; the status checks and the error logs happen there.
+
+Binaries are keyed on an FNV-1a hash of the sources and the vendor,
+renderer and version strings, so a shader edit or a driver update
+recompiles. A binary the driver still rejects falls back to the source.
+Include after GL/glew.h, with the context current and GLEW initialized.
+*/
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace shadercache {
+
+// 64-bit FNV-1a; the projects use it for their file and pixel checksums too
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+struct Stats {
+    int programs = 0;    // requested
+    int cacheHits = 0;   // loaded from a binary the driver accepted
+    int compiled = 0;    // built from source and linked
+    int failed = 0;      // did not link; logged by finish()
+    bool parallel = false;
+    bool binaries = false;
+    double requestMs = 0.0; // issuing the compiles and binary loads
+    double finishMs = 0.0;  // waiting for and checking the programs
+};
+
+class ProgramCache {
+public:
+    Stats stats;
+
+    void open(const std::string& cachePath) {
+        path = cachePath;
+        stats.parallel = GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile;
+        if (GLEW_KHR_parallel_shader_compile) glMaxShaderCompilerThreadsKHR(0xFFFFFFFFu);
+        else if (GLEW_ARB_parallel_shader_compile) glMaxShaderCompilerThreadsARB(0xFFFFFFFFu);
+
+        GLint formats = 0;
+        if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        stats.binaries = formats > 0 && !path.empty();
+
+        const GLubyte* strings[] = { glGetString(GL_VENDOR), glGetString(GL_RENDERER), glGetString(GL_VERSION) };
+        for (const GLubyte* text : strings) {
+            if (text) driverHash = fnv1a(text, strlen((const char*)text), driverHash);
+        }
+        if (stats.binaries) load();
+    }
+
+    GLuint request(const std::string& vertexSource, const std::string& fragmentSource) {
+        return queue({ { GL_VERTEX_SHADER, vertexSource }, { GL_FRAGMENT_SHADER, fragmentSource } });
+    }
+
+    GLuint requestCompute(const std::string& source) {
+        return queue({ { GL_COMPUTE_SHADER, source } });
+    }
+
+    // Never blocks: true once finish() would not wait. Without parallel
+    // compilation there is no way to ask, so it is always true.
+    bool ready(GLuint program) const {
+        if (!stats.parallel || !pending.count(program)) return true;
+        GLint complete = GL_TRUE;
+        glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &complete);
+        return complete == GL_TRUE;
+    }
+
+    // Blocks until the program is built; logs and counts a failure
+    GLuint finish(GLuint program) {
+        auto found = pending.find(program);
+        if (found == pending.end()) return program;
+        auto start = std::chrono::steady_clock::now();
+        Pending& entry = found->second;
+
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (entry.fromBinary) {
+            if (linked) stats.cacheHits++;
+            else {
+                binaries.erase(entry.key); // stale despite the matching key; rebuilt and rewritten below
+                entry.fromBinary = false;
+                build(program, entry);
+                glGetProgramiv(program, GL_LINK_STATUS, &linked);
+            }
+        }
+        if (!linked) {
+            stats.failed++;
+            char infoLog[512];
+            for (GLuint shader : entry.shaders) {
+                GLint compiled = 0;
+                glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+                if (compiled) continue;
+                glGetShaderInfoLog(shader, sizeof(infoLog), NULL, infoLog);
+                std::cout << "Shader compilation failed: " << infoLog << std::endl;
+            }
+            glGetProgramInfoLog(program, sizeof(infoLog), NULL, infoLog);
+            std::cout << "Shader program linking failed: " << infoLog << std::endl;
+        }
+        else {
+            if (!entry.fromBinary) stats.compiled++;
+            used.insert(entry.key);
+            if (!entry.fromBinary && stats.binaries) keepBinary(program, entry.key);
+        }
+
+        for (GLuint shader : entry.shaders) {
+            glDetachShader(program, shader);
+            glDeleteShader(shader);
+        }
+        pending.erase(found);
+        stats.finishMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return program;
+    }
+
+    void finishAll() {
+        while (!pending.empty()) finish(pending.begin()->first);
+    }
+
+    // Writes the binaries of this run's programs; entries nothing asked
+    // for (old shader versions, other drivers) are dropped
+    bool save() {
+        if (!stats.binaries || !dirty) return true;
+        std::vector<char> data(HEADER_BYTES, 0);
+        uint32_t count = 0;
+        for (const auto& entry : binaries) {
+            if (!used.count(entry.first)) continue;
+            uint32_t format = entry.second.format, size = (uint32_t)entry.second.data.size();
+            append(data, &entry.first, sizeof(entry.first));
+            append(data, &format, sizeof(format));
+            append(data, &size, sizeof(size));
+            append(data, entry.second.data.data(), size);
+            count++;
+        }
+        uint64_t checksum = fnv1a(data.data() + HEADER_BYTES, data.size() - HEADER_BYTES);
+        memcpy(data.data(), "GLPB", 4);
+        memcpy(data.data() + 4, &count, sizeof(count));
+        memcpy(data.data() + 8, &checksum, sizeof(checksum));
+
+        // Write under a temporary name, so a crash never leaves a torn file
+        std::string temporary = path + ".tmp";
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(data.data(), data.size());
+        file.close();
+        if (!file || rename(temporary.c_str(), path.c_str()) != 0) {
+            std::cout << "Failed to write program cache " << path << std::endl;
+            remove(temporary.c_str());
+            return false;
+        }
+        dirty = false;
+        return true;
+    }
+
+private:
+    // File layout: "GLPB", entry count, FNV-1a of the entries; then per
+    // entry the key, the binary format, the byte count and the bytes
+    enum { HEADER_BYTES = 16, ENTRY_HEADER_BYTES = 16 };
+
+    struct Stage {
+        GLenum type;
+        std::string source;
+    };
+
+    struct Pending {
+        uint64_t key;
+        std::vector<Stage> stages; // kept until finish() in case the binary is rejected
+        std::vector<GLuint> shaders;
+        bool fromBinary = false;
+    };
+
+    struct Binary {
+        GLenum format;
+        std::vector<char> data;
+    };
+
+    std::string path;
+    uint64_t driverHash = 14695981039346656037ull;
+    std::map<GLuint, Pending> pending;
+    std::map<uint64_t, Binary> binaries;
+    std::set<uint64_t> used;
+    bool dirty = false;
+
+    GLuint queue(std::vector<Stage> stages) {
+        auto start = std::chrono::steady_clock::now();
+        Pending entry;
+        entry.key = driverHash;
+        for (const Stage& stage : stages) {
+            entry.key = fnv1a(&stage.type, sizeof(stage.type), entry.key);
+            entry.key = fnv1a(stage.source.data(), stage.source.size(), entry.key);
+        }
+        entry.stages = std::move(stages);
+
+        GLuint program = glCreateProgram();
+        auto binary = binaries.find(entry.key);
+        if (binary != binaries.end()) {
+            glProgramBinary(program, binary->second.format, binary->second.data.data(), (GLsizei)binary->second.data.size());
+            entry.fromBinary = true;
+        }
+        else {
+            build(program, entry);
+        }
+        pending[program] = std::move(entry);
+        stats.programs++;
+        stats.requestMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return program;
+    }
+
+    // Queues the compiles and the link without reading any status back
+    void build(GLuint program, Pending& entry) {
+        for (const Stage& stage : entry.stages) {
+            GLuint shader = glCreateShader(stage.type);
+            const char* source = stage.source.c_str();
+            glShaderSource(shader, 1, &source, NULL);
+            glCompileShader(shader);
+            glAttachShader(program, shader);
+            entry.shaders.push_back(shader);
+        }
+        if (stats.binaries) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(program);
+    }
+
+    void keepBinary(GLuint program, uint64_t key) {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) return;
+        Binary binary;
+        binary.data.resize(length);
+        glGetProgramBinary(program, length, NULL, &binary.format, binary.data.data());
+        binaries[key] = std::move(binary);
+        dirty = true;
+    }
+
+    // A missing, truncated or corrupt file just means compiling from source
+    void load() {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return;
+        std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        uint32_t count;
+        uint64_t checksum;
+        if (data.size() < HEADER_BYTES || memcmp(data.data(), "GLPB", 4) != 0) return;
+        memcpy(&count, data.data() + 4, sizeof(count));
+        memcpy(&checksum, data.data() + 8, sizeof(checksum));
+        if (fnv1a(data.data() + HEADER_BYTES, data.size() - HEADER_BYTES) != checksum) {
+            std::cout << "Program cache " << path << " failed its checksum, recompiling" << std::endl;
+            return;
+        }
+
+        size_t offset = HEADER_BYTES;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t key;
+            uint32_t format, size;
+            if (data.size() - offset < ENTRY_HEADER_BYTES) break;
+            memcpy(&key, data.data() + offset, sizeof(key));
+            memcpy(&format, data.data() + offset + 8, sizeof(format));
+            memcpy(&size, data.data() + offset + 12, sizeof(size));
+            offset += ENTRY_HEADER_BYTES;
+            if (data.size() - offset < size) break;
+            binaries[key] = { (GLenum)format, std::vector<char>(data.begin() + offset, data.begin() + offset + size) };
+            offset += size;
+        }
+    }
+
+    static void append(std::vector<char>& data, const void* bytes, size_t size) {
+        data.insert(data.end(), (const char*)bytes, (const char*)bytes + size);
+    }
+};
+
+} // namespace shadercache
@@ -13,6 +13,10 @@ July 27, 2025 */
 #include <random>
 #include <cmath>
 
+#include "../Profiler.h"
+#include "../MeshOptimizer.h"
+#include "../ShaderCache.h"
+
 // Window dimensions
 const unsigned int WINDOW_WIDTH = 1200;
 const unsigned int WINDOW_HEIGHT = 800;
@@ -131,9 +135,11 @@ public:
     std::vector<Vertex> vertices;
     std::vector<unsigned int> indices;
     unsigned int VAO, VBO, EBO;
+    GLenum indexType;
     
     Sphere(float radius, int sectorCount, int stackCount) {
         generateSphere(radius, sectorCount, stackCount);
+        optimize();
         setupBuffers();
     }
     
@@ -144,6 +150,19 @@ public:
     }
     
 private:
+    // Reorder triangles for the post-transform cache and overdraw, then
+    // vertices for fetch, and report the simulated cache behaviour
+    void optimize() {
+        meshopt::CacheStats before = meshopt::analyzeVertexCache(indices, vertices.size());
+        meshopt::optimizeVertexCache(indices, vertices.size());
+        meshopt::optimizeOverdraw(indices, vertices);
+        meshopt::optimizeVertexFetch(vertices, indices);
+        meshopt::CacheStats after = meshopt::analyzeVertexCache(indices, vertices.size());
+        
+        std::cout << "Sphere: " << indices.size() / 3 << " triangles, ACMR " << before.acmr << " -> " << after.acmr
+                  << ", ATVR " << before.atvr << " -> " << after.atvr << std::endl;
+    }
+    
     void generateSphere(float radius, int sectorCount, int stackCount) {
         float x, y, z, xy;
         float nx, ny, nz, lengthInv = 1.0f / radius;
@@ -207,8 +226,16 @@ private:
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
         
+        // 16-bit indices whenever the vertex count allows
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        if (meshopt::fitsShortIndices(vertices.size())) {
+            std::vector<unsigned short> shortIndices(indices.begin(), indices.end());
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(unsigned short), &shortIndices[0], GL_STATIC_DRAW);
+            indexType = GL_UNSIGNED_SHORT;
+        } else {
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+            indexType = GL_UNSIGNED_INT;
+        }
         
         // Position attribute
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
@@ -223,7 +250,7 @@ private:
 public:
     void draw() {
         glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
+        glDrawElements(GL_TRIANGLES, indices.size(), indexType, 0);
         glBindVertexArray(0);
     }
 };
@@ -249,6 +276,7 @@ public:
           isDynamic(dynamic), sizePhase(0.0f) {}
     
     void update(float deltaTime, glm::vec3 sunPosition) {
+        PROFILE_SCOPE("Planet::update");
         orbitAngle += orbitSpeed * deltaTime;
         rotation += rotationSpeed * deltaTime;
         
@@ -273,6 +301,7 @@ public:
     unsigned int VAO, VBO, colorVBO;
     
     StarField(int count) {
+        PROFILE_SCOPE("StarField");
         generateStars(count);
         setupBuffers();
     }
@@ -352,6 +381,7 @@ public:
     }
     
     void update(float deltaTime) {
+        PROFILE_SCOPE("SpaceFlash::update");
         if (!active) return;
         
         age += deltaTime * 60.0f; // 60 FPS equivalent
@@ -376,48 +406,15 @@ public:
     }
 };
 
-// Shader compilation helper
-unsigned int compileShader(unsigned int type, const char* source) {
-    unsigned int shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, NULL);
-    glCompileShader(shader);
-    
-    int success;
-    char infoLog[512];
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::COMPILATION_FAILED\n" << infoLog << std::endl;
-    }
-    
-    return shader;
-}
-
-// Shader program creation
-unsigned int createShaderProgram(const char* vertexSource, const char* fragmentSource) {
-    unsigned int vertexShader = compileShader(GL_VERTEX_SHADER, vertexSource);
-    unsigned int fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
-    
-    unsigned int shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-    
-    int success;
-    char infoLog[512];
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
-    }
-    
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-    
-    return shaderProgram;
-}
+// Shader programs. Both are requested before either is used, so the driver
+// compiles them side by side; linked binaries are kept across runs.
+shadercache::ProgramCache programCache;
 
 int main() {
+    auto startupBegin = std::chrono::steady_clock::now();
+    PROFILE_THREAD_NAME("main");
+    PROFILE_TRACE_AT_EXIT(nullptr); // set PROFILER_TRACE=file.json to record a trace
+    
     // Initialize GLFW
     if (!glfwInit()) {
         std::cout << "Failed to initialize GLFW" << std::endl;
@@ -450,8 +447,9 @@ int main() {
     glPointSize(2.0f);
     
     // Create shaders
-    unsigned int shaderProgram = createShaderProgram(vertexShaderSource, fragmentShaderSource);
-    unsigned int pointShaderProgram = createShaderProgram(pointVertexShaderSource, pointFragmentShaderSource);
+    programCache.open("SimpleDemoScene.programs");
+    unsigned int shaderProgram = programCache.request(vertexShaderSource, fragmentShaderSource);
+    unsigned int pointShaderProgram = programCache.request(pointVertexShaderSource, pointFragmentShaderSource);
     
     // Create sphere for planets and sun
     Sphere sphere(1.0f, 36, 18);
@@ -497,8 +495,20 @@ int main() {
     std::uniform_real_distribution<float> posDis(-1500.0f, 1500.0f);
     std::uniform_int_distribution<int> colorDis(0, 5);
     
+    // The meshes above were built while the driver compiled; settle the
+    // programs and keep their binaries for the next launch
+    programCache.finishAll();
+    programCache.save();
+    double startupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupBegin).count();
+    const shadercache::Stats& programs = programCache.stats;
+    std::cout << "Startup " << startupMs << " ms (" << (programs.cacheHits == programs.programs ? "warm" : "cold")
+        << "): " << programs.cacheHits << " of " << programs.programs << " shader programs from the program cache, "
+        << programs.requestMs + programs.finishMs << " ms blocked on shaders" << std::endl;
+    
     // Main render loop
     while (!glfwWindowShouldClose(window)) {
+        PROFILE_SCOPE("frame");
+        
         // Timing
         float currentFrame = glfwGetTime();
         float deltaTime = currentFrame - lastFrame;
@@ -609,6 +619,7 @@ int main() {
                                               0.1f, 10000.0f);
         
         // Draw starfield
+        PROFILE_SCOPE("draw");
         glUseProgram(pointShaderProgram);
         glUniformMatrix4fv(glGetUniformLocation(pointShaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
         glUniformMatrix4fv(glGetUniformLocation(pointShaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
@@ -655,7 +666,10 @@ int main() {
         }
         
         // Swap buffers and poll events
-        glfwSwapBuffers(window);
+        {
+            PROFILE_SCOPE("glfwSwapBuffers");
+            glfwSwapBuffers(window);
+        }
         glfwPollEvents();
     }
     
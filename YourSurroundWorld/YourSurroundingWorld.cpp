@@ -6,13 +6,45 @@ JULY 16, 2025*/
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
 #include <iostream>
 #include <vector>
 #include <memory>
 #include <cmath>
 #include <string>
-
-// Vertex structure
+#include <cstring>
+#include <cstdio>
+#include <cstdarg>
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <cfloat>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define NOMINMAX
+#include <windows.h>
+#endif
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define USE_SSE_CULLING 1
+#endif
+
+#include "../Profiler.h"
+#include "../MeshOptimizer.h"
+#include "../ShaderCache.h"
+#include "../CpuUsage.h"
+
+// Vertex structure (CPU side, and the full GPU layout: 44 bytes)
 struct Vertex {
     glm::vec3 position;
     glm::vec3 normal;
@@ -20,6 +52,23 @@ struct Vertex {
     glm::vec3 color;
 };
 
+// Compact GPU layout (16 bytes): positions as 16-bit unorm within the
+// geometry's bounds, 2_10_10_10 normals, half-float UVs and no color (the
+// per-draw material supplies it). Geometry::dequantize maps positions back
+// to object space and is folded into the model matrix.
+struct CompactVertex {
+    uint16_t position[4]; // xyz, w padding
+    uint32_t normal;      // GL_INT_2_10_10_10_REV
+    uint32_t texCoord;    // two halves
+};
+
+enum VertexFormat { VERTEX_FULL, VERTEX_COMPACT };
+VertexFormat vertexFormat = VERTEX_COMPACT; // fixed before the first geometry is uploaded
+
+size_t vertexStride() {
+    return vertexFormat == VERTEX_COMPACT ? sizeof(CompactVertex) : sizeof(Vertex);
+}
+
 // Material structure
 struct Material {
     glm::vec3 color = glm::vec3(1.0f);
@@ -29,90 +78,1052 @@ struct Material {
     bool transparent = false;
 };
 
-// Light structure
+// Light structure (same field order as the initializers in initializeScene())
 struct Light {
+    int type; // 0=directional, 1=point, 2=ambient
     glm::vec3 position;
     glm::vec3 color;
     float intensity;
-    int type; // 0=directional, 1=point, 2=ambient
+    float radius = 20.0f; // point lights fade to zero here, which bounds them for clustering
 };
 
-// Mesh class
-class Mesh {
+// Axis-aligned bounding box
+struct AABB {
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+
+    void expand(const glm::vec3& point) {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void expand(const AABB& box) {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    glm::vec3 center() const { return (min + max) * 0.5f; }
+    glm::vec3 extent() const { return (max - min) * 0.5f; }
+
+    float surfaceArea() const {
+        glm::vec3 d = glm::max(max - min, glm::vec3(0.0f));
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // Bounds of this box after an affine transform (Arvo's method)
+    AABB transformed(const glm::mat4& m) const {
+        glm::vec3 c = glm::vec3(m * glm::vec4(center(), 1.0f));
+        glm::vec3 e = extent();
+        glm::vec3 r(
+            fabsf(m[0][0]) * e.x + fabsf(m[1][0]) * e.y + fabsf(m[2][0]) * e.z,
+            fabsf(m[0][1]) * e.x + fabsf(m[1][1]) * e.y + fabsf(m[2][1]) * e.z,
+            fabsf(m[0][2]) * e.x + fabsf(m[1][2]) * e.y + fabsf(m[2][2]) * e.z);
+        AABB box;
+        box.min = c - r;
+        box.max = c + r;
+        return box;
+    }
+};
+
+// Vertex layout shared by every VAO that sources Vertex data
+void setupVertexAttributes() {
+    if (vertexFormat == VERTEX_COMPACT) {
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, position));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, normal));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(CompactVertex), (void*)offsetof(CompactVertex, texCoord));
+        glDisableVertexAttribArray(3); // color reads the constant white, see resetConstantAttributes()
+        return;
+    }
+
+    // Position attribute
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+
+    // Normal attribute
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+
+    // Texture coordinate attribute
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texCoord));
+
+    // Color attribute
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, color));
+}
+
+// Per-instance placement matrix (locations 4-7), sourced from the bound GL_ARRAY_BUFFER
+void setupInstanceAttributes() {
+    for (int column = 0; column < 4; ++column) {
+        glEnableVertexAttribArray(4 + column);
+        glVertexAttribPointer(4 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(column * sizeof(glm::vec4)));
+        glVertexAttribDivisor(4 + column, 1);
+    }
+}
+
+// Per-instance LOD crossfade of prefab parts (see Prefab::updateLods)
+const GLuint LOD_FADE_LOCATION = 9;
+
+// Non-instanced VAOs leave locations 4-7 disabled and read this constant
+// identity instead; compact vertices read a constant white color and
+// everything reads LOD fade 0 (opaque). Reset after instanced draws, which
+// may leave these undefined.
+void resetConstantAttributes() {
+    glVertexAttrib4f(3, 1.0f, 1.0f, 1.0f, 1.0f);
+    glVertexAttrib4f(4, 1.0f, 0.0f, 0.0f, 0.0f);
+    glVertexAttrib4f(5, 0.0f, 1.0f, 0.0f, 0.0f);
+    glVertexAttrib4f(6, 0.0f, 0.0f, 1.0f, 0.0f);
+    glVertexAttrib4f(7, 0.0f, 0.0f, 0.0f, 1.0f);
+    glVertexAttrib1f(LOD_FADE_LOCATION, 0.0f);
+}
+
+// Background geometry uploads. A worker thread owns a hidden window whose
+// context shares objects with the main one: the main thread allocates the
+// buffers (and the VAOs, which are not shared) and queues the bytes, the
+// worker copies them in with glBufferSubData and fences. Geometry is
+// resident, and drawn, only once poll() has seen that fence signal, so a
+// large scene load never holds up a frame. Without a shared context the
+// copies happen inline on the calling thread.
+class GeometryUploader {
 public:
-    std::vector<Vertex> vertices;
-    std::vector<unsigned int> indices;
-    Material material;
-    GLuint VAO, VBO, EBO;
-    glm::mat4 transform = glm::mat4(1.0f);
-    bool castShadow = true;
-    bool receiveShadow = true;
+    struct Region {
+        GLuint buffer;
+        size_t offset;
+        const void* data;
+        size_t bytes;
+    };
 
-    Mesh(const std::vector<Vertex>& verts, const std::vector<unsigned int>& inds, const Material& mat)
-        : vertices(verts), indices(inds), material(mat) {
-        setupMesh();
+    struct Upload {
+        std::vector<Region> regions;
+        std::shared_ptr<void> owner; // keeps the region data alive until the worker has copied it
+        GLsync allocated = 0;        // main thread: the buffer storage exists
+        GLsync fence = 0;            // worker: the copies are queued; set under the mutex
+        bool settled = false;        // main thread: fence signaled and regions rebound, by poll() or finishAll()
+        bool complete = false;       // main thread: retired by poll()
+    };
+
+    bool threaded = false;
+    size_t queuedBytes = 0; // main thread, every upload so far
+
+    void start(GLFWwindow* mainWindow) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        context = glfwCreateWindow(1, 1, "geometry uploads", NULL, mainWindow);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+        if (!context) {
+            std::cout << "No shared context for background geometry uploads, uploading inline" << std::endl;
+            return;
+        }
+        threaded = true;
+        worker = std::thread([this] { run(); });
     }
 
-    ~Mesh() {
-        glDeleteVertexArrays(1, &VAO);
-        glDeleteBuffers(1, &VBO);
-        glDeleteBuffers(1, &EBO);
+    void stop() {
+        if (!threaded) return;
+        finishAll();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+        poll();
+        glfwDestroyWindow(context);
+        threaded = false;
     }
 
-    void draw() {
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+    // Call with the buffers allocated (glBufferData with NULL) on this
+    // thread. Returns the pending upload, or null when it ran inline.
+    std::shared_ptr<const Upload> submit(std::vector<Region> regions, std::shared_ptr<void> owner) {
+        for (const Region& region : regions) queuedBytes += region.bytes;
+        if (!threaded) {
+            for (const Region& region : regions) write(region);
+            return nullptr;
+        }
+
+        auto upload = std::make_shared<Upload>();
+        upload->regions = std::move(regions);
+        upload->owner = std::move(owner);
+        upload->allocated = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush(); // the worker's context waits on this fence
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(upload);
+        }
+        inFlight.push_back(upload);
+        wake.notify_one();
+        return upload;
+    }
+
+    bool busy() const {
+        return !inFlight.empty();
+    }
+
+    // Main thread, once per frame: retires the uploads whose fence has
+    // signaled, and those finishAll() already settled (whose buffers may be
+    // gone since, so they are not touched again)
+    int poll() {
+        int retired = 0;
+        for (auto it = inFlight.begin(); it != inFlight.end();) {
+            Upload& upload = **it;
+            if (!upload.settled) {
+                GLsync fence;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    fence = upload.fence;
+                }
+                if (!fence || glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+                    ++it;
+                    continue;
+                }
+                settle(upload);
+            }
+            upload.complete = true;
+            it = inFlight.erase(it);
+            retired++;
+        }
+        return retired;
+    }
+
+    // Blocks until every queued copy has executed on the GPU, before the
+    // main thread reads, copies or deletes buffers the worker may still be
+    // writing. The copies are made visible here, while their buffers still
+    // exist; the uploads still retire, and count, in the next poll().
+    void finishAll() {
+        if (inFlight.empty()) return;
+        PROFILE_SCOPE("GeometryUploader::finishAll");
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&] { return queue.empty() && !working; });
+        for (const auto& upload : inFlight) {
+            if (upload->settled) continue;
+            while (glClientWaitSync(upload->fence, 0, 1000000000ull) == GL_TIMEOUT_EXPIRED) {
+            }
+            settle(*upload);
+        }
     }
 
 private:
-    void setupMesh() {
+    GLFWwindow* context = nullptr;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    std::deque<std::shared_ptr<Upload>> queue; // waiting for the worker
+    std::vector<std::shared_ptr<Upload>> inFlight; // main thread: submitted, not yet retired
+    bool working = false, stopping = false;
+
+    // Rebinding each buffer is what the spec asks for before contents changed
+    // by another context are guaranteed visible in this one
+    static void settle(Upload& upload) {
+        glDeleteSync(upload.fence);
+        for (const Region& region : upload.regions) glBindBuffer(GL_COPY_READ_BUFFER, region.buffer);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        upload.settled = true;
+    }
+
+    static void write(const Region& region) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, region.buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, region.offset, region.bytes, region.data);
+    }
+
+    void run() {
+        PROFILE_THREAD_NAME("geometry uploads");
+        glfwMakeContextCurrent(context);
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (queue.empty()) break;
+            std::shared_ptr<Upload> upload = queue.front();
+            queue.pop_front();
+            working = true;
+            lock.unlock();
+
+            GLsync fence;
+            {
+                PROFILE_SCOPE("GeometryUploader::upload");
+                glWaitSync(upload->allocated, 0, GL_TIMEOUT_IGNORED);
+                glDeleteSync(upload->allocated);
+                for (const Region& region : upload->regions) write(region);
+                glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+                upload->owner.reset(); // glBufferSubData has taken its copy
+                fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                glFlush(); // the main context waits on this fence
+            }
+
+            lock.lock();
+            upload->fence = fence;
+            working = false;
+            idle.notify_all();
+        }
+        glfwMakeContextCurrent(NULL);
+    }
+};
+
+GeometryUploader geometryUploader;
+
+// Packed vertex and index bytes, kept alive for a background upload
+struct PackedGeometry {
+    std::vector<unsigned char> vertices, indices;
+};
+
+// Geometry: CPU copy of a vertex/index set plus where it lives on the GPU.
+// Geometry loaded from a scene snapshot has no CPU copy, only the counts.
+// It either owns its VAO/VBO/EBO or is a region of a shared GeometryPool,
+// in which case baseVertex/indexOffset locate it inside the pool buffers.
+// Indices are relative to baseVertex, so any geometry under 64K vertices
+// uploads 16-bit indices, pooled or not. Nothing may draw it before it is
+// resident (see GeometryUploader).
+class Geometry {
+public:
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    size_t vertexCount = 0, indexCount = 0; // as uploaded
+    GLuint VAO = 0, VBO = 0, EBO = 0;
+    GLint baseVertex = 0;
+    size_t indexOffset = 0; // bytes into the EBO
+    GLenum indexType = GL_UNSIGNED_INT;
+    unsigned int objectIndexGeneration = 0; // IndirectDraws object index buffer attached to VAO
+    bool ownsBuffers = false;
+    AABB bounds; // object space
+    AABB quantization; // range compact positions are quantized over; empty means bounds
+    glm::mat4 dequantize = glm::mat4(1.0f); // compact positions to object space; identity for the full layout
+    std::shared_ptr<const GeometryUploader::Upload> upload; // background upload filling the buffers, null when inline
+
+    Geometry() = default;
+
+    Geometry(const std::vector<Vertex>& verts, const std::vector<unsigned int>& inds)
+        : vertices(verts), indices(inds), vertexCount(verts.size()), indexCount(inds.size()), ownsBuffers(true) {
+        computeBounds();
+
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
         glGenBuffers(1, &EBO);
 
         glBindVertexArray(VAO);
 
+        auto packed = std::make_shared<PackedGeometry>();
+        packed->vertices = packVertices();
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, packed->vertices.size(), NULL, GL_STATIC_DRAW);
 
+        packed->indices = packIndices();
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, packed->indices.size(), NULL, GL_STATIC_DRAW);
 
-        // Position attribute
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+        setupVertexAttributes();
 
-        // Normal attribute
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+        glBindVertexArray(0);
+        upload = geometryUploader.submit({ { VBO, 0, packed->vertices.data(), packed->vertices.size() },
+            { EBO, 0, packed->indices.data(), packed->indices.size() } }, packed);
+    }
 
-        // Texture coordinate attribute
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, texCoord));
+    // Own buffers filled from vertices already in the current GPU layout and
+    // packed indices (a mapped scene snapshot, which owner keeps mapped until
+    // the upload has read it); vertexCount must be set
+    void loadPacked(const void* vertexData, const void* indexData, size_t indexBytes, std::shared_ptr<void> owner) {
+        ownsBuffers = true;
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+        glGenBuffers(1, &EBO);
+
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, vertexCount * vertexStride(), NULL, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, NULL, GL_STATIC_DRAW);
+        setupVertexAttributes();
+        glBindVertexArray(0);
+        upload = geometryUploader.submit({ { VBO, 0, vertexData, vertexCount * vertexStride() }, { EBO, 0, indexData, indexBytes } }, owner);
+    }
+
+    Geometry(const Geometry&) = delete;
+    Geometry& operator=(const Geometry&) = delete;
+
+    ~Geometry() {
+        if (ownsBuffers) {
+            if (!resident()) geometryUploader.finishAll();
+            glDeleteVertexArrays(1, &VAO);
+            glDeleteBuffers(1, &VBO);
+            glDeleteBuffers(1, &EBO);
+        }
+    }
+
+    bool resident() const {
+        return !upload || upload->complete;
+    }
+
+    void computeBounds() {
+        bounds = AABB();
+        for (const Vertex& vertex : vertices) bounds.expand(vertex.position);
+    }
+
+    // Vertices in the current GPU layout; sets dequantize for the compact one
+    std::vector<unsigned char> packVertices() {
+        std::vector<unsigned char> packed(vertices.size() * vertexStride());
+        if (vertexFormat == VERTEX_FULL) {
+            if (!vertices.empty()) memcpy(packed.data(), vertices.data(), packed.size());
+            return packed;
+        }
+
+        const AABB& range = quantization.min.x <= quantization.max.x ? quantization : bounds;
+        glm::vec3 size = range.max - range.min;
+        glm::vec3 inverseSize(size.x > 0.0f ? 1.0f / size.x : 0.0f, size.y > 0.0f ? 1.0f / size.y : 0.0f, size.z > 0.0f ? 1.0f / size.z : 0.0f);
+        dequantize = glm::scale(glm::translate(glm::mat4(1.0f), range.min), size);
+
+        CompactVertex* out = (CompactVertex*)packed.data();
+        for (const Vertex& vertex : vertices) {
+            glm::vec3 unit = glm::clamp((vertex.position - range.min) * inverseSize, 0.0f, 1.0f);
+            for (int axis = 0; axis < 3; ++axis) {
+                out->position[axis] = (uint16_t)(unit[axis] * 65535.0f + 0.5f);
+            }
+            out->position[3] = 0;
+            out->normal = glm::packSnorm3x10_1x2(glm::vec4(glm::normalize(vertex.normal), 0.0f));
+            out->texCoord = glm::packHalf2x16(vertex.texCoord);
+            out++;
+        }
+        return packed;
+    }
+
+    // Indices in the narrowest type that holds them; sets indexType
+    std::vector<unsigned char> packIndices() {
+        if (!meshopt::fitsShortIndices(vertices.size())) {
+            indexType = GL_UNSIGNED_INT;
+            std::vector<unsigned char> packed(indices.size() * sizeof(unsigned int));
+            if (!indices.empty()) memcpy(packed.data(), indices.data(), packed.size());
+            return packed;
+        }
+
+        indexType = GL_UNSIGNED_SHORT;
+        std::vector<unsigned char> packed(indices.size() * sizeof(unsigned short));
+        unsigned short* out = (unsigned short*)packed.data();
+        for (unsigned int index : indices) *out++ = (unsigned short)index;
+        return packed;
+    }
+
+    void draw() const {
+        glBindVertexArray(VAO);
+        drawElements();
+        glBindVertexArray(0);
+    }
+
+    // Draw call only, for callers that already have VAO bound
+    void drawElements() const {
+        glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)indexCount, indexType, (void*)indexOffset, baseVertex);
+    }
+};
+
+// Shared vertex/index buffers behind one VAO. Regions are appended and never
+// freed; the pool grows by doubling and copying on the GPU. The EBO mixes
+// 16- and 32-bit regions, so it is sized in bytes.
+class GeometryPool {
+public:
+    GLuint VAO = 0, VBO = 0, EBO = 0;
+    size_t vertexCount = 0, indexBytes = 0;
+    size_t vertexCapacity = 0, indexCapacity = 0; // vertices, bytes
+    unsigned int generation = 0; // bumped whenever VBO/EBO are reallocated
+
+    ~GeometryPool() {
+        release();
+    }
+
+    void release() {
+        if (VAO) {
+            geometryUploader.finishAll();
+            glDeleteVertexArrays(1, &VAO);
+            glDeleteBuffers(1, &VBO);
+            glDeleteBuffers(1, &EBO);
+        }
+        VAO = VBO = EBO = 0;
+        vertexCount = indexBytes = vertexCapacity = indexCapacity = 0;
+    }
+
+    // quantization: see Geometry::quantization; geometries that must share
+    // one model matrix (LOD levels) pass the same range
+    std::shared_ptr<Geometry> add(const std::vector<Vertex>& vertices, const std::vector<unsigned int>& indices, const AABB& quantization = AABB()) {
+        auto geometry = std::make_shared<Geometry>();
+        geometry->vertices = vertices;
+        geometry->indices = indices;
+        geometry->vertexCount = vertices.size();
+        geometry->indexCount = indices.size();
+        geometry->computeBounds();
+        geometry->quantization = quantization;
+        auto packed = std::make_shared<PackedGeometry>();
+        packed->vertices = geometry->packVertices();
+        packed->indices = geometry->packIndices();
+
+        // Regions start 4-byte aligned whatever the previous region's index type
+        size_t indexOffset = (indexBytes + 3) & ~(size_t)3;
+        reserve(vertexCount + vertices.size(), indexOffset + packed->indices.size());
+        geometry->VAO = VAO;
+        geometry->baseVertex = (GLint)vertexCount;
+        geometry->indexOffset = indexOffset;
+
+        // Written through the copy target so no VAO's element binding is disturbed
+        geometry->upload = geometryUploader.submit({ { VBO, vertexCount * vertexStride(), packed->vertices.data(), packed->vertices.size() },
+            { EBO, indexOffset, packed->indices.data(), packed->indices.size() } }, packed);
+
+        vertexCount += vertices.size();
+        indexBytes = indexOffset + packed->indices.size();
+        return geometry;
+    }
+
+    size_t sizeInBytes() const {
+        return vertexCount * vertexStride() + indexBytes;
+    }
+
+    // Replaces the contents with vertices already in the current GPU layout
+    // and a packed index region, uploaded straight from the caller's memory
+    // (a mapped scene snapshot, which owner keeps mapped until then)
+    std::shared_ptr<const GeometryUploader::Upload> load(const void* vertexData, size_t vertices, const void* indexData, size_t bytes,
+        std::shared_ptr<void> owner) {
+        release();
+        glGenVertexArrays(1, &VAO);
+        glGenBuffers(1, &VBO);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, VBO);
+        glBufferData(GL_COPY_WRITE_BUFFER, vertices * vertexStride(), NULL, GL_STATIC_DRAW);
+        glGenBuffers(1, &EBO);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, EBO);
+        glBufferData(GL_COPY_WRITE_BUFFER, bytes, NULL, GL_STATIC_DRAW);
+        vertexCount = vertexCapacity = vertices;
+        indexBytes = indexCapacity = bytes;
+        generation++;
+        attachBuffers();
+        return geometryUploader.submit({ { VBO, 0, vertexData, vertices * vertexStride() }, { EBO, 0, indexData, bytes } }, owner);
+    }
 
-        // Color attribute
-        glEnableVertexAttribArray(3);
-        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, color));
+private:
+    void reserve(size_t vertices, size_t bytes) {
+        if (!VAO) glGenVertexArrays(1, &VAO);
+        if (vertices <= vertexCapacity && bytes <= indexCapacity && VBO) return;
+
+        size_t newVertexCapacity = std::max(vertexCapacity, (size_t)4096);
+        while (newVertexCapacity < vertices) newVertexCapacity *= 2;
+        size_t newIndexCapacity = std::max(indexCapacity, (size_t)16384);
+        while (newIndexCapacity < bytes) newIndexCapacity *= 2;
+
+        VBO = grow(VBO, vertexCount * vertexStride(), newVertexCapacity * vertexStride());
+        EBO = grow(EBO, indexBytes, newIndexCapacity);
+        vertexCapacity = newVertexCapacity;
+        indexCapacity = newIndexCapacity;
+        generation++;
+        attachBuffers();
+    }
 
+    // Point the VAO at the current buffers; geometries keep the same VAO name
+    void attachBuffers() {
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        setupVertexAttributes();
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
         glBindVertexArray(0);
     }
+
+    // Waits for pending uploads into the old buffer before copying it
+    GLuint grow(GLuint oldBuffer, size_t usedBytes, size_t newBytes) {
+        if (oldBuffer) geometryUploader.finishAll();
+        GLuint buffer;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, newBytes, NULL, GL_STATIC_DRAW);
+        if (oldBuffer) {
+            glBindBuffer(GL_COPY_READ_BUFFER, oldBuffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, usedBytes);
+            glDeleteBuffers(1, &oldBuffer);
+        }
+        return buffer;
+    }
+};
+
+class SceneNode;
+
+// Mesh class: a placement of (possibly shared) geometry with its own
+// transform and material
+class Mesh {
+public:
+    std::shared_ptr<Geometry> geometry;
+    Material material;
+    glm::mat4 transform = glm::mat4(1.0f); // world transform, kept in sync with node when there is one
+    SceneNode* node = nullptr;
+    bool castShadow = true;
+    bool receiveShadow = true;
+    bool isStatic = false; // never moves after initializeScene(), eligible for static batching
+    bool batched = false;  // merged into one of Scene::staticBatches
+    bool occluder = false; // large surface drawn into the Hi-Z depth pre-pass (OcclusionCuller)
+    int objectSlot = -1;   // record in the per-object uniform buffer
+    int materialIndex = 0; // entry in the deduplicated material table
+    std::vector<std::shared_ptr<Geometry>> lods; // prefab parts: LOD_LEVELS pooled levels sharing geometry's dequantize, finest first
+
+    Mesh(const std::vector<Vertex>& verts, const std::vector<unsigned int>& inds, const Material& mat)
+        : geometry(std::make_shared<Geometry>(verts, inds)), material(mat) {
+    }
+
+    Mesh(std::shared_ptr<Geometry> geom, const Material& mat)
+        : geometry(std::move(geom)), material(mat) {
+    }
+
+    AABB worldBounds() const {
+        return geometry->bounds.transformed(transform);
+    }
+
+    // Every level it may draw with has reached the GPU
+    bool resident() const {
+        if (!geometry->resident()) return false;
+        for (const auto& lod : lods) {
+            if (!lod->resident()) return false;
+        }
+        return true;
+    }
+
+    void draw() {
+        geometry->draw();
+    }
+};
+
+// Scene graph node (room -> furniture -> part). The local transform is
+// relative to the parent; world and normal matrices are cached and only
+// recomputed when this node or one of its ancestors moved. Moving a node
+// flags the path up to the root, so update() skips untouched subtrees and
+// costs nothing when the scene is still.
+class SceneNode {
+public:
+    std::string name;
+    SceneNode* parent = nullptr;
+    std::vector<std::unique_ptr<SceneNode>> children;
+    std::vector<Mesh*> meshes; // meshes whose transform follows this node
+    glm::mat4 local = glm::mat4(1.0f);
+    glm::mat4 world = glm::mat4(1.0f);
+    glm::mat3 normalMatrix = glm::mat3(1.0f);
+
+    SceneNode(const std::string& nodeName, const glm::mat4& localTransform = glm::mat4(1.0f))
+        : name(nodeName), local(localTransform) {
+    }
+
+    SceneNode* addChild(const std::string& childName, const glm::mat4& localTransform = glm::mat4(1.0f)) {
+        children.push_back(std::make_unique<SceneNode>(childName, localTransform));
+        SceneNode* child = children.back().get();
+        child->parent = this;
+        child->markDirty();
+        return child;
+    }
+
+    void attach(Mesh* mesh) {
+        meshes.push_back(mesh);
+        mesh->node = this;
+        mesh->transform = world;
+    }
+
+    void setLocal(const glm::mat4& transform) {
+        local = transform;
+        markDirty();
+    }
+
+    void markDirty() {
+        dirty = true;
+        for (SceneNode* node = this; node && !node->subtreeDirty; node = node->parent) {
+            node->subtreeDirty = true;
+        }
+    }
+
+    // Returns the number of nodes whose world matrix was recomputed
+    size_t update(bool parentMoved = false) {
+        if (!subtreeDirty && !parentMoved) return 0;
+
+        size_t updated = 0;
+        bool moved = dirty || parentMoved;
+        if (moved) {
+            world = parent ? parent->world * local : local;
+            normalMatrix = glm::mat3(glm::transpose(glm::inverse(world)));
+            for (Mesh* mesh : meshes) mesh->transform = world;
+            updated++;
+        }
+        dirty = subtreeDirty = false;
+
+        for (auto& child : children) {
+            updated += child->update(moved);
+        }
+        return updated;
+    }
+
+private:
+    bool dirty = true;        // local changed since the last update
+    bool subtreeDirty = true; // this node or a descendant needs an update
+};
+
+// Level of detail for cylindrical prefab parts: LOD_SEGMENTS cylinders from
+// finest to coarsest, then a box impostor. A placement uses the coarsest
+// level its projected radius (pixels) allows; an n-gon deviates from the
+// circle by r * (1 - cos(pi / n)), so the thresholds keep that error near
+// half a pixel, and below LOD_PIXELS' last entry the impostor takes over.
+// Changing level needs the size to clear the threshold by LOD_HYSTERESIS,
+// so placements near a threshold do not flip every frame.
+const int LOD_SEGMENTS[] = { 48, 24, 12, 6 };
+const int LOD_LEVELS = 5;
+const float LOD_PIXELS[LOD_LEVELS - 1] = { 60.0f, 15.0f, 4.0f, 1.0f }; // finest level down to the impostor
+const float LOD_HYSTERESIS = 0.15f;
+const int LOD_FADE_FRAMES = 12; // dithered crossfade length
+
+int selectLod(float pixels, int current) {
+    int level = 0;
+    while (level < LOD_LEVELS - 1 && pixels < LOD_PIXELS[level]) level++;
+    if (current < 0) return level;
+    if (level > current && pixels > LOD_PIXELS[current] * (1.0f - LOD_HYSTERESIS)) return current;
+    if (level < current && pixels < LOD_PIXELS[current - 1] * (1.0f + LOD_HYSTERESIS)) return current;
+    return level;
+}
+
+// Prefab: a named group of parts with local transforms, placed many times.
+// Each part is drawn once for all placements with glDrawElementsInstanced,
+// so draw count depends on the part count, not on how often it is placed.
+// Parts must use pooled geometry (createBox/createCylinder).
+//
+// Camera passes can instead draw per LOD: updateLods() picks a level for
+// every (part, placement) and groups placements by level into a second
+// instance buffer, so each part costs one instanced draw per level in use.
+// Parts without a LOD chain form a single group at full detail. Shadow
+// passes keep drawPart(), whose fixed geometry keeps cached maps valid.
+class Prefab {
+public:
+    // Placements of one part drawn with one geometry; fade is per entry
+    struct LodGroup {
+        const Mesh* part;
+        const Geometry* geometry;
+        size_t first, count; // range of lodInstances
+    };
+
+    // fade 0 is opaque; during a crossfade the incoming level has +t and
+    // the outgoing one -t, which dither to complementary pixel sets
+    struct LodInstance {
+        glm::mat4 placement;
+        float fade;
+    };
+
+    struct LodStats {
+        size_t placements[LOD_LEVELS] = {}; // (part, placement) pairs per level, chained parts only
+        size_t fading = 0;
+    };
+
+    std::string name;
+    std::vector<std::unique_ptr<Mesh>> parts; // Mesh::transform is the part's local transform
+    std::vector<SceneNode*> placements;       // furniture nodes this prefab is placed at
+    std::vector<glm::mat4> instances;         // world matrices of placements, as uploaded
+    bool isStatic = false;                    // placements never move, so parts go into cached shadow maps
+
+    Prefab(const std::string& prefabName, GeometryPool& geometryPool)
+        : name(prefabName), pool(geometryPool) {
+    }
+
+    std::vector<LodGroup> lodGroups;       // by part, then level; valid while lodsSelected
+    std::vector<LodInstance> lodInstances;
+    bool lodsSelected = false;
+
+    ~Prefab() {
+        if (VAO) glDeleteVertexArrays(1, &VAO);
+        if (instanceVBO) glDeleteBuffers(1, &instanceVBO);
+        if (lodVAO) glDeleteVertexArrays(1, &lodVAO);
+        if (lodVBO) glDeleteBuffers(1, &lodVBO);
+    }
+
+    void addPart(std::unique_ptr<Mesh> part) {
+        if (part->geometry->ownsBuffers) {
+            std::cout << "Prefab " << name << ": part geometry is not pooled, skipped" << std::endl;
+            return;
+        }
+        parts.push_back(std::move(part));
+    }
+
+    void place(SceneNode* placement) {
+        placements.push_back(placement);
+        syncPlacements();
+    }
+
+    // Copy the placement nodes' world matrices; called when transforms moved.
+    // Returns whether any placement actually changed.
+    bool syncPlacements() {
+        bool changed = instances.size() != placements.size();
+        instances.resize(placements.size());
+        for (size_t i = 0; i < placements.size(); ++i) {
+            if (instances[i] != placements[i]->world) changed = true;
+            instances[i] = placements[i]->world;
+        }
+        instancesDirty = instancesDirty || changed;
+        return changed;
+    }
+
+    // Uploads placements and (re)builds the VAO over the pool and instance
+    // buffers; returns the VAO to bind for drawPart()
+    GLuint prepare() {
+        if (!instanceVBO) glGenBuffers(1, &instanceVBO);
+        if (instancesDirty) {
+            glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+            glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(glm::mat4), instances.data(), GL_STATIC_DRAW);
+            instancesDirty = false;
+        }
+        if (!VAO || poolGeneration != pool.generation) {
+            if (!VAO) glGenVertexArrays(1, &VAO);
+            glBindVertexArray(VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, pool.VBO);
+            setupVertexAttributes();
+            glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+            setupInstanceAttributes();
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.EBO);
+            glBindVertexArray(0);
+            poolGeneration = pool.generation;
+        }
+        return VAO;
+    }
+
+    // Returns the number of triangles drawn
+    size_t drawPart(const Mesh& part) const {
+        const Geometry& geometry = *part.geometry;
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, (GLsizei)geometry.indexCount, geometry.indexType,
+            (void*)geometry.indexOffset, (GLsizei)instances.size(), geometry.baseVertex);
+        return geometry.indexCount / 3 * instances.size();
+    }
+
+    // Once per frame before the camera passes. projectionScale turns a
+    // radius at unit distance into pixels. Without crossfade a level change
+    // pops; with it, a change waits for any running fade to finish.
+    void updateLods(const glm::vec3& eye, float projectionScale, bool crossfade, LodStats& stats) {
+        PROFILE_SCOPE("Prefab::updateLods");
+        size_t stateCount = parts.size() * instances.size();
+        if (lodStates.size() != stateCount) lodStates.assign(stateCount, LodState());
+        lodGroups.clear();
+        lodInstances.clear();
+
+        std::vector<LodInstance> levels[LOD_LEVELS];
+        for (size_t p = 0; p < parts.size(); ++p) {
+            const Mesh& part = *parts[p];
+            if (part.lods.size() != LOD_LEVELS) {
+                size_t first = lodInstances.size();
+                for (const glm::mat4& placement : instances) lodInstances.push_back({ placement, 0.0f });
+                lodGroups.push_back({ &part, part.geometry.get(), first, instances.size() });
+                continue;
+            }
+
+            // Chains are cylinders around the part's local y axis
+            glm::vec3 extent = part.geometry->bounds.extent();
+            for (size_t i = 0; i < instances.size(); ++i) {
+                glm::mat4 world = instances[i] * part.transform;
+                glm::vec3 center = glm::vec3(world * glm::vec4(part.geometry->bounds.center(), 1.0f));
+                float radius = std::max(extent.x, extent.z) * glm::length(glm::vec3(world[0]));
+                float distance = std::max(glm::length(center - eye), 1e-3f);
+
+                LodState& state = lodStates[p * instances.size() + i];
+                int target = selectLod(radius * projectionScale / distance, state.level);
+                if (state.level < 0 || !crossfade) {
+                    state.level = target;
+                    state.previous = -1;
+                }
+                else if (state.previous < 0 && target != state.level) {
+                    state.previous = state.level;
+                    state.level = target;
+                    state.fade = 0.0f;
+                }
+                if (state.previous >= 0) {
+                    state.fade += 1.0f / LOD_FADE_FRAMES;
+                    if (state.fade >= 1.0f) state.previous = -1;
+                }
+
+                stats.placements[state.level]++;
+                if (state.previous < 0) {
+                    levels[state.level].push_back({ instances[i], 0.0f });
+                    continue;
+                }
+                levels[state.level].push_back({ instances[i], state.fade });
+                levels[state.previous].push_back({ instances[i], -state.fade });
+                stats.fading++;
+            }
+
+            for (int level = 0; level < LOD_LEVELS; ++level) {
+                if (levels[level].empty()) continue;
+                lodGroups.push_back({ &part, part.lods[level].get(), lodInstances.size(), levels[level].size() });
+                lodInstances.insert(lodInstances.end(), levels[level].begin(), levels[level].end());
+                levels[level].clear();
+            }
+        }
+        lodsSelected = true;
+    }
+
+    // Uploads this frame's LOD instances; returns the VAO to bind for
+    // drawLodPart(). Instance attributes are pointed per group at draw time.
+    GLuint prepareLods() {
+        if (!lodVBO) glGenBuffers(1, &lodVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, lodVBO);
+        glBufferData(GL_ARRAY_BUFFER, lodInstances.size() * sizeof(LodInstance), lodInstances.data(), GL_STREAM_DRAW);
+        if (!lodVAO || lodPoolGeneration != pool.generation) {
+            if (!lodVAO) glGenVertexArrays(1, &lodVAO);
+            glBindVertexArray(lodVAO);
+            glBindBuffer(GL_ARRAY_BUFFER, pool.VBO);
+            setupVertexAttributes();
+            glBindBuffer(GL_ARRAY_BUFFER, lodVBO);
+            setupInstanceAttributes();
+            glEnableVertexAttribArray(LOD_FADE_LOCATION);
+            glVertexAttribDivisor(LOD_FADE_LOCATION, 1);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.EBO);
+            glBindVertexArray(0);
+            lodPoolGeneration = pool.generation;
+        }
+        return lodVAO;
+    }
+
+    // GL 3.3 has no base instance, so each group re-points the instance
+    // attributes at its range. Returns the number of triangles drawn.
+    size_t drawLodPart(const Mesh& part) const {
+        size_t triangles = 0;
+        glBindBuffer(GL_ARRAY_BUFFER, lodVBO);
+        for (const LodGroup& group : lodGroups) {
+            if (group.part != &part) continue;
+            size_t base = group.first * sizeof(LodInstance);
+            for (int column = 0; column < 4; ++column) {
+                glVertexAttribPointer(4 + column, 4, GL_FLOAT, GL_FALSE, sizeof(LodInstance), (void*)(base + column * sizeof(glm::vec4)));
+            }
+            glVertexAttribPointer(LOD_FADE_LOCATION, 1, GL_FLOAT, GL_FALSE, sizeof(LodInstance), (void*)(base + offsetof(LodInstance, fade)));
+
+            const Geometry& geometry = *group.geometry;
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES, (GLsizei)geometry.indexCount, geometry.indexType,
+                (void*)geometry.indexOffset, (GLsizei)group.count, geometry.baseVertex);
+            triangles += geometry.indexCount / 3 * group.count;
+        }
+        return triangles;
+    }
+
+private:
+    struct LodState {
+        int level = -1;
+        int previous = -1; // level fading out, -1 when not fading
+        float fade = 0.0f;
+    };
+
+    GeometryPool& pool;
+    GLuint VAO = 0, instanceVBO = 0;
+    GLuint lodVAO = 0, lodVBO = 0;
+    unsigned int poolGeneration = 0, lodPoolGeneration = 0;
+    bool instancesDirty = true;
+    std::vector<LodState> lodStates; // by part, then placement
 };
 
 // Scene class
 class Scene {
 public:
+    SceneNode root = SceneNode("room");
     std::vector<std::unique_ptr<Mesh>> meshes;
+    std::vector<std::unique_ptr<Prefab>> prefabs;
     std::vector<Light> lights;
     glm::vec3 backgroundColor = glm::vec3(0.96f, 0.96f, 0.96f);
     bool isNightMode = false;
-
-    void addMesh(std::unique_ptr<Mesh> mesh) {
+    unsigned int lightsVersion = 0; // bumped whenever lights change, so uploads happen only then
+    bool objectsDirty = true;       // mesh set or transforms changed since the last object upload
+    bool boundsDirty = true;        // mesh set or transforms changed since the last BVH refit
+    unsigned int staticVersion = 0; // bumped when static shadow casters change, invalidating cached shadow maps
+
+    // The mesh's current transform becomes its node's local transform under parent
+    void addMesh(std::unique_ptr<Mesh> mesh, SceneNode* parent = nullptr) {
+        SceneNode* node = (parent ? parent : &root)->addChild("mesh", mesh->transform);
+        node->attach(mesh.get());
+        if (mesh->isStatic) staticVersion++;
         meshes.push_back(std::move(mesh));
+        objectsDirty = true;
+        boundsDirty = true;
+    }
+
+    // Propagate moved nodes to world/normal matrices, meshes and prefab
+    // placements. Returns the number of nodes recomputed (0 for a still scene).
+    size_t updateTransforms() {
+        PROFILE_SCOPE("Scene::updateTransforms");
+        size_t updated = root.update();
+        if (updated > 0) {
+            for (auto& prefab : prefabs) {
+                if (prefab->syncPlacements() && prefab->isStatic) staticVersion++;
+            }
+            objectsDirty = true;
+            boundsDirty = true;
+        }
+        return updated;
+    }
+
+    Prefab* addPrefab(std::unique_ptr<Prefab> prefab) {
+        prefabs.push_back(std::move(prefab));
+        objectsDirty = true;
+        staticVersion++;
+        return prefabs.back().get();
     }
 
     void addLight(const Light& light) {
         lights.push_back(light);
+        lightsVersion++;
+    }
+
+    // Static batching: merge static meshes into shared world-space buffers,
+    // one batch per shader state (roughness/metalness/opacity) and shadow
+    // flags. The full vertex layout bakes color into the batch vertices, so
+    // it does not split a group; compact vertices have no color, so there
+    // it does. Needs the geometry CPU copies, so snapshots store the batches.
+    std::vector<std::unique_ptr<Mesh>> staticBatches;
+
+    void buildStaticBatches() {
+        PROFILE_SCOPE("Scene::buildStaticBatches");
+        staticBatches.clear();
+
+        bool bakeColor = vertexFormat == VERTEX_FULL;
+        std::map<std::tuple<float, float, float, bool, bool, bool, float, float, float>, std::vector<Mesh*>> groups;
+        for (auto& mesh : meshes) {
+            mesh->batched = false;
+            if (!mesh->isStatic) continue;
+            const Material& m = mesh->material;
+            glm::vec3 color = bakeColor ? glm::vec3(0.0f) : m.color;
+            groups[std::make_tuple(m.roughness, m.metalness, m.opacity, m.transparent, mesh->castShadow, mesh->receiveShadow,
+                color.x, color.y, color.z)].push_back(mesh.get());
+        }
+
+        for (auto& group : groups) {
+            if (group.second.size() < 2) continue; // A batch of one saves nothing
+
+            std::vector<Vertex> vertices;
+            std::vector<unsigned int> indices;
+            for (Mesh* mesh : group.second) {
+                unsigned int baseVertex = (unsigned int)vertices.size();
+                glm::mat3 normalMatrix = glm::mat3(glm::transpose(glm::inverse(mesh->transform)));
+
+                // Pre-transform into world space so the batch draws with an identity
+                // model matrix, and bake the material color the batch can no longer carry
+                for (const Vertex& vertex : mesh->geometry->vertices) {
+                    Vertex world = vertex;
+                    world.position = glm::vec3(mesh->transform * glm::vec4(vertex.position, 1.0f));
+                    world.normal = glm::normalize(normalMatrix * vertex.normal);
+                    if (bakeColor) world.color = vertex.color * mesh->material.color;
+                    vertices.push_back(world);
+                }
+                for (unsigned int index : mesh->geometry->indices) {
+                    indices.push_back(baseVertex + index);
+                }
+                mesh->batched = true;
+            }
+
+            Material batchMaterial = group.second.front()->material;
+            if (bakeColor) batchMaterial.color = glm::vec3(1.0f);
+            auto batch = std::make_unique<Mesh>(vertices, indices, batchMaterial);
+            batch->castShadow = group.second.front()->castShadow;
+            batch->receiveShadow = group.second.front()->receiveShadow;
+            batch->isStatic = true;
+            staticBatches.push_back(std::move(batch));
+        }
+        objectsDirty = true;
+        staticVersion++;
+    }
+
+    // Number of draw calls one frame costs with or without batching
+    size_t countDrawCalls(bool batching) const {
+        size_t count = 0;
+        for (const auto& prefab : prefabs) {
+            if (!prefab->instances.empty()) count += prefab->parts.size();
+        }
+        if (!batching) return count + meshes.size();
+        count += staticBatches.size();
+        for (const auto& mesh : meshes) {
+            if (!mesh->batched) count++;
+        }
+        return count;
     }
 
     void toggleLighting() {
@@ -134,6 +1145,7 @@ public:
                 else if (light.type == 1) light.intensity = 1.2f; // Point lights
             }
         }
+        lightsVersion++;
     }
 };
 
@@ -147,6 +1159,7 @@ public:
     float aspect = 1.0f;
     float nearPlane = 0.1f;
     float farPlane = 1000.0f;
+    glm::vec2 jitter = glm::vec2(0.0f); // sub-pixel projection offset in NDC for TAA
 
     int mode = 1; // 1=overview, 2=close-up, 3=detail
     float radius = 18.0f;
@@ -157,8 +1170,13 @@ public:
         return glm::lookAt(position, target, up);
     }
 
-    glm::mat4 getProjectionMatrix() {
-        return glm::perspective(glm::radians(fov), aspect, nearPlane, farPlane);
+    glm::mat4 getProjectionMatrix(bool jittered = true) {
+        glm::mat4 projection = glm::perspective(glm::radians(fov), aspect, nearPlane, farPlane);
+        if (jittered) {
+            projection[2][0] += jitter.x;
+            projection[2][1] += jitter.y;
+        }
+        return projection;
     }
 
     void updatePosition() {
@@ -204,50 +1222,308 @@ public:
     }
 };
 
-// Geometry creation functions
-std::unique_ptr<Mesh> createBox(float width, float height, float depth, const Material& material, const glm::vec3& pos = glm::vec3(0.0f)) {
-    std::vector<Vertex> vertices;
-    std::vector<unsigned int> indices;
+// View frustum as six inward-facing planes (Gribb/Hartmann extraction)
+struct Frustum {
+    glm::vec4 planes[6];
+
+    enum Result { OUTSIDE = 0, INTERSECTS = 1, INSIDE = 2 };
+
+    void extract(const glm::mat4& viewProjection) {
+        const glm::mat4& m = viewProjection;
+        for (int i = 0; i < 3; ++i) {
+            glm::vec4 row(m[0][i], m[1][i], m[2][i], m[3][i]);
+            glm::vec4 w(m[0][3], m[1][3], m[2][3], m[3][3]);
+            planes[i * 2] = w + row;     // left, bottom, near
+            planes[i * 2 + 1] = w - row; // right, top, far
+        }
+        for (auto& plane : planes) {
+            plane /= glm::length(glm::vec3(plane));
+        }
+
+#ifdef USE_SSE_CULLING
+        // Planes in SoA form, padded to eight with planes nothing is outside of
+        for (int i = 0; i < 8; ++i) {
+            glm::vec4 p = i < 6 ? planes[i] : glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+            soa[0][i] = p.x; soa[1][i] = p.y; soa[2][i] = p.z; soa[3][i] = p.w;
+            soa[4][i] = fabsf(p.x); soa[5][i] = fabsf(p.y); soa[6][i] = fabsf(p.z);
+        }
+#endif
+    }
+
+    // Center/extent test: a box is outside if it lies entirely behind any plane
+    Result classify(const AABB& box) const {
+        glm::vec3 c = box.center();
+        glm::vec3 e = box.extent();
+#ifdef USE_SSE_CULLING
+        __m128 cx = _mm_set1_ps(c.x), cy = _mm_set1_ps(c.y), cz = _mm_set1_ps(c.z);
+        __m128 ex = _mm_set1_ps(e.x), ey = _mm_set1_ps(e.y), ez = _mm_set1_ps(e.z);
+        int outside = 0, straddling = 0;
+        for (int half = 0; half < 8; half += 4) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_load_ps(&soa[0][half])),
+                _mm_mul_ps(cy, _mm_load_ps(&soa[1][half]))),
+                _mm_add_ps(_mm_mul_ps(cz, _mm_load_ps(&soa[2][half])), _mm_load_ps(&soa[3][half])));
+            __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, _mm_load_ps(&soa[4][half])),
+                _mm_mul_ps(ey, _mm_load_ps(&soa[5][half]))), _mm_mul_ps(ez, _mm_load_ps(&soa[6][half])));
+            outside |= _mm_movemask_ps(_mm_cmplt_ps(distance, _mm_sub_ps(_mm_setzero_ps(), radius)));
+            straddling |= _mm_movemask_ps(_mm_cmple_ps(distance, radius)) << half;
+        }
+        if (outside) return OUTSIDE;
+        return straddling ? INTERSECTS : INSIDE;
+#else
+        Result result = INSIDE;
+        for (const auto& plane : planes) {
+            float distance = glm::dot(glm::vec3(plane), c) + plane.w;
+            float radius = glm::dot(glm::abs(glm::vec3(plane)), e);
+            if (distance < -radius) return OUTSIDE;
+            if (distance <= radius) result = INTERSECTS;
+        }
+        return result;
+#endif
+    }
+
+private:
+#ifdef USE_SSE_CULLING
+    alignas(16) float soa[7][8]; // nx, ny, nz, d, |nx|, |ny|, |nz|
+#endif
+};
+
+// Culling counters for the last frame
+struct CullStats {
+    size_t nodesTested = 0;
+    size_t meshesTested = 0;
+    size_t meshesCulled = 0;
+    size_t meshesDrawn = 0;
+    double microseconds = 0.0;
+};
+
+// Bounding volume hierarchy over Scene::meshes, built with binned SAH and
+// refit in place when transforms change. Children of an internal node are
+// stored next to each other after their parent, so refitting is one reverse
+// sweep over the node array. Every node covers a contiguous range of the
+// leaf-ordered mesh list, so a subtree fully inside the frustum is accepted
+// with one range copy.
+class SceneBVH {
+public:
+    struct Node {
+        AABB bounds;
+        int left = -1;  // index of the left child (right is left + 1), -1 for leaves
+        int first = 0;  // first mesh covered, in leaf order
+        int count = 0;  // number of meshes covered
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Mesh*> orderedMeshes; // meshes in leaf order
+    std::vector<AABB> orderedBounds;  // world bounds, parallel to orderedMeshes
+    size_t builtMeshCount = 0;
+    int depth = 0;                    // deepest leaf; the root is depth 0
+
+    void build(const std::vector<std::unique_ptr<Mesh>>& meshes) {
+        builtMeshCount = meshes.size();
+        nodes.clear();
+        depth = 0;
+        items.resize(meshes.size());
+        itemBounds.resize(meshes.size());
+        centroids.resize(meshes.size());
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            items[i] = (int)i;
+            itemBounds[i] = meshes[i]->worldBounds();
+            centroids[i] = itemBounds[i].center();
+        }
+
+        if (!meshes.empty()) {
+            nodes.reserve(meshes.size() * 2);
+            nodes.push_back(Node());
+            subdivide(0, 0, (int)meshes.size(), 0);
+        }
+
+        orderedMeshes.resize(meshes.size());
+        orderedBounds.resize(meshes.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            orderedMeshes[i] = meshes[items[i]].get();
+            orderedBounds[i] = itemBounds[items[i]];
+        }
+    }
+
+    // Keep the topology, recompute bounds bottom-up
+    void refit() {
+        for (size_t i = 0; i < orderedMeshes.size(); ++i) {
+            orderedBounds[i] = orderedMeshes[i]->worldBounds();
+        }
+        for (int n = (int)nodes.size() - 1; n >= 0; --n) {
+            Node& node = nodes[n];
+            node.bounds = AABB();
+            if (node.left < 0) {
+                for (int i = node.first; i < node.first + node.count; ++i) node.bounds.expand(orderedBounds[i]);
+            }
+            else {
+                node.bounds.expand(nodes[node.left].bounds);
+                node.bounds.expand(nodes[node.left + 1].bounds);
+            }
+        }
+    }
+
+    void cull(const Frustum& frustum, std::vector<Mesh*>& visible, CullStats& stats) const {
+        if (nodes.empty()) return;
+
+        // One pending sibling per level at most; degenerate builds (many
+        // coincident centroids) can go deeper than the fixed stack
+        int fixedStack[64];
+        std::vector<int> deepStack;
+        int* stack = fixedStack;
+        if (depth + 1 > 64) {
+            deepStack.resize(depth + 1);
+            stack = deepStack.data();
+        }
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            stats.nodesTested++;
+            Frustum::Result result = frustum.classify(node.bounds);
+            if (result == Frustum::OUTSIDE) continue;
+
+            if (result == Frustum::INSIDE) {
+                visible.insert(visible.end(), orderedMeshes.begin() + node.first, orderedMeshes.begin() + node.first + node.count);
+            }
+            else if (node.left < 0) {
+                for (int i = node.first; i < node.first + node.count; ++i) {
+                    stats.meshesTested++;
+                    if (frustum.classify(orderedBounds[i]) != Frustum::OUTSIDE) visible.push_back(orderedMeshes[i]);
+                }
+            }
+            else {
+                stack[top++] = node.left + 1;
+                stack[top++] = node.left;
+            }
+        }
+    }
+
+private:
+    static const int BIN_COUNT = 12;
+    static const int MAX_LEAF_SIZE = 4;
+
+    // Build scratch, indexed by position in Scene::meshes
+    std::vector<int> items;
+    std::vector<AABB> itemBounds;
+    std::vector<glm::vec3> centroids;
+
+    void subdivide(int nodeIndex, int begin, int end, int level) {
+        depth = std::max(depth, level);
+        AABB bounds, centroidBounds;
+        for (int i = begin; i < end; ++i) {
+            bounds.expand(itemBounds[items[i]]);
+            centroidBounds.expand(centroids[items[i]]);
+        }
+        nodes[nodeIndex].bounds = bounds;
+        nodes[nodeIndex].first = begin;
+        nodes[nodeIndex].count = end - begin;
+
+        int count = end - begin;
+        int axis = 0;
+        glm::vec3 span = centroidBounds.max - centroidBounds.min;
+        if (span.y > span.x) axis = 1;
+        if (span.z > span[axis]) axis = 2;
+
+        if (count <= MAX_LEAF_SIZE || span[axis] <= 0.0f) return;
+
+        // Bin centroids along the widest axis and sweep for the cheapest split
+        AABB binBounds[BIN_COUNT];
+        int binCounts[BIN_COUNT] = {};
+        float scale = BIN_COUNT / span[axis];
+        auto binOf = [&](int item) {
+            return std::min(BIN_COUNT - 1, (int)((centroids[item][axis] - centroidBounds.min[axis]) * scale));
+        };
+        for (int i = begin; i < end; ++i) {
+            int bin = binOf(items[i]);
+            binCounts[bin]++;
+            binBounds[bin].expand(itemBounds[items[i]]);
+        }
+
+        float rightArea[BIN_COUNT];
+        int rightCount[BIN_COUNT];
+        AABB accumulated;
+        int accumulatedCount = 0;
+        for (int b = BIN_COUNT - 1; b > 0; --b) {
+            accumulated.expand(binBounds[b]);
+            accumulatedCount += binCounts[b];
+            rightArea[b] = accumulated.surfaceArea();
+            rightCount[b] = accumulatedCount;
+        }
+
+        float bestCost = FLT_MAX;
+        int bestSplit = -1;
+        accumulated = AABB();
+        accumulatedCount = 0;
+        for (int b = 1; b < BIN_COUNT; ++b) {
+            accumulated.expand(binBounds[b - 1]);
+            accumulatedCount += binCounts[b - 1];
+            if (accumulatedCount == 0 || rightCount[b] == 0) continue;
+            float cost = accumulated.surfaceArea() * accumulatedCount + rightArea[b] * rightCount[b];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        // Stay a leaf when no split beats testing every mesh
+        if (bestSplit < 0 || bestCost >= bounds.surfaceArea() * count) return;
+
+        int* middle = std::partition(&items[begin], &items[begin] + count, [&](int item) { return binOf(item) < bestSplit; });
+        int split = (int)(middle - &items[0]);
+
+        int left = (int)nodes.size();
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        nodes[nodeIndex].left = left;
+        subdivide(left, begin, split, level + 1);
+        subdivide(left + 1, split, end, level + 1);
+    }
+};
+
+// Geometry creation functions. Vertices are white; the material color is
+// applied per draw so identical shapes can share one cached geometry.
+void generateBox(float width, float height, float depth, std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+    const glm::vec3 white(1.0f);
 
     float hw = width * 0.5f, hh = height * 0.5f, hd = depth * 0.5f;
 
     // Define box vertices with normals
     vertices = {
         // Front face
-        {{-hw, -hh,  hd}, {0, 0, 1}, {0, 0}, material.color},
-        {{ hw, -hh,  hd}, {0, 0, 1}, {1, 0}, material.color},
-        {{ hw,  hh,  hd}, {0, 0, 1}, {1, 1}, material.color},
-        {{-hw,  hh,  hd}, {0, 0, 1}, {0, 1}, material.color},
+        {{-hw, -hh,  hd}, {0, 0, 1}, {0, 0}, white},
+        {{ hw, -hh,  hd}, {0, 0, 1}, {1, 0}, white},
+        {{ hw,  hh,  hd}, {0, 0, 1}, {1, 1}, white},
+        {{-hw,  hh,  hd}, {0, 0, 1}, {0, 1}, white},
 
         // Back face
-        {{-hw, -hh, -hd}, {0, 0, -1}, {1, 0}, material.color},
-        {{-hw,  hh, -hd}, {0, 0, -1}, {1, 1}, material.color},
-        {{ hw,  hh, -hd}, {0, 0, -1}, {0, 1}, material.color},
-        {{ hw, -hh, -hd}, {0, 0, -1}, {0, 0}, material.color},
+        {{-hw, -hh, -hd}, {0, 0, -1}, {1, 0}, white},
+        {{-hw,  hh, -hd}, {0, 0, -1}, {1, 1}, white},
+        {{ hw,  hh, -hd}, {0, 0, -1}, {0, 1}, white},
+        {{ hw, -hh, -hd}, {0, 0, -1}, {0, 0}, white},
 
         // Left face
-        {{-hw, -hh, -hd}, {-1, 0, 0}, {0, 0}, material.color},
-        {{-hw, -hh,  hd}, {-1, 0, 0}, {1, 0}, material.color},
-        {{-hw,  hh,  hd}, {-1, 0, 0}, {1, 1}, material.color},
-        {{-hw,  hh, -hd}, {-1, 0, 0}, {0, 1}, material.color},
+        {{-hw, -hh, -hd}, {-1, 0, 0}, {0, 0}, white},
+        {{-hw, -hh,  hd}, {-1, 0, 0}, {1, 0}, white},
+        {{-hw,  hh,  hd}, {-1, 0, 0}, {1, 1}, white},
+        {{-hw,  hh, -hd}, {-1, 0, 0}, {0, 1}, white},
 
         // Right face
-        {{ hw, -hh, -hd}, {1, 0, 0}, {1, 0}, material.color},
-        {{ hw,  hh, -hd}, {1, 0, 0}, {1, 1}, material.color},
-        {{ hw,  hh,  hd}, {1, 0, 0}, {0, 1}, material.color},
-        {{ hw, -hh,  hd}, {1, 0, 0}, {0, 0}, material.color},
+        {{ hw, -hh, -hd}, {1, 0, 0}, {1, 0}, white},
+        {{ hw,  hh, -hd}, {1, 0, 0}, {1, 1}, white},
+        {{ hw,  hh,  hd}, {1, 0, 0}, {0, 1}, white},
+        {{ hw, -hh,  hd}, {1, 0, 0}, {0, 0}, white},
 
         // Top face
-        {{-hw,  hh, -hd}, {0, 1, 0}, {0, 1}, material.color},
-        {{-hw,  hh,  hd}, {0, 1, 0}, {0, 0}, material.color},
-        {{ hw,  hh,  hd}, {0, 1, 0}, {1, 0}, material.color},
-        {{ hw,  hh, -hd}, {0, 1, 0}, {1, 1}, material.color},
+        {{-hw,  hh, -hd}, {0, 1, 0}, {0, 1}, white},
+        {{-hw,  hh,  hd}, {0, 1, 0}, {0, 0}, white},
+        {{ hw,  hh,  hd}, {0, 1, 0}, {1, 0}, white},
+        {{ hw,  hh, -hd}, {0, 1, 0}, {1, 1}, white},
 
         // Bottom face
-        {{-hw, -hh, -hd}, {0, -1, 0}, {1, 1}, material.color},
-        {{ hw, -hh, -hd}, {0, -1, 0}, {0, 1}, material.color},
-        {{ hw, -hh,  hd}, {0, -1, 0}, {0, 0}, material.color},
-        {{-hw, -hh,  hd}, {0, -1, 0}, {1, 0}, material.color}
+        {{-hw, -hh, -hd}, {0, -1, 0}, {1, 1}, white},
+        {{ hw, -hh, -hd}, {0, -1, 0}, {0, 1}, white},
+        {{ hw, -hh,  hd}, {0, -1, 0}, {0, 0}, white},
+        {{-hw, -hh,  hd}, {0, -1, 0}, {1, 0}, white}
     };
 
     indices = {
@@ -258,38 +1534,33 @@ std::unique_ptr<Mesh> createBox(float width, float height, float depth, const Ma
         16, 17, 18,  16, 18, 19,  // Top
         20, 21, 22,  20, 22, 23   // Bottom
     };
-
-    auto mesh = std::make_unique<Mesh>(vertices, indices, material);
-    mesh->transform = glm::translate(glm::mat4(1.0f), pos);
-    return mesh;
 }
 
-std::unique_ptr<Mesh> createCylinder(float radius, float height, int segments, const Material& material, const glm::vec3& pos = glm::vec3(0.0f)) {
-    std::vector<Vertex> vertices;
-    std::vector<unsigned int> indices;
+void generateCylinder(float radius, float height, int segments, std::vector<Vertex>& vertices, std::vector<unsigned int>& indices) {
+    const glm::vec3 white(1.0f);
 
     float halfHeight = height * 0.5f;
 
     // Top center vertex
-    vertices.push_back({ {0, halfHeight, 0}, {0, 1, 0}, {0.5f, 0.5f}, material.color });
+    vertices.push_back({ {0, halfHeight, 0}, {0, 1, 0}, {0.5f, 0.5f}, white });
 
     // Top circle vertices
     for (int i = 0; i <= segments; ++i) {
         float angle = 2.0f * M_PI * i / segments;
         float x = radius * cos(angle);
         float z = radius * sin(angle);
-        vertices.push_back({ {x, halfHeight, z}, {0, 1, 0}, {0.5f + 0.5f * cos(angle), 0.5f + 0.5f * sin(angle)}, material.color });
+        vertices.push_back({ {x, halfHeight, z}, {0, 1, 0}, {0.5f + 0.5f * cos(angle), 0.5f + 0.5f * sin(angle)}, white });
     }
 
     // Bottom center vertex
-    vertices.push_back({ {0, -halfHeight, 0}, {0, -1, 0}, {0.5f, 0.5f}, material.color });
+    vertices.push_back({ {0, -halfHeight, 0}, {0, -1, 0}, {0.5f, 0.5f}, white });
 
     // Bottom circle vertices
     for (int i = 0; i <= segments; ++i) {
         float angle = 2.0f * M_PI * i / segments;
         float x = radius * cos(angle);
         float z = radius * sin(angle);
-        vertices.push_back({ {x, -halfHeight, z}, {0, -1, 0}, {0.5f + 0.5f * cos(angle), 0.5f + 0.5f * sin(angle)}, material.color });
+        vertices.push_back({ {x, -halfHeight, z}, {0, -1, 0}, {0.5f + 0.5f * cos(angle), 0.5f + 0.5f * sin(angle)}, white });
     }
 
     // Side vertices
@@ -299,8 +1570,8 @@ std::unique_ptr<Mesh> createCylinder(float radius, float height, int segments, c
         float z = radius * sin(angle);
         glm::vec3 normal = glm::normalize(glm::vec3(x, 0, z));
 
-        vertices.push_back({ {x, halfHeight, z}, normal, {(float)i / segments, 1}, material.color });
-        vertices.push_back({ {x, -halfHeight, z}, normal, {(float)i / segments, 0}, material.color });
+        vertices.push_back({ {x, halfHeight, z}, normal, {(float)i / segments, 1}, white });
+        vertices.push_back({ {x, -halfHeight, z}, normal, {(float)i / segments, 0}, white });
     }
 
     // Top face indices
@@ -332,30 +1603,173 @@ std::unique_ptr<Mesh> createCylinder(float radius, float height, int segments, c
         indices.push_back(current + 1);
         indices.push_back(next + 1);
     }
+}
+
+// How generated shapes order their indices and vertices before upload:
+// as generated, for the post-transform vertex cache, or for the cache and
+// then overdraw. Every order but the first also reorders vertices for fetch.
+enum IndexOrder { INDEX_ORIGINAL, INDEX_VERTEX_CACHE, INDEX_OVERDRAW };
+IndexOrder indexOrder = INDEX_OVERDRAW; // fixed before the first geometry is generated
+
+const char* indexOrderName(IndexOrder order) {
+    return order == INDEX_OVERDRAW ? "overdraw" : order == INDEX_VERTEX_CACHE ? "cache" : "original";
+}
+
+// Content-addressed geometry cache: one pooled geometry per unique set of
+// shape parameters, shared by every Mesh built from those parameters
+class GeometryCache {
+public:
+    enum Shape { SHAPE_BOX, SHAPE_CYLINDER, SHAPE_IMPOSTOR, SHAPE_COUNT };
+
+    // Simulated vertex cache totals over a shape's unique geometries, as
+    // generated and as uploaded
+    struct IndexReport {
+        meshopt::CacheStats before, after;
+        size_t geometries = 0;
+    };
+
+    GeometryPool pool;
+    size_t requests = 0;
+    IndexReport indexReports[SHAPE_COUNT];
+
+    std::shared_ptr<Geometry> box(float width, float height, float depth) {
+        return get(std::make_tuple(SHAPE_BOX, width, height, depth), [&](std::vector<Vertex>& v, std::vector<unsigned int>& i) {
+            generateBox(width, height, depth, v, i);
+        });
+    }
+
+    // Every segment count quantizes over the same box, so any level of a
+    // cylinder's LOD chain can stand in for another under one model matrix
+    std::shared_ptr<Geometry> cylinder(float radius, float height, int segments) {
+        return get(std::make_tuple(SHAPE_CYLINDER, radius, height, (float)segments), [&](std::vector<Vertex>& v, std::vector<unsigned int>& i) {
+            generateCylinder(radius, height, segments, v, i);
+        }, cylinderRange(radius, height));
+    }
+
+    // Box with the cylinder's footprint area (side r * sqrt(pi)), the last
+    // LOD level, where the silhouette is a pixel or two wide
+    std::shared_ptr<Geometry> cylinderImpostor(float radius, float height) {
+        float side = radius * sqrtf((float)M_PI);
+        return get(std::make_tuple(SHAPE_IMPOSTOR, radius, height, 0.0f), [&](std::vector<Vertex>& v, std::vector<unsigned int>& i) {
+            generateBox(side, height, side, v, i);
+        }, cylinderRange(radius, height));
+    }
+
+    std::vector<std::shared_ptr<Geometry>> cylinderLods(float radius, float height) {
+        std::vector<std::shared_ptr<Geometry>> lods;
+        for (int segments : LOD_SEGMENTS) lods.push_back(cylinder(radius, height, segments));
+        lods.push_back(cylinderImpostor(radius, height));
+        return lods;
+    }
+
+    size_t uniqueShapes() const {
+        return entries.size();
+    }
+
+    void clear() {
+        entries.clear();
+        pool.release();
+        for (IndexReport& report : indexReports) report = IndexReport();
+    }
+
+    // Combined ACMR/ATVR over every unique geometry of any shape
+    IndexReport totalIndexReport() const {
+        IndexReport total;
+        for (const IndexReport& report : indexReports) {
+            accumulate(total.before, report.before);
+            accumulate(total.after, report.after);
+            total.geometries += report.geometries;
+        }
+        return total;
+    }
+
+    void printIndexReport() const {
+        const char* names[SHAPE_COUNT] = { "box", "cylinder", "impostor" };
+        for (int shape = 0; shape < SHAPE_COUNT; ++shape) {
+            const IndexReport& report = indexReports[shape];
+            if (!report.geometries) continue;
+            printf("Index order (%s) %-8s x%zu: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", indexOrderName(indexOrder), names[shape],
+                report.geometries, report.before.acmr, report.after.acmr, report.before.atvr, report.after.atvr);
+        }
+    }
+
+private:
+    typedef std::tuple<int, float, float, float> Key;
+    std::map<Key, std::shared_ptr<Geometry>> entries;
+
+    static AABB cylinderRange(float radius, float height) {
+        AABB range;
+        range.expand(glm::vec3(-radius, -height * 0.5f, -radius));
+        range.expand(glm::vec3(radius, height * 0.5f, radius));
+        return range;
+    }
+
+    template <typename Generator>
+    std::shared_ptr<Geometry> get(const Key& key, Generator generate, const AABB& quantization = AABB()) {
+        requests++;
+        auto found = entries.find(key);
+        if (found != entries.end()) return found->second;
+
+        std::vector<Vertex> vertices;
+        std::vector<unsigned int> indices;
+        generate(vertices, indices);
+
+        IndexReport& report = indexReports[std::get<0>(key)];
+        accumulate(report.before, meshopt::analyzeVertexCache(indices, vertices.size()));
+        if (indexOrder != INDEX_ORIGINAL) {
+            meshopt::optimizeVertexCache(indices, vertices.size());
+            if (indexOrder == INDEX_OVERDRAW) meshopt::optimizeOverdraw(indices, vertices);
+            meshopt::optimizeVertexFetch(vertices, indices);
+        }
+        accumulate(report.after, meshopt::analyzeVertexCache(indices, vertices.size()));
+        report.geometries++;
 
-    auto mesh = std::make_unique<Mesh>(vertices, indices, material);
+        auto geometry = pool.add(vertices, indices, quantization);
+        entries.emplace(key, geometry);
+        return geometry;
+    }
+
+    static void accumulate(meshopt::CacheStats& total, const meshopt::CacheStats& stats) {
+        total.transformed += stats.transformed;
+        total.triangles += stats.triangles;
+        total.vertices += stats.vertices;
+        total.acmr = total.triangles ? (float)total.transformed / total.triangles : 0.0f;
+        total.atvr = total.vertices ? (float)total.transformed / total.vertices : 0.0f;
+    }
+};
+
+GeometryCache geometryCache;
+
+std::unique_ptr<Mesh> createBox(float width, float height, float depth, const Material& material, const glm::vec3& pos = glm::vec3(0.0f)) {
+    auto mesh = std::make_unique<Mesh>(geometryCache.box(width, height, depth), material);
     mesh->transform = glm::translate(glm::mat4(1.0f), pos);
     return mesh;
 }
 
-// Enhanced furniture creation functions
-std::vector<std::unique_ptr<Mesh>> createEnhancedTable(float x, float z) {
-    std::vector<std::unique_ptr<Mesh>> meshes;
+std::unique_ptr<Mesh> createCylinder(float radius, float height, int segments, const Material& material, const glm::vec3& pos = glm::vec3(0.0f)) {
+    auto mesh = std::make_unique<Mesh>(geometryCache.cylinder(radius, height, segments), material);
+    mesh->lods = geometryCache.cylinderLods(radius, height);
+    mesh->transform = glm::translate(glm::mat4(1.0f), pos);
+    return mesh;
+}
+
+// Enhanced furniture prefabs, modelled around the origin and placed with
+// Scene::prefabs instances
+std::unique_ptr<Prefab> createTablePrefab() {
+    auto table = std::make_unique<Prefab>("table", geometryCache.pool);
 
     // Table top
     Material topMaterial;
     topMaterial.color = glm::vec3(0.82f, 0.71f, 0.55f); // Wood color
     topMaterial.roughness = 0.3f;
-    auto top = createBox(2.4f, 0.15f, 2.4f, topMaterial, glm::vec3(x, 3.5f, z));
-    meshes.push_back(std::move(top));
+    table->addPart(createBox(2.4f, 0.15f, 2.4f, topMaterial, glm::vec3(0, 3.5f, 0)));
 
     // Pedestal base
     Material pedestalMaterial;
     pedestalMaterial.color = glm::vec3(0.55f, 0.27f, 0.07f);
     pedestalMaterial.roughness = 0.4f;
     pedestalMaterial.metalness = 0.1f;
-    auto pedestal = createCylinder(0.2f, 3.4f, 16, pedestalMaterial, glm::vec3(x, 1.75f, z));
-    meshes.push_back(std::move(pedestal));
+    table->addPart(createCylinder(0.2f, 3.4f, 16, pedestalMaterial, glm::vec3(0, 1.75f, 0)));
 
     // Base feet
     Material baseMaterial;
@@ -365,29 +1779,26 @@ std::vector<std::unique_ptr<Mesh>> createEnhancedTable(float x, float z) {
 
     for (int i = 0; i < 4; i++) {
         float angle = i * (M_PI / 2.0f);
-        float footX = x + 1.6f * cos(angle);
-        float footZ = z + 1.6f * sin(angle);
+        float footX = 1.6f * cos(angle);
+        float footZ = 1.6f * sin(angle);
 
-        auto foot = createCylinder(0.12f, 0.08f, 16, baseMaterial, glm::vec3(footX, 0.04f, footZ));
-        meshes.push_back(std::move(foot));
+        table->addPart(createCylinder(0.12f, 0.08f, 16, baseMaterial, glm::vec3(footX, 0.04f, footZ)));
     }
 
-    return meshes;
+    return table;
 }
 
-std::vector<std::unique_ptr<Mesh>> createEnhancedChair(float x, float z, float rotation = 0) {
-    std::vector<std::unique_ptr<Mesh>> meshes;
+std::unique_ptr<Prefab> createChairPrefab() {
+    auto chair = std::make_unique<Prefab>("chair", geometryCache.pool);
 
     // Seat
     Material seatMaterial;
     seatMaterial.color = glm::vec3(0.58f, 0.44f, 0.86f); // Purple
     seatMaterial.roughness = 0.7f;
-    auto seat = createBox(1.0f, 0.15f, 1.0f, seatMaterial, glm::vec3(x, 2.5f, z));
-    meshes.push_back(std::move(seat));
+    chair->addPart(createBox(1.0f, 0.15f, 1.0f, seatMaterial, glm::vec3(0, 2.5f, 0)));
 
     // Backrest
-    auto back = createBox(1.0f, 1.2f, 0.12f, seatMaterial, glm::vec3(x, 3.3f, z - 0.44f));
-    meshes.push_back(std::move(back));
+    chair->addPart(createBox(1.0f, 1.2f, 0.12f, seatMaterial, glm::vec3(0, 3.3f, -0.44f)));
 
     // Legs
     Material legMaterial;
@@ -398,21 +1809,16 @@ std::vector<std::unique_ptr<Mesh>> createEnhancedChair(float x, float z, float r
     for (int i = 0; i < 4; i++) {
         float x_offset = (i % 2 == 0) ? -0.4f : 0.4f;
         float z_offset = (i < 2) ? -0.4f : 0.4f;
-        auto leg = createCylinder(0.04f, 2.5f, 12, legMaterial, glm::vec3(x + x_offset, 1.25f, z + z_offset));
-        meshes.push_back(std::move(leg));
+        chair->addPart(createCylinder(0.04f, 2.5f, 12, legMaterial, glm::vec3(x_offset, 1.25f, z_offset)));
     }
 
-    // Apply rotation to all meshes
-    if (rotation != 0) {
-        glm::mat4 rotationMatrix = glm::rotate(glm::mat4(1.0f), rotation, glm::vec3(0, 1, 0));
-        for (auto& mesh : meshes) {
-            glm::mat4 translation = glm::translate(glm::mat4(1.0f), glm::vec3(x, 0, z));
-            glm::mat4 negativeTranslation = glm::translate(glm::mat4(1.0f), glm::vec3(-x, 0, -z));
-            mesh->transform = translation * rotationMatrix * negativeTranslation * mesh->transform;
-        }
-    }
+    return chair;
+}
 
-    return meshes;
+// Furniture node on the floor, turned about its own vertical axis
+SceneNode* placeFurniture(SceneNode* parent, const std::string& name, float x, float z, float rotation = 0) {
+    glm::mat4 placement = glm::translate(glm::mat4(1.0f), glm::vec3(x, 0, z));
+    return parent->addChild(name, glm::rotate(placement, rotation, glm::vec3(0, 1, 0)));
 }
 
 std::vector<std::unique_ptr<Mesh>> createOriginalFloor() {
@@ -442,6 +1848,7 @@ std::vector<std::unique_ptr<Mesh>> createOriginalFloor() {
             float z = row * tileSize - floorDepth / 2.0f + tileSize / 2.0f;
 
             auto tile = createBox(tileSize, tileHeight, tileSize, material, glm::vec3(x, y, z));
+            tile->isStatic = true;
             meshes.push_back(std::move(tile));
         }
     }
@@ -467,6 +1874,7 @@ std::vector<std::unique_ptr<Mesh>> createOriginalFloor() {
             float z = row * tileSize - sideRows * tileSize / 2.0f - 4.5f;
 
             auto tile = createBox(tileSize, tileHeight, tileSize, material, glm::vec3(x, y, z));
+            tile->isStatic = true;
             meshes.push_back(std::move(tile));
         }
     }
@@ -495,139 +1903,3165 @@ std::vector<std::unique_ptr<Mesh>> createOriginalWalls() {
     auto wainscot = createBox(30.0f, 3.0f, 0.1f, wainscotMaterial, glm::vec3(0, 1.5f, -7.4f));
     meshes.push_back(std::move(wainscot));
 
+    for (auto& mesh : meshes) {
+        mesh->isStatic = true;
+        mesh->occluder = true;
+    }
+
     return meshes;
 }
 
-// Shader source code
+// Shader source code. Programs are assembled from these pieces so every
+// stage that shades lights shares one definition of the blocks and the
+// light loop.
+const char* shaderVersion = "#version 330 core\n";
+
+const char* frameDataSource = R"(
+layout (std140) uniform FrameData {
+    mat4 view;
+    mat4 projection;
+    vec4 viewPos;
+    vec4 clusterScale; // x, y = tile size in pixels, z, w = depth slice scale and bias
+    ivec4 clusterDims; // x, y, z = grid size, w = 1 when clustered shading is on
+    mat4 inverseViewProjection;
+};
+)";
+
+const char* objectDataSource = R"(
+struct MaterialData {
+    vec4 color;  // rgb = color, a = roughness
+    vec4 params; // x = metalness, y = opacity
+};
+
+layout (std140) uniform MaterialTable {
+    MaterialData materials[256];
+};
+
+#ifdef INDIRECT_DRAW
+// Multi-draw indirect: one record per draw (per placement for prefab parts),
+// found through a divisor-1 attribute that counts from the draw's baseInstance
+struct ObjectRecord {
+    mat4 modelMatrix;
+    vec4 normalColumns[3];
+    ivec4 info; // x = material index, y = receive shadow, z = LOD fade (float bits)
+};
+
+layout (std430, binding = 0) readonly buffer ObjectRecords {
+    ObjectRecord objects[];
+};
+
+#ifdef VERTEX_STAGE
+layout (location = 8) in int aObjectIndex;
+flat out int ObjectIndex;
+#define OBJECT aObjectIndex
+#else
+flat in int ObjectIndex;
+#define OBJECT ObjectIndex
+#endif
+
+#define model objects[OBJECT].modelMatrix
+#define normalMatrix mat3(objects[OBJECT].normalColumns[0].xyz, objects[OBJECT].normalColumns[1].xyz, objects[OBJECT].normalColumns[2].xyz)
+#define materialIndex objects[OBJECT].info.x
+#define receiveShadow objects[OBJECT].info.y
+#else
+layout (std140) uniform ObjectData {
+    mat4 model;
+    mat3 normalMatrix; // precomputed on the CPU when the node moves
+    int materialIndex;
+    int receiveShadow;
+};
+#endif
+)";
+
 const char* vertexShaderSource = R"(
-#version 330 core
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoord;
 layout (location = 3) in vec3 aColor;
+layout (location = 4) in mat4 aInstance; // prefab placement, identity for regular meshes
+layout (location = 9) in float aLodFade;  // prefab LOD crossfade, 0 otherwise
 
 out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoord;
 out vec3 Color;
-
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+out float ViewDepth;
+flat out float LodFade;
 
 void main() {
-    FragPos = vec3(model * vec4(aPos, 1.0));
-    Normal = mat3(transpose(inverse(model))) * aNormal;
+    // Prefab placements are rigid, so their upper 3x3 transforms normals as is
+    FragPos = vec3(aInstance * (model * vec4(aPos, 1.0)));
+    Normal = mat3(aInstance) * (normalMatrix * aNormal);
     TexCoord = aTexCoord;
     Color = aColor;
-    
-    gl_Position = projection * view * vec4(FragPos, 1.0);
+#ifdef INDIRECT_DRAW
+    ObjectIndex = aObjectIndex;
+    LodFade = intBitsToFloat(objects[OBJECT].info.z);
+#else
+    LodFade = aLodFade;
+#endif
+
+    vec4 viewSpace = view * vec4(FragPos, 1.0);
+    ViewDepth = -viewSpace.z;
+    gl_Position = projection * viewSpace;
+}
+)";
+
+// Light blocks, cluster lists and the light loop, for forward and deferred shading.
+// LightVariants also compiles it with LIGHT_VARIANT for fixed light counts.
+const char* lightingSource = R"(
+struct Light {
+    vec4 position; // xyz = position or direction, w = type (0=directional, 1=point, 2=ambient)
+    vec4 color;    // rgb = color, a = intensity
+    vec4 params;   // x = radius, y = first shadow map layer or -1
+};
+
+layout (std140) uniform LightData {
+    Light lights[10];
+    int numLights;
+};
+
+// Shadow maps: one layer per directional light, six (cube faces) per point light
+layout (std140) uniform ShadowData {
+    mat4 shadowMatrices[26];
+    ivec4 shadowInfo; // x = first point light layer, y = shadowed point lights, z = 1 when shadows are on
+};
+uniform sampler2DArrayShadow shadowMaps;
+
+float sampleShadow(int layer, vec3 fragPos, vec3 norm) {
+    if(layer < 0 || shadowInfo.z == 0) return 1.0;
+
+    // Normal offset plus a small constant bias against acne
+    vec4 clip = shadowMatrices[layer] * vec4(fragPos + norm * 0.04, 1.0);
+    vec3 coord = clip.xyz / clip.w * 0.5 + 0.5;
+    if(any(lessThan(coord, vec3(0.0))) || any(greaterThan(coord, vec3(1.0)))) return 1.0;
+    return texture(shadowMaps, vec4(coord.xy, float(layer), coord.z - 0.001));
+}
+
+// Picks the cube face by the major axis, matching the face order the maps were rendered in
+float pointShadow(int layer, vec3 lightPos, vec3 fragPos, vec3 norm) {
+    if(layer < 0) return 1.0;
+    vec3 d = fragPos - lightPos;
+    vec3 a = abs(d);
+    int face = (a.x >= a.y && a.x >= a.z) ? (d.x > 0.0 ? 0 : 1) : (a.y >= a.z ? (d.y > 0.0 ? 2 : 3) : (d.z > 0.0 ? 4 : 5));
+    return sampleShadow(layer + face, fragPos, norm);
+}
+
+// Clustered shading: point lights, froxel grid and per-froxel light lists
+uniform samplerBuffer clusterLights;   // two texels per point light: position/radius, color/intensity
+uniform usamplerBuffer clusterGrid;    // per froxel: offset into clusterIndices, light count
+uniform usamplerBuffer clusterIndices; // point light indices
+
+vec3 shadePointLight(vec3 fragPos, vec3 position, float radius, vec3 lightColor, vec3 norm, vec3 viewDir, float metalness) {
+    vec3 lightDir = normalize(position - fragPos);
+    float distance = length(position - fragPos);
+    float attenuation = 1.0 / (1.0 + 0.09 * distance + 0.032 * (distance * distance));
+
+    // Windowed falloff so the light ends exactly at its radius
+    float window = clamp(1.0 - pow(distance / radius, 4.0), 0.0, 1.0);
+    attenuation *= window * window;
+
+    float diff = max(dot(norm, lightDir), 0.0);
+    vec3 reflectDir = reflect(-lightDir, norm);
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
+
+    return lightColor * (diff + spec * metalness) * attenuation;
+}
+
+vec3 shadeDirectionalLight(Light light, vec3 fragPos, vec3 norm, bool shadowed) {
+    vec3 lightDir = normalize(-light.position.xyz);
+    float diff = max(dot(norm, lightDir), 0.0);
+    float shadow = shadowed ? sampleShadow(int(light.params.y), fragPos, norm) : 1.0;
+    return light.color.rgb * light.color.a * diff * shadow;
+}
+
+vec3 shadeBlockPointLight(Light light, vec3 fragPos, vec3 norm, vec3 viewDir, float metalness, bool shadowed) {
+    float shadow = shadowed ? pointShadow(int(light.params.y), light.position.xyz, fragPos, norm) : 1.0;
+    return shadow * shadePointLight(fragPos, light.position.xyz, light.params.x, light.color.rgb * light.color.a, norm, viewDir, metalness);
+}
+
+vec3 shadeLights(vec3 fragPos, vec3 norm, float viewDepth, float metalness, bool shadowed) {
+    vec3 viewDir = normalize(viewPos.xyz - fragPos);
+    vec3 result = vec3(0.0);
+
+#ifdef LIGHT_VARIANT
+    // Specialized for the light block's contents (see LightConfig): ambient,
+    // directional and point lights in that order, so every loop has a
+    // constant trip count and no per-light type branch
+    const int DIRECTIONAL_START = AMBIENT_LIGHTS;
+    const int POINT_START = AMBIENT_LIGHTS + DIRECTIONAL_LIGHTS;
+    for(int i = 0; i < AMBIENT_LIGHTS; i++) {
+        result += lights[i].color.rgb * lights[i].color.a;
+    }
+    for(int i = DIRECTIONAL_START; i < DIRECTIONAL_START + DIRECTIONAL_LIGHTS; i++) {
+        result += shadeDirectionalLight(lights[i], fragPos, norm, shadowed);
+    }
+    for(int i = POINT_START; i < POINT_START + POINT_LIGHTS; i++) {
+        result += shadeBlockPointLight(lights[i], fragPos, norm, viewDir, metalness, shadowed);
+    }
+    const bool clustered = CLUSTERED_LIGHTS != 0;
+#else
+    bool clustered = clusterDims.w != 0;
+    for(int i = 0; i < numLights && i < 10; i++) {
+        int type = int(lights[i].position.w);
+        if(clustered && type == 1) continue; // Point lights come from the cluster lists
+
+        if(type == 2) { // Ambient
+            result += lights[i].color.rgb * lights[i].color.a;
+        }
+        else if(type == 0) { // Directional
+            result += shadeDirectionalLight(lights[i], fragPos, norm, shadowed);
+        }
+        else if(type == 1) { // Point
+            result += shadeBlockPointLight(lights[i], fragPos, norm, viewDir, metalness, shadowed);
+        }
+    }
+#endif
+
+    if(clustered) {
+        ivec2 tile = ivec2(gl_FragCoord.xy / clusterScale.xy);
+        int slice = int(max(log(viewDepth) * clusterScale.z + clusterScale.w, 0.0));
+        tile = min(tile, clusterDims.xy - 1);
+        slice = min(slice, clusterDims.z - 1);
+        int cluster = (slice * clusterDims.y + tile.y) * clusterDims.x + tile.x;
+
+        uvec2 range = texelFetch(clusterGrid, cluster).xy;
+        for(uint i = 0u; i < range.y; i++) {
+            int light = int(texelFetch(clusterIndices, int(range.x + i)).x);
+            vec4 positionRadius = texelFetch(clusterLights, light * 2);
+            vec4 colorIntensity = texelFetch(clusterLights, light * 2 + 1);
+            int layer = light < shadowInfo.y ? shadowInfo.x + light * 6 : -1;
+            float shadow = shadowed ? pointShadow(layer, positionRadius.xyz, fragPos, norm) : 1.0;
+            result += shadow * shadePointLight(fragPos, positionRadius.xyz, positionRadius.w, colorIntensity.rgb * colorIntensity.a, norm, viewDir, metalness);
+        }
+    }
+
+    return result;
+}
+)";
+
+// LOD crossfade as an ordered 4x4 dither: fade t > 0 keeps the pixels whose
+// threshold is below t and -t keeps the rest, so during a transition the
+// incoming and outgoing levels together cover each pixel exactly once
+const char* lodDitherSource = R"(
+flat in float LodFade;
+
+bool lodDitherDiscard() {
+    if(LodFade == 0.0) return false;
+    const float bayer[16] = float[16](0.0, 8.0, 2.0, 10.0, 12.0, 4.0, 14.0, 6.0, 3.0, 11.0, 1.0, 9.0, 15.0, 7.0, 13.0, 5.0);
+    ivec2 pixel = ivec2(gl_FragCoord.xy) & 3;
+    float threshold = (bayer[pixel.y * 4 + pixel.x] + 0.5) / 16.0;
+    return LodFade > 0.0 ? threshold >= LodFade : threshold < -LodFade;
 }
 )";
 
 const char* fragmentShaderSource = R"(
-#version 330 core
 out vec4 FragColor;
 
 in vec3 FragPos;
 in vec3 Normal;
 in vec2 TexCoord;
 in vec3 Color;
+in float ViewDepth;
 
-struct Light {
-    int type; // 0=directional, 1=point, 2=ambient
-    vec3 position;
-    vec3 color;
-    float intensity;
-};
+void main() {
+    if(lodDitherDiscard()) discard;
+    vec3 albedo = Color * materials[materialIndex].color.rgb;
+    float metalness = materials[materialIndex].params.x;
+    float opacity = materials[materialIndex].params.y;
+
+    vec3 result = shadeLights(FragPos, normalize(Normal), ViewDepth, metalness, receiveShadow != 0);
+    FragColor = vec4(result * albedo, opacity);
+}
+)";
+
+// Deferred geometry pass: surface attributes only, no lighting
+const char* gbufferFragmentSource = R"(
+layout (location = 0) out vec4 GAlbedo; // rgb = albedo, a = metalness
+layout (location = 1) out vec4 GNormal; // xyz = world normal, w = roughness (negative: ignores shadows)
 
-uniform Light lights[10];
-uniform int numLights;
-uniform vec3 viewPos;
-uniform float roughness;
-uniform float metalness;
-uniform float opacity;
+in vec3 FragPos;
+in vec3 Normal;
+in vec2 TexCoord;
+in vec3 Color;
+in float ViewDepth;
 
 void main() {
-    vec3 norm = normalize(Normal);
-    vec3 viewDir = normalize(viewPos - FragPos);
-    
-    vec3 result = vec3(0.0);
-    
-    for(int i = 0; i < numLights && i < 10; i++) {
-        if(lights[i].type == 2) { // Ambient
-            result += lights[i].color * lights[i].intensity;
+    if(lodDitherDiscard()) discard;
+    GAlbedo = vec4(Color * materials[materialIndex].color.rgb, materials[materialIndex].params.x);
+    float roughness = materials[materialIndex].color.a;
+    GNormal = vec4(normalize(Normal), receiveShadow != 0 ? roughness : -1.0 - roughness);
+}
+)";
+
+// Fullscreen triangle from gl_VertexID, no vertex buffers needed
+const char* fullscreenVertexSource = R"(
+void main() {
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+// Deferred lighting pass: rebuild position from depth and run the same light
+// loop as the forward shader (clustered lists act as screen-space tiles)
+const char* deferredLightingSource = R"(
+out vec4 FragColor;
+
+uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if(depth >= 1.0) discard; // background keeps the clear color
+
+    vec4 albedoMetal = texelFetch(gAlbedo, pixel, 0);
+    vec4 normalRoughness = texelFetch(gNormal, pixel, 0);
+    vec3 norm = normalize(normalRoughness.xyz);
+
+    vec2 ndc = gl_FragCoord.xy / vec2(textureSize(gDepth, 0)) * 2.0 - 1.0;
+    vec4 world = inverseViewProjection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+    vec3 fragPos = world.xyz / world.w;
+    float viewDepth = -(view * vec4(fragPos, 1.0)).z;
+
+    vec3 result = shadeLights(fragPos, norm, viewDepth, albedoMetal.a, normalRoughness.w >= 0.0);
+    FragColor = vec4(result * albedoMetal.rgb, 1.0);
+
+    // Forward-drawn transparent surfaces test against the opaque depth
+    gl_FragDepth = depth;
+}
+)";
+
+// Depth-only pass into a shadow map layer; prefab placements come from aInstance
+const char* shadowVertexSource = R"(
+layout (location = 0) in vec3 aPos;
+layout (location = 4) in mat4 aInstance;
+
+uniform mat4 lightMatrix;
+
+void main() {
+    gl_Position = lightMatrix * (aInstance * (model * vec4(aPos, 1.0)));
+}
+)";
+
+const char* shadowFragmentSource = R"(
+void main() {
+}
+)";
+
+// Shader programs. Every program is requested during startup before any
+// is configured, so the driver builds them in parallel or loads them from
+// the program cache; each subsystem finishes its own before first use.
+shadercache::ProgramCache programCache;
+
+GLuint createShaderProgram(const std::string& vertexSource, const std::string& fragmentSource) {
+    return programCache.request(vertexSource, fragmentSource);
+}
+
+GLuint createComputeProgram(const std::string& source) {
+    return programCache.requestCompute(source);
+}
+
+// Uniform buffer objects (std140). Sizes must match the blocks in the shaders.
+const int MAX_LIGHTS = 10;
+const int MAX_MATERIALS = 256;
+const int MAX_SHADOWED_DIRECTIONAL = 2;
+const int MAX_SHADOWED_POINT = 4;
+const int MAX_SHADOW_LAYERS = MAX_SHADOWED_DIRECTIONAL + 6 * MAX_SHADOWED_POINT;
+
+// Shadow map layer assignment, shared by the light upload and the shadow
+// renderer: directional lights first (one layer each), then six per point
+// light. Returns each light's first layer in scene order, -1 for none.
+std::vector<int> shadowLayers(const std::vector<Light>& lights, int* directionalCount = nullptr, int* pointCount = nullptr) {
+    int directional = 0, point = 0;
+    for (const Light& light : lights) {
+        if (light.type == 0) directional++;
+        else if (light.type == 1) point++;
+    }
+    directional = std::min(directional, MAX_SHADOWED_DIRECTIONAL);
+    point = std::min(point, MAX_SHADOWED_POINT);
+    if (directionalCount) *directionalCount = directional;
+    if (pointCount) *pointCount = point;
+
+    std::vector<int> layers(lights.size(), -1);
+    int directionalIndex = 0, pointIndex = 0;
+    for (size_t i = 0; i < lights.size(); ++i) {
+        if (lights[i].type == 0 && directionalIndex < directional) layers[i] = directionalIndex++;
+        else if (lights[i].type == 1 && pointIndex < point) layers[i] = directional + 6 * pointIndex++;
+    }
+    return layers;
+}
+
+// Scene indices in light block order: ambient, then directional, then point
+// lights, so a long list of point lights (served by the clustered path)
+// never pushes the others past the cap, and each type is one contiguous run
+std::vector<size_t> lightBlockOrder(const std::vector<Light>& lights) {
+    std::vector<size_t> ordered;
+    for (int type : { 2, 0, 1 }) {
+        for (size_t i = 0; i < lights.size() && ordered.size() < (size_t)MAX_LIGHTS; ++i) {
+            if (lights[i].type == type) ordered.push_back(i);
+        }
+    }
+    return ordered;
+}
+
+// What a specialized lighting shader is compiled for: the number of each
+// light type in the light block, and whether point lights come from the
+// cluster lists instead (their block count is then irrelevant and kept 0).
+// Intensities and positions stay uniforms, so the L key needs no rebuild.
+struct LightConfig {
+    int ambient = 0, directional = 0, point = 0;
+    bool clustered = false;
+
+    static LightConfig of(const std::vector<Light>& lights, bool clustered) {
+        LightConfig config;
+        config.clustered = clustered;
+        for (size_t index : lightBlockOrder(lights)) {
+            if (lights[index].type == 2) config.ambient++;
+            else if (lights[index].type == 0) config.directional++;
+            else if (lights[index].type == 1 && !clustered) config.point++;
         }
-        else if(lights[i].type == 0) { // Directional
-            vec3 lightDir = normalize(-lights[i].position);
-            float diff = max(dot(norm, lightDir), 0.0);
-            result += lights[i].color * lights[i].intensity * diff;
+        return config;
+    }
+
+    int key() const {
+        return ((ambient * (MAX_LIGHTS + 1) + directional) * (MAX_LIGHTS + 1) + point) * 2 + (clustered ? 1 : 0);
+    }
+
+    std::string defines() const {
+        char text[160];
+        snprintf(text, sizeof(text), "#define LIGHT_VARIANT\n#define AMBIENT_LIGHTS %d\n#define DIRECTIONAL_LIGHTS %d\n"
+            "#define POINT_LIGHTS %d\n#define CLUSTERED_LIGHTS %d\n", ambient, directional, point, clustered ? 1 : 0);
+        return text;
+    }
+};
+
+// A lighting program plus its variants by LightConfig. The generic program
+// branches on each light's type and runs any configuration; variants are
+// requested the first time their configuration shows up, build in the
+// background (KHR_parallel_shader_compile) and take over once linked.
+// Built variants stay, so switching back to a configuration is free.
+class LightVariants {
+public:
+    GLuint generic = 0;
+    GLuint active = 0; // what the last select() picked
+
+    void request(const std::string& vertex, const std::string& header, const std::string& body, void (*configureProgram)(GLuint)) {
+        vertexSource = vertex;
+        fragmentHeader = header;
+        fragmentBody = body;
+        configure = configureProgram;
+        generic = active = createShaderProgram(vertexSource, fragmentHeader + fragmentBody);
+    }
+
+    void init() {
+        programCache.finish(generic);
+        configure(generic);
+    }
+
+    // wait: block until the variant is built instead of drawing with the
+    // generic program meanwhile (benchmarks measure the variant)
+    GLuint select(const LightConfig& config, bool wait) {
+        Variant& variant = variants[config.key()];
+        if (!variant.program) {
+            variant.program = createShaderProgram(vertexSource, fragmentHeader + config.defines() + fragmentBody);
         }
-        else if(lights[i].type == 1) { // Point
-            vec3 lightDir = normalize(lights[i].position - FragPos);
-            float distance = length(lights[i].position - FragPos);
-            float attenuation = 1.0 / (1.0 + 0.09 * distance + 0.032 * (distance * distance));
-            
-            float diff = max(dot(norm, lightDir), 0.0);
-            vec3 reflectDir = reflect(-lightDir, norm);
-            float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
-            
-            result += lights[i].color * lights[i].intensity * (diff + spec * metalness) * attenuation;
+        if (!variant.linked && !variant.failed && (wait || programCache.ready(variant.program))) {
+            programCache.finish(variant.program);
+            GLint linked = 0;
+            glGetProgramiv(variant.program, GL_LINK_STATUS, &linked);
+            if (linked) configure(variant.program);
+            variant.linked = linked != 0;
+            variant.failed = !linked;
         }
+        active = variant.linked ? variant.program : generic;
+        return active;
     }
-    
-    FragColor = vec4(result * Color, opacity);
-}
-)";
 
-// Shader compilation
-GLuint compileShader(const char* source, GLenum type) {
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, NULL);
-    glCompileShader(shader);
+    void useGeneric() {
+        active = generic;
+    }
 
-    int success;
-    char infoLog[512];
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        std::cout << "Shader compilation failed: " << infoLog << std::endl;
+    int built() const {
+        int count = 0;
+        for (const auto& variant : variants) count += variant.second.linked ? 1 : 0;
+        return count;
     }
 
-    return shader;
-}
+    void destroy() {
+        for (auto& variant : variants) glDeleteProgram(programCache.finish(variant.second.program));
+        variants.clear();
+        if (generic) glDeleteProgram(generic);
+        generic = active = 0;
+    }
+
+private:
+    struct Variant {
+        GLuint program = 0;
+        bool linked = false;
+        bool failed = false;
+    };
+
+    std::string vertexSource, fragmentHeader, fragmentBody;
+    void (*configure)(GLuint) = nullptr;
+    std::map<int, Variant> variants;
+};
+
+enum UniformBinding {
+    FRAME_BINDING = 0,
+    LIGHT_BINDING = 1,
+    MATERIAL_BINDING = 2,
+    OBJECT_BINDING = 3,
+    SHADOW_BINDING = 4
+};
 
-GLuint createShaderProgram() {
-    GLuint vertexShader = compileShader(vertexShaderSource, GL_VERTEX_SHADER);
-    GLuint fragmentShader = compileShader(fragmentShaderSource, GL_FRAGMENT_SHADER);
+struct FrameUniforms {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec4 viewPos;
+    glm::vec4 clusterScale; // tile size in pixels, depth slice scale and bias
+    int clusterDims[4];     // grid size, clustered flag
+    glm::mat4 inverseViewProjection;
+};
+
+struct LightUniforms {
+    struct {
+        glm::vec4 position; // w = type
+        glm::vec4 color;    // a = intensity
+        glm::vec4 params;   // x = radius, y = first shadow layer
+    } lights[MAX_LIGHTS];
+    int numLights;
+    int padding[3];
+};
+
+struct MaterialUniforms {
+    glm::vec4 color;  // a = roughness
+    glm::vec4 params; // x = metalness, y = opacity
+};
+
+struct ObjectUniforms {
+    glm::mat4 model;
+    glm::vec4 normalMatrix[3]; // std140 mat3: three vec4-aligned columns
+    int materialIndex;
+    int receiveShadow;
+    float lodFade; // indirect records only; direct draws read the instance attribute
+    int padding;
+};
+
+struct ShadowUniforms {
+    glm::mat4 matrices[MAX_SHADOW_LAYERS];
+    int info[4]; // first point light layer, shadowed point lights, enabled
+};
+
+class UniformBuffers {
+public:
+    GLuint frameUBO = 0, lightUBO = 0, materialUBO = 0, objectUBO = 0;
+    GLsizeiptr objectStride = 0; // sizeof(ObjectUniforms) rounded up to the offset alignment
+    std::vector<ObjectUniforms> objectRecords; // CPU copy by Mesh::objectSlot, for the indirect path
+    unsigned int uploadedLightsVersion = ~0u;
+
+    // GLSL 330 has no binding qualifier, so assign block bindings per program
+    static void bindBlocks(GLuint program) {
+        const char* names[] = { "FrameData", "LightData", "MaterialTable", "ObjectData", "ShadowData" };
+        const UniformBinding bindings[] = { FRAME_BINDING, LIGHT_BINDING, MATERIAL_BINDING, OBJECT_BINDING, SHADOW_BINDING };
+        for (int i = 0; i < 5; ++i) {
+            GLuint index = glGetUniformBlockIndex(program, names[i]);
+            if (index != GL_INVALID_INDEX) glUniformBlockBinding(program, index, bindings[i]);
+        }
+    }
+
+    void init() {
+        frameUBO = createBuffer(sizeof(FrameUniforms), GL_STREAM_DRAW);
+        lightUBO = createBuffer(sizeof(LightUniforms), GL_DYNAMIC_DRAW);
+        materialUBO = createBuffer(MAX_MATERIALS * sizeof(MaterialUniforms), GL_STATIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BINDING, frameUBO);
+        glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BINDING, lightUBO);
+        glBindBufferBase(GL_UNIFORM_BUFFER, MATERIAL_BINDING, materialUBO);
+
+        GLint alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        objectStride = ((sizeof(ObjectUniforms) + alignment - 1) / alignment) * alignment;
+        glGenBuffers(1, &objectUBO);
+    }
+
+    void destroy() {
+        GLuint buffers[] = { frameUBO, lightUBO, materialUBO, objectUBO };
+        glDeleteBuffers(4, buffers);
+    }
+
+    // Once per frame: camera matrices, eye position and the cluster grid layout
+    void uploadFrame(Camera& camera, const glm::vec4& clusterScale, const glm::ivec4& clusterDims) {
+        FrameUniforms frame;
+        frame.view = camera.getViewMatrix();
+        frame.projection = camera.getProjectionMatrix();
+        frame.viewPos = glm::vec4(camera.position, 1.0f);
+        frame.clusterScale = clusterScale;
+        frame.clusterDims[0] = clusterDims.x;
+        frame.clusterDims[1] = clusterDims.y;
+        frame.clusterDims[2] = clusterDims.z;
+        frame.clusterDims[3] = clusterDims.w;
+        frame.inverseViewProjection = glm::inverse(frame.projection * frame.view);
+        glBindBuffer(GL_UNIFORM_BUFFER, frameUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+    }
+
+    // Only when Scene::lightsVersion has moved on (addLight, toggleLighting)
+    void uploadLights(const Scene& scene) {
+        if (uploadedLightsVersion == scene.lightsVersion) return;
+
+        std::vector<size_t> ordered = lightBlockOrder(scene.lights);
+        std::vector<int> layers = shadowLayers(scene.lights);
+
+        LightUniforms block = {};
+        block.numLights = (int)ordered.size();
+        for (int i = 0; i < block.numLights; ++i) {
+            const Light& light = scene.lights[ordered[i]];
+            block.lights[i].position = glm::vec4(light.position, (float)light.type);
+            block.lights[i].color = glm::vec4(light.color, light.intensity);
+            block.lights[i].params = glm::vec4(light.radius, (float)layers[ordered[i]], 0.0f, 0.0f);
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, lightUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightUniforms), &block);
+        uploadedLightsVersion = scene.lightsVersion;
+    }
+
+    // Only when Scene::objectsDirty: assigns every mesh an object slot and a
+    // material index, then uploads the per-object records and material table.
+    void uploadObjects(Scene& scene) {
+        PROFILE_SCOPE("UniformBuffers::uploadObjects");
+        if (!scene.objectsDirty) return;
+
+        std::vector<Mesh*> objects;
+        for (auto& batch : scene.staticBatches) objects.push_back(batch.get());
+        for (auto& mesh : scene.meshes) objects.push_back(mesh.get());
+        for (auto& prefab : scene.prefabs) {
+            for (auto& part : prefab->parts) objects.push_back(part.get());
+        }
+
+        std::map<std::tuple<float, float, float, float, float, float>, int> materialIndices;
+        std::vector<MaterialUniforms> materials;
+        std::vector<unsigned char> records(objects.size() * objectStride);
+        objectRecords.resize(objects.size());
+
+        for (size_t i = 0; i < objects.size(); ++i) {
+            Mesh* mesh = objects[i];
+            const Material& m = mesh->material;
+            auto key = std::make_tuple(m.color.x, m.color.y, m.color.z, m.roughness, m.metalness, m.opacity);
+            auto found = materialIndices.find(key);
+            if (found == materialIndices.end()) {
+                if ((int)materials.size() == MAX_MATERIALS) {
+                    std::cout << "Material table full, reusing entry 0" << std::endl;
+                    found = materialIndices.emplace(key, 0).first;
+                }
+                else {
+                    found = materialIndices.emplace(key, (int)materials.size()).first;
+                    materials.push_back({ glm::vec4(m.color, m.roughness), glm::vec4(m.metalness, m.opacity, 0.0f, 0.0f) });
+                }
+            }
+
+            mesh->objectSlot = (int)i;
+            mesh->materialIndex = found->second;
+
+            // Scene nodes cache their normal matrix; batches and prefab parts
+            // never move, so theirs is computed here once per upload
+            glm::mat3 normalMatrix = mesh->node ? mesh->node->normalMatrix
+                : glm::mat3(glm::transpose(glm::inverse(mesh->transform)));
+
+            ObjectUniforms object = {};
+            object.model = mesh->transform * mesh->geometry->dequantize;
+            for (int column = 0; column < 3; ++column) {
+                object.normalMatrix[column] = glm::vec4(normalMatrix[column], 0.0f);
+            }
+            object.materialIndex = mesh->materialIndex;
+            object.receiveShadow = mesh->receiveShadow ? 1 : 0;
+            memcpy(&records[i * objectStride], &object, sizeof(object));
+            objectRecords[i] = object;
+        }
+
+        glBindBuffer(GL_UNIFORM_BUFFER, materialUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, materials.size() * sizeof(MaterialUniforms), materials.data());
+        glBindBuffer(GL_UNIFORM_BUFFER, objectUBO);
+        glBufferData(GL_UNIFORM_BUFFER, records.size(), records.data(), GL_STATIC_DRAW);
+        scene.objectsDirty = false;
+    }
+
+    // The whole per-draw uniform cost: one offset bind
+    void bindObject(const Mesh& mesh) {
+        glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BINDING, objectUBO, mesh.objectSlot * objectStride, sizeof(ObjectUniforms));
+    }
+
+private:
+    GLuint createBuffer(GLsizeiptr size, GLenum usage) {
+        GLuint buffer;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferData(GL_UNIFORM_BUFFER, size, NULL, usage);
+        return buffer;
+    }
+};
+
+// Clustered forward lighting: the view frustum is split into a froxel grid
+// (screen tiles x exponential depth slices), every point light is assigned
+// to the froxels its radius touches, and the fragment shader walks only its
+// froxel's list. Lists live in texture buffers, which GL 3.3 core provides
+// (SSBOs would need 4.3). Assignment runs on the CPU, split by depth slice
+// across a pool of worker threads (started the first time there are enough
+// lights, kept until destroy()) so no two threads write the same froxel.
+class ClusteredLighting {
+public:
+    static const int TILES_X = 16, TILES_Y = 9, SLICES = 24;
+    static const int CLUSTER_COUNT = TILES_X * TILES_Y * SLICES;
+    static const int MAX_LIGHTS_PER_CLUSTER = 256;
+    float clusterFar = 100.0f; // froxels stop here; farther fragments use the last slice
+
+    // Texture units 0..3 are left for material textures
+    enum { LIGHT_UNIT = 4, GRID_UNIT = 5, INDEX_UNIT = 6 };
+
+    size_t assignedLights = 0; // light/froxel pairs in the last update
+
+    static void bindSamplers(GLuint program) {
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "clusterLights"), LIGHT_UNIT);
+        glUniform1i(glGetUniformLocation(program, "clusterGrid"), GRID_UNIT);
+        glUniform1i(glGetUniformLocation(program, "clusterIndices"), INDEX_UNIT);
+        glUseProgram(0);
+    }
+
+    void init() {
+        createBufferTexture(lightBuffer, lightTexture, GL_RGBA32F);
+        createBufferTexture(gridBuffer, gridTexture, GL_RG32UI);
+        createBufferTexture(indexBuffer, indexTexture, GL_R32UI);
+    }
+
+    void destroy() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+
+        GLuint buffers[] = { lightBuffer, gridBuffer, indexBuffer };
+        GLuint textures[] = { lightTexture, gridTexture, indexTexture };
+        glDeleteBuffers(3, buffers);
+        glDeleteTextures(3, textures);
+    }
+
+    // Frame uniforms the fragment shader needs to find its froxel
+    glm::vec4 scale(int width, int height, const Camera& camera) const {
+        float logRange = logf(clusterFar / camera.nearPlane);
+        return glm::vec4((float)width / TILES_X, (float)height / TILES_Y,
+            SLICES / logRange, -SLICES * logf(camera.nearPlane) / logRange);
+    }
+
+    void update(const Scene& scene, Camera& camera) {
+        PROFILE_SCOPE("ClusteredLighting::update");
+        // Point lights in world space, re-uploaded only when lights change
+        if (uploadedLightsVersion != scene.lightsVersion) {
+            pointLights.clear();
+            std::vector<glm::vec4> texels;
+            for (const Light& light : scene.lights) {
+                if (light.type != 1) continue;
+                pointLights.push_back(light);
+                texels.push_back(glm::vec4(light.position, light.radius));
+                texels.push_back(glm::vec4(light.color, light.intensity));
+            }
+            upload(lightBuffer, texels.size() * sizeof(glm::vec4), texels.data());
+            uploadedLightsVersion = scene.lightsVersion;
+        }
+
+        buildFroxels(camera);
+
+        // Light spheres in view space
+        glm::mat4 view = camera.getViewMatrix();
+        viewLights.resize(pointLights.size());
+        for (size_t i = 0; i < pointLights.size(); ++i) {
+            glm::vec3 center = glm::vec3(view * glm::vec4(pointLights[i].position, 1.0f));
+            viewLights[i] = glm::vec4(center, pointLights[i].radius);
+        }
+
+        // Assign by depth slice; small light counts are not worth the threads
+        for (auto& list : clusterLists) list.clear();
+        if (pointLights.size() < 32) {
+            assignSlices(0, SLICES);
+        }
+        else {
+            if (workers.empty()) startWorkers();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                generation++;
+                pending = (int)workers.size();
+            }
+            wake.notify_all();
+            assignChunk(0); // the calling thread takes the first chunk
+            std::unique_lock<std::mutex> lock(mutex);
+            idle.wait(lock, [&] { return pending == 0; });
+        }
+
+        // Flatten into (offset, count) per froxel plus one index list
+        grid.resize(CLUSTER_COUNT * 2);
+        indices.clear();
+        for (int c = 0; c < CLUSTER_COUNT; ++c) {
+            grid[c * 2] = (GLuint)indices.size();
+            grid[c * 2 + 1] = (GLuint)clusterLists[c].size();
+            indices.insert(indices.end(), clusterLists[c].begin(), clusterLists[c].end());
+        }
+        if (indices.empty()) indices.push_back(0); // keep the buffer texture non-empty
+        assignedLights = indices.size();
+
+        upload(gridBuffer, grid.size() * sizeof(GLuint), grid.data());
+        upload(indexBuffer, indices.size() * sizeof(GLuint), indices.data());
+    }
+
+    void bind() {
+        glActiveTexture(GL_TEXTURE0 + LIGHT_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, lightTexture);
+        glActiveTexture(GL_TEXTURE0 + GRID_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, gridTexture);
+        glActiveTexture(GL_TEXTURE0 + INDEX_UNIT);
+        glBindTexture(GL_TEXTURE_BUFFER, indexTexture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+private:
+    GLuint lightBuffer = 0, gridBuffer = 0, indexBuffer = 0;
+    GLuint lightTexture = 0, gridTexture = 0, indexTexture = 0;
+    unsigned int uploadedLightsVersion = ~0u;
+
+    std::vector<Light> pointLights;
+    std::vector<glm::vec4> viewLights; // xyz = view-space center, w = radius
+    std::vector<AABB> froxels;         // view-space bounds per froxel
+    std::vector<std::vector<GLuint>> clusterLists = std::vector<std::vector<GLuint>>(CLUSTER_COUNT);
+    std::vector<GLuint> grid, indices;
+    float froxelFov = 0.0f, froxelAspect = 0.0f, froxelNear = 0.0f, froxelFar = 0.0f;
+
+    // Assignment workers; each update bumps the generation and waits until
+    // every worker has finished its chunk of slices
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+    unsigned int generation = 0;
+    int pending = 0;
+    bool stopping = false;
+
+    void startWorkers() {
+        int threadCount = (int)std::max(1u, std::min(std::thread::hardware_concurrency(), 8u));
+        stopping = false;
+        for (int t = 1; t < threadCount; ++t) workers.emplace_back(&ClusteredLighting::work, this, t);
+    }
+
+    void work(int chunk) {
+        PROFILE_THREAD_NAME("light assignment");
+        unsigned int seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) break;
+            seen = generation;
+            lock.unlock();
+            assignChunk(chunk);
+            lock.lock();
+            if (--pending == 0) idle.notify_one();
+        }
+    }
+
+    // Chunk 0 is the calling thread's, 1..workers.size() the workers'
+    void assignChunk(int chunk) {
+        int threadCount = (int)workers.size() + 1;
+        int slicesPerThread = (SLICES + threadCount - 1) / threadCount;
+        int begin = chunk * slicesPerThread;
+        int end = std::min((int)SLICES, begin + slicesPerThread);
+        if (begin < end) assignSlices(begin, end);
+    }
+
+    // Froxel bounds depend only on the projection, so rebuild them when it changes
+    void buildFroxels(const Camera& camera) {
+        if (froxelFov == camera.fov && froxelAspect == camera.aspect && froxelNear == camera.nearPlane && froxelFar == clusterFar) return;
+        froxelFov = camera.fov;
+        froxelAspect = camera.aspect;
+        froxelNear = camera.nearPlane;
+        froxelFar = clusterFar;
+
+        float tanY = tanf(glm::radians(camera.fov) * 0.5f);
+        float tanX = tanY * camera.aspect;
+        froxels.resize(CLUSTER_COUNT);
+        for (int z = 0; z < SLICES; ++z) {
+            float nearDepth = camera.nearPlane * powf(clusterFar / camera.nearPlane, (float)z / SLICES);
+            float farDepth = camera.nearPlane * powf(clusterFar / camera.nearPlane, (float)(z + 1) / SLICES);
+            if (z == SLICES - 1) farDepth = camera.farPlane;
+            for (int y = 0; y < TILES_Y; ++y) {
+                for (int x = 0; x < TILES_X; ++x) {
+                    AABB box;
+                    for (float depth : { nearDepth, farDepth }) {
+                        for (int corner = 0; corner < 4; ++corner) {
+                            float ndcX = -1.0f + 2.0f * (x + (corner & 1)) / TILES_X;
+                            float ndcY = -1.0f + 2.0f * (y + (corner >> 1)) / TILES_Y;
+                            box.expand(glm::vec3(ndcX * tanX * depth, ndcY * tanY * depth, -depth));
+                        }
+                    }
+                    froxels[(z * TILES_Y + y) * TILES_X + x] = box;
+                }
+            }
+        }
+    }
+
+    void assignSlices(int sliceBegin, int sliceEnd) {
+        PROFILE_SCOPE("ClusteredLighting::assignSlices");
+        const int tilesPerSlice = TILES_X * TILES_Y;
+        for (int z = sliceBegin; z < sliceEnd; ++z) {
+            // Slice depth range from any froxel in the slice
+            const AABB& sliceBox = froxels[z * tilesPerSlice];
+            for (size_t l = 0; l < viewLights.size(); ++l) {
+                const glm::vec4& sphere = viewLights[l];
+                if (sphere.z - sphere.w > sliceBox.max.z || sphere.z + sphere.w < sliceBox.min.z) continue;
+
+                for (int t = 0; t < tilesPerSlice; ++t) {
+                    int cluster = z * tilesPerSlice + t;
+                    const AABB& box = froxels[cluster];
+                    glm::vec3 closest = glm::clamp(glm::vec3(sphere), box.min, box.max);
+                    glm::vec3 d = closest - glm::vec3(sphere);
+                    if (glm::dot(d, d) <= sphere.w * sphere.w && clusterLists[cluster].size() < MAX_LIGHTS_PER_CLUSTER) {
+                        clusterLists[cluster].push_back((GLuint)l);
+                    }
+                }
+            }
+        }
+    }
+
+    static void createBufferTexture(GLuint& buffer, GLuint& texture, GLenum format) {
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+
+    // Orphan and refill; the texture view follows the buffer's new storage
+    static void upload(GLuint buffer, size_t bytes, const void* data) {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, std::max(bytes, (size_t)16), NULL, GL_STREAM_DRAW);
+        if (bytes > 0) glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+    }
+};
+
+// Shadow maps for the directional and point lights, all layers of one depth
+// texture array (see shadowLayers()). Static casters are rendered into a
+// cached array only when a shadowed light moves or static geometry changes.
+// Dynamic casters are composited each frame onto a copy of that cache; with
+// none in the scene the cache is sampled directly, so a still room costs
+// only the shadow lookups.
+class ShadowMaps {
+public:
+    static const int SIZE = 512;
+    enum { SHADOW_UNIT = 10 }; // after the cluster and G-buffer units
+
+    bool enabled = true;
+    size_t staticRenders = 0; // times the static cache was rebuilt
+
+    static void bindSampler(GLuint program) {
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "shadowMaps"), SHADOW_UNIT);
+        glUseProgram(0);
+    }
+
+    void requestPrograms() {
+        program = createShaderProgram(std::string(shaderVersion) + objectDataSource + shadowVertexSource,
+            std::string(shaderVersion) + shadowFragmentSource);
+    }
+
+    void init() {
+        programCache.finish(program);
+        UniformBuffers::bindBlocks(program);
+        lightMatrixLocation = glGetUniformLocation(program, "lightMatrix");
+
+        glGenBuffers(1, &UBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(ShadowUniforms), NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, SHADOW_BINDING, UBO);
+
+        glGenFramebuffers(1, &FBO);
+        glGenFramebuffers(1, &copyFBO);
+    }
+
+    // Call after UniformBuffers::uploadObjects (casters draw with their object
+    // slots). May leave the shadow framebuffer and viewport bound.
+    void update(const Scene& scene, UniformBuffers& uniforms) {
+        PROFILE_SCOPE("ShadowMaps::update");
+        if (uploadedEnabled != (int)enabled) uploadInfo();
+        if (!enabled) return;
+
+        bool rebuild = builtStaticVersion != scene.staticVersion;
+        if (checkedLightsVersion != scene.lightsVersion) {
+            rebuild = lightsMoved(scene) || rebuild;
+            checkedLightsVersion = scene.lightsVersion;
+        }
+
+        collectCasters(scene);
+        if (rebuild) {
+            computeMatrices(scene);
+            allocate(staticArray, staticLayers);
+            renderLayers(staticArray, true, staticCasters, staticParts, uniforms);
+            builtStaticVersion = scene.staticVersion;
+            staticRenders++;
+        }
+
+        sampledArray = staticArray;
+        if (layerCount > 0 && (!dynamicCasters.empty() || !dynamicParts.empty())) {
+            allocate(liveArray, liveLayers);
+            copyLayers(staticArray, liveArray);
+            renderLayers(liveArray, false, dynamicCasters, dynamicParts, uniforms);
+            sampledArray = liveArray;
+        }
+    }
+
+    void bind() {
+        glActiveTexture(GL_TEXTURE0 + SHADOW_UNIT);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, sampledArray);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    void destroy() {
+        GLuint textures[] = { staticArray, liveArray };
+        glDeleteTextures(2, textures);
+        GLuint framebuffers[] = { FBO, copyFBO };
+        glDeleteFramebuffers(2, framebuffers);
+        if (UBO) glDeleteBuffers(1, &UBO);
+        if (program) glDeleteProgram(program);
+        staticArray = liveArray = sampledArray = FBO = copyFBO = UBO = program = 0;
+    }
+
+private:
+    GLuint program = 0, UBO = 0, FBO = 0, copyFBO = 0;
+    GLuint staticArray = 0, liveArray = 0, sampledArray = 0;
+    GLint lightMatrixLocation = -1;
+    int layerCount = 0, directionalCount = 0, pointCount = 0;
+    int staticLayers = 0, liveLayers = 0; // layers allocated in each array
+    std::vector<glm::mat4> matrices;
+    std::vector<glm::vec4> shadowedLights; // type/position/radius the cache was built for
+    unsigned int builtStaticVersion = ~0u, checkedLightsVersion = ~0u;
+    int uploadedEnabled = -1;
+
+    std::vector<Mesh*> staticCasters, dynamicCasters;
+    std::vector<std::pair<Prefab*, Mesh*>> staticParts, dynamicParts;
+
+    // Intensity changes (toggleLighting) leave the maps valid; only
+    // position, direction, radius or the set of shadowed lights matter
+    bool lightsMoved(const Scene& scene) {
+        std::vector<int> layers = shadowLayers(scene.lights);
+        std::vector<glm::vec4> current;
+        for (size_t i = 0; i < scene.lights.size(); ++i) {
+            if (layers[i] < 0) continue;
+            const Light& light = scene.lights[i];
+            current.push_back(glm::vec4(light.position, light.type == 1 ? light.radius : 0.0f));
+        }
+        bool moved = current != shadowedLights;
+        shadowedLights = current;
+        return moved;
+    }
+
+    // Static batches stand in for the meshes they merged. Geometry still
+    // uploading is left out; its arrival bumps Scene::staticVersion.
+    void collectCasters(const Scene& scene) {
+        staticCasters.clear();
+        dynamicCasters.clear();
+        staticParts.clear();
+        dynamicParts.clear();
+
+        for (const auto& batch : scene.staticBatches) {
+            if (batch->castShadow && batch->resident()) staticCasters.push_back(batch.get());
+        }
+        for (const auto& mesh : scene.meshes) {
+            if (!mesh->castShadow || mesh->batched || !mesh->resident()) continue;
+            (mesh->isStatic ? staticCasters : dynamicCasters).push_back(mesh.get());
+        }
+        for (const auto& prefab : scene.prefabs) {
+            if (prefab->instances.empty()) continue;
+            for (const auto& part : prefab->parts) {
+                if (!part->castShadow || !part->resident()) continue;
+                (prefab->isStatic ? staticParts : dynamicParts).push_back({ prefab.get(), part.get() });
+            }
+        }
+    }
+
+    void computeMatrices(const Scene& scene) {
+        std::vector<int> layers = shadowLayers(scene.lights, &directionalCount, &pointCount);
+        layerCount = directionalCount + 6 * pointCount;
+        matrices.assign(MAX_SHADOW_LAYERS, glm::mat4(1.0f));
+
+        // Directional lights: an orthographic box around the whole room
+        AABB bounds;
+        for (const auto& mesh : scene.meshes) bounds.expand(mesh->worldBounds());
+        for (const auto& prefab : scene.prefabs) {
+            for (const auto& part : prefab->parts) {
+                for (const glm::mat4& placement : prefab->instances) {
+                    bounds.expand(part->geometry->bounds.transformed(placement * part->transform));
+                }
+            }
+        }
+        glm::vec3 center = bounds.center();
+        float radius = std::max(glm::length(bounds.extent()), 1.0f);
+
+        // Point lights: 90 degree faces in +X, -X, +Y, -Y, +Z, -Z order
+        const glm::vec3 faceDirections[6] = {
+            glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0),
+            glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1)
+        };
+        const glm::vec3 faceUps[6] = {
+            glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1),
+            glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0)
+        };
+
+        for (size_t i = 0; i < scene.lights.size(); ++i) {
+            if (layers[i] < 0) continue;
+            const Light& light = scene.lights[i];
+            if (light.type == 0) {
+                glm::vec3 direction = glm::normalize(light.position);
+                glm::vec3 up = fabs(direction.y) > 0.99f ? glm::vec3(0, 0, 1) : glm::vec3(0, 1, 0);
+                glm::mat4 view = glm::lookAt(center - direction * radius * 2.0f, center, up);
+                matrices[layers[i]] = glm::ortho(-radius, radius, -radius, radius, radius, radius * 3.0f) * view;
+            }
+            else {
+                glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, 0.05f, light.radius);
+                for (int face = 0; face < 6; ++face) {
+                    matrices[layers[i] + face] = projection
+                        * glm::lookAt(light.position, light.position + faceDirections[face], faceUps[face]);
+                }
+            }
+        }
+        uploadInfo();
+    }
+
+    void uploadInfo() {
+        ShadowUniforms block = {};
+        for (size_t i = 0; i < matrices.size(); ++i) block.matrices[i] = matrices[i];
+        block.info[0] = directionalCount;
+        block.info[1] = pointCount;
+        block.info[2] = enabled && layerCount > 0 ? 1 : 0;
+        glBindBuffer(GL_UNIFORM_BUFFER, UBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ShadowUniforms), &block);
+        uploadedEnabled = enabled;
+    }
+
+    // (Re)creates a depth array with one layer per shadow map, compare mode on
+    void allocate(GLuint& texture, int& allocated) {
+        if (texture && allocated == layerCount) return;
+        if (!texture) glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, SIZE, SIZE, std::max(layerCount, 1), 0,
+            GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        allocated = layerCount;
+    }
+
+    // Layer by layer depth blit; GL 3.3 has no glCopyImageSubData
+    void copyLayers(GLuint source, GLuint destination) {
+        for (int layer = 0; layer < layerCount; ++layer) {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, copyFBO);
+            glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, source, 0, layer);
+            glReadBuffer(GL_NONE);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FBO);
+            glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, destination, 0, layer);
+            glDrawBuffer(GL_NONE);
+            glBlitFramebuffer(0, 0, SIZE, SIZE, 0, 0, SIZE, SIZE, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    // Dynamic casters draw on top of the copied cache, so only the static pass clears
+    void renderLayers(GLuint texture, bool clear, const std::vector<Mesh*>& casters,
+        const std::vector<std::pair<Prefab*, Mesh*>>& parts, UniformBuffers& uniforms) {
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        glViewport(0, 0, SIZE, SIZE);
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(2.0f, 4.0f);
+        glUseProgram(program);
+
+        for (int layer = 0; layer < layerCount; ++layer) {
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, layer);
+            if (clear) glClear(GL_DEPTH_BUFFER_BIT);
+            glUniformMatrix4fv(lightMatrixLocation, 1, GL_FALSE, glm::value_ptr(matrices[layer]));
+
+            for (Mesh* mesh : casters) {
+                glBindVertexArray(mesh->geometry->VAO);
+                uniforms.bindObject(*mesh);
+                mesh->geometry->drawElements();
+            }
+            for (const auto& part : parts) {
+                glBindVertexArray(part.first->prepare());
+                uniforms.bindObject(*part.second);
+                part.first->drawPart(*part.second);
+            }
+        }
+
+        glBindVertexArray(0);
+        glDisable(GL_POLYGON_OFFSET_FILL);
+    }
+};
+
+// Render queue: every visible draw gets a 64-bit sort key and the list is
+// radix-sorted before submission.
+//   opaque:      0 | program:7 | vao:16 | material:16 | depth:24   (front to back)
+//   transparent: 1 | farness:24 | program:7 | vao:16 | material:16 (back to front)
+// Opaque draws run with blending off and depth writes on, transparent draws
+// with blending on and depth writes off.
+struct DrawItem {
+    uint64_t key;
+    Mesh* mesh;
+    Prefab* prefab; // set for instanced prefab parts
+    GLuint program;
+    GLuint VAO;
+    bool transparent;
+};
+
+struct QueueStats {
+    size_t draws = 0;
+    size_t stateChanges = 0;         // program, VAO and blend changes actually issued
+    size_t unsortedStateChanges = 0; // what insertion order would have issued
+    double overdraw = 0.0;           // shaded samples per pixel sample, from the last completed query
+    size_t multiDraws = 0;           // glMultiDrawElementsIndirect calls (indirect path only)
+    size_t triangles = 0;            // submitted, instances included
+    size_t occlusionCulled = 0;      // indirect commands (one per LOD level in use) the Hi-Z test dropped, read back a few frames late
+};
+
+class RenderQueue {
+public:
+    std::vector<DrawItem> items;
+    QueueStats stats;
+
+    void clear() {
+        items.clear();
+    }
+
+    void add(Mesh& mesh, Prefab* prefab, GLuint program, GLuint VAO, float depth, float farPlane) {
+        bool transparent = mesh.material.transparent || mesh.material.opacity < 1.0f;
+        uint64_t quantized = (uint64_t)(glm::clamp(depth / farPlane, 0.0f, 1.0f) * 0xFFFFFF);
+        uint64_t state = ((uint64_t)(program & 0x7F) << 32) | ((uint64_t)(VAO & 0xFFFF) << 16) | (uint64_t)(mesh.materialIndex & 0xFFFF);
+
+        uint64_t key;
+        if (transparent) key = (1ull << 63) | ((0xFFFFFF - quantized) << 39) | state;
+        else key = (state << 24) | quantized;
+
+        items.push_back({ key, &mesh, prefab, program, VAO, transparent });
+    }
+
+    // LSD radix sort on the keys, 8 bits per pass, skipping bytes every key shares
+    void sort() {
+        PROFILE_SCOPE("RenderQueue::sort");
+        stats.unsortedStateChanges = countStateChanges(items);
+
+        scratch.resize(items.size());
+        for (int shift = 0; shift < 64; shift += 8) {
+            size_t counts[256] = {};
+            for (const DrawItem& item : items) counts[(item.key >> shift) & 0xFF]++;
+            if (counts[(items.empty() ? 0 : (items[0].key >> shift) & 0xFF)] == items.size()) continue;
+
+            size_t offset = 0;
+            for (size_t& count : counts) {
+                size_t c = count;
+                count = offset;
+                offset += c;
+            }
+            for (const DrawItem& item : items) scratch[counts[(item.key >> shift) & 0xFF]++] = item;
+            items.swap(scratch);
+        }
+    }
+
+    // Sorted keys put every transparent item after the opaque ones
+    size_t opaqueCount() const {
+        size_t count = 0;
+        while (count < items.size() && !items[count].transparent) count++;
+        return count;
+    }
+
+    // Draws items [first, last); a frame may execute the queue in several ranges
+    void execute(UniformBuffers& uniforms, bool separatePasses, size_t first = 0, size_t last = SIZE_MAX) {
+        PROFILE_SCOPE("RenderQueue::execute");
+        GLuint currentProgram = 0, currentVAO = 0;
+        int blending = -1;
+        last = std::min(last, items.size());
+        if (first == 0) {
+            stats.draws = 0;
+            stats.stateChanges = 0;
+            stats.multiDraws = 0;
+            stats.triangles = 0;
+        }
+        stats.draws += last - first;
+
+        for (size_t i = first; i < last; ++i) {
+            const DrawItem& item = items[i];
+            if (item.program != currentProgram) {
+                glUseProgram(item.program);
+                currentProgram = item.program;
+                stats.stateChanges++;
+            }
+            if (separatePasses && (int)item.transparent != blending) {
+                if (item.transparent) glEnable(GL_BLEND);
+                else glDisable(GL_BLEND);
+                glDepthMask(item.transparent ? GL_FALSE : GL_TRUE);
+                blending = item.transparent;
+                stats.stateChanges++;
+            }
+            if (item.VAO != currentVAO) {
+                glBindVertexArray(item.VAO);
+                currentVAO = item.VAO;
+                stats.stateChanges++;
+            }
+
+            uniforms.bindObject(*item.mesh);
+            if (item.prefab && item.prefab->lodsSelected) stats.triangles += item.prefab->drawLodPart(*item.mesh);
+            else if (item.prefab) stats.triangles += item.prefab->drawPart(*item.mesh);
+            else {
+                item.mesh->geometry->drawElements();
+                stats.triangles += item.mesh->geometry->indexCount / 3;
+            }
+        }
+
+        // Leave the defaults the rest of the frame expects
+        glEnable(GL_BLEND);
+        glDepthMask(GL_TRUE);
+        glBindVertexArray(0);
+        if (!separatePasses) stats.unsortedStateChanges = stats.stateChanges;
+    }
+
+    // Overdraw: GL_SAMPLES_PASSED around the scene passes, read back a few
+    // frames later so the query never stalls the pipeline
+    void beginOverdrawQuery() {
+        if (!queries[0]) glGenQueries(QUERY_COUNT, queries);
+        glBeginQuery(GL_SAMPLES_PASSED, queries[queryFrame % QUERY_COUNT]);
+    }
+
+    void endOverdrawQuery(int width, int height) {
+        glEndQuery(GL_SAMPLES_PASSED);
+        queryFrame++;
+
+        GLuint oldest = queries[queryFrame % QUERY_COUNT];
+        GLint available = 0;
+        if (queryFrame >= QUERY_COUNT) glGetQueryObjectiv(oldest, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint64 samples = 0;
+            glGetQueryObjectui64v(oldest, GL_QUERY_RESULT, &samples);
+            GLint sampleCount = 0;
+            glGetIntegerv(GL_SAMPLES, &sampleCount);
+            double pixelSamples = (double)width * height * std::max(1, sampleCount);
+            if (pixelSamples > 0) stats.overdraw = samples / pixelSamples;
+        }
+    }
+
+    void destroy() {
+        if (queries[0]) glDeleteQueries(QUERY_COUNT, queries);
+    }
+
+private:
+    static const int QUERY_COUNT = 3;
+    std::vector<DrawItem> scratch;
+    GLuint queries[QUERY_COUNT] = {};
+    unsigned int queryFrame = 0;
+
+    static size_t countStateChanges(const std::vector<DrawItem>& order) {
+        size_t changes = 0;
+        GLuint program = 0, VAO = 0;
+        int blending = -1;
+        for (const DrawItem& item : order) {
+            if (item.program != program) changes++;
+            if ((int)item.transparent != blending) changes++;
+            if (item.VAO != VAO) changes++;
+            program = item.program;
+            VAO = item.VAO;
+            blending = item.transparent;
+        }
+        return changes;
+    }
+};
+
+// Hi-Z occlusion culling for the indirect path. Every frame the large
+// static occluders (Mesh::occluder, the room's walls) are drawn depth-only
+// at HIZ_WIDTH x HIZ_HEIGHT with the camera's matrices, and a compute pass
+// reduces that depth into a max-depth mip pyramid. IndirectDraws then runs
+// the cull shader over its commands: each command's world bounds are
+// projected, the pyramid level where they span at most 2x2 texels is read
+// (one extra level-0 texel around the rectangle, so low-resolution occluder
+// edges stay conservative), and the draw survives when its nearest point
+// is in front of the farthest occluder depth there, or it crosses the
+// camera plane. Bounds outside the frustum are dropped as well, which
+// covers prefab parts the CPU never culls.
+//
+// Survivors are compacted per run in queue order (a prefix sum in one
+// workgroup per run), so the sorted order is kept. With
+// ARB_indirect_parameters each run draws the GPU-written count; otherwise
+// culled commands stay in place with instanceCount 0. The pre-pass is of
+// the current frame, so nothing lags behind camera motion.
+const char* hizReduceSource = R"(
+layout (local_size_x = 8, local_size_y = 8) in;
+
+uniform sampler2D source;
+uniform int sourceLevel;
+uniform int reduce; // 0 copies the depth target into level 0, 1 takes the max of 2x2
+layout (r32f) writeonly uniform image2D destination;
+
+void main() {
+    ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+    if(any(greaterThanEqual(texel, imageSize(destination)))) return;
+
+    ivec2 last = textureSize(source, sourceLevel) - 1;
+    ivec2 base = texel << reduce;
+    float depth = texelFetch(source, min(base, last), sourceLevel).r;
+    if(reduce != 0) {
+        depth = max(depth, texelFetch(source, min(base + ivec2(1, 0), last), sourceLevel).r);
+        depth = max(depth, texelFetch(source, min(base + ivec2(0, 1), last), sourceLevel).r);
+        depth = max(depth, texelFetch(source, min(base + ivec2(1, 1), last), sourceLevel).r);
+    }
+    imageStore(destination, texel, vec4(depth));
+}
+)";
+
+const char* hizCullSource = R"(
+layout (local_size_x = 64) in;
+
+struct DrawCommand {
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+
+layout (std430, binding = 1) readonly buffer Commands { DrawCommand commands[]; };
+layout (std430, binding = 2) readonly buffer Bounds { vec4 bounds[]; }; // world min, max per command
+layout (std430, binding = 3) writeonly buffer Culled { DrawCommand culled[]; };
+layout (std430, binding = 4) writeonly buffer Counts { uint visibleCounts[]; }; // per run
+
+uniform mat4 viewProjection;
+uniform sampler2D hiz;
+uniform int hizLevels;
+uniform int compact;
+uniform int runIndex;
+uniform int runFirst;
+uniform int runCount;
+
+shared uint prefix[64];
+
+bool isVisible(uint command) {
+    vec3 lo = bounds[command * 2u].xyz;
+    vec3 hi = bounds[command * 2u + 1u].xyz;
+    vec3 ndcMin = vec3(1e30), ndcMax = vec3(-1e30);
+    for(int i = 0; i < 8; i++) {
+        vec3 corner = vec3((i & 1) != 0 ? hi.x : lo.x, (i & 2) != 0 ? hi.y : lo.y, (i & 4) != 0 ? hi.z : lo.z);
+        vec4 clip = viewProjection * vec4(corner, 1.0);
+        if(clip.w <= 1e-4) return true;
+        vec3 ndc = clip.xyz / clip.w;
+        ndcMin = min(ndcMin, ndc);
+        ndcMax = max(ndcMax, ndc);
+    }
+    if(any(lessThan(ndcMax.xy, vec2(-1.0))) || any(greaterThan(ndcMin.xy, vec2(1.0))) || ndcMin.z > 1.0) return false;
+
+    vec2 size0 = vec2(textureSize(hiz, 0));
+    vec2 rectMin = clamp((ndcMin.xy * 0.5 + 0.5) * size0 - 1.0, vec2(0.0), size0);
+    vec2 rectMax = clamp((ndcMax.xy * 0.5 + 0.5) * size0 + 1.0, vec2(0.0), size0);
+    vec2 extent = rectMax - rectMin;
+    int level = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1.0)))), 0, hizLevels - 1);
+
+    ivec2 size = textureSize(hiz, level);
+    ivec2 texelMin = clamp(ivec2(rectMin / exp2(float(level))), ivec2(0), size - 1);
+    ivec2 texelMax = clamp(ivec2(rectMax / exp2(float(level))), ivec2(0), size - 1);
+    float occluderDepth = 0.0;
+    for(int y = texelMin.y; y <= texelMax.y; y++) {
+        for(int x = texelMin.x; x <= texelMax.x; x++) {
+            occluderDepth = max(occluderDepth, texelFetch(hiz, ivec2(x, y), level).r);
+        }
+    }
+    return ndcMin.z * 0.5 + 0.5 <= occluderDepth;
+}
+
+void main() {
+    uint lane = gl_LocalInvocationID.x;
+    uint written = 0u;
+    for(uint base = 0u; base < uint(runCount); base += 64u) {
+        uint index = base + lane;
+        uint command = uint(runFirst) + index;
+        bool inRun = index < uint(runCount);
+        bool visible = inRun && isVisible(command);
+
+        // Inclusive prefix sum of the visible flags over this chunk
+        prefix[lane] = visible ? 1u : 0u;
+        barrier();
+        for(uint offset = 1u; offset < 64u; offset <<= 1) {
+            uint add = lane >= offset ? prefix[lane - offset] : 0u;
+            barrier();
+            prefix[lane] += add;
+            barrier();
+        }
+
+        if(inRun) {
+            DrawCommand draw = commands[command];
+            if(compact != 0) {
+                if(visible) culled[uint(runFirst) + written + prefix[lane] - 1u] = draw;
+            }
+            else {
+                if(!visible) draw.instanceCount = 0u;
+                culled[command] = draw;
+            }
+        }
+        written += prefix[63];
+        barrier();
+    }
+    if(lane == 0u) visibleCounts[runIndex] = written;
+}
+)";
+
+const char* occluderVertexSource = R"(
+layout (location = 0) in vec3 aPos;
+
+uniform mat4 modelViewProjection;
+
+void main() {
+    gl_Position = modelViewProjection * vec4(aPos, 1.0);
+}
+)";
+
+class OcclusionCuller {
+public:
+    static const int HIZ_WIDTH = 512, HIZ_HEIGHT = 256;
+    bool supported = false;
+    bool compact = false; // ARB_indirect_parameters: runs draw a GPU-written count
+    int levels = 0;
+    size_t occluders = 0; // drawn into the last pyramid
+
+    // Compute shaders, image load/store and SSBOs are GL 4.3 core
+    void requestPrograms() {
+        supported = GLEW_VERSION_4_3;
+        if (!supported) return;
+
+        std::string header = "#version 430 core\n";
+        occluderProgram = createShaderProgram(header + occluderVertexSource, header + "void main() {}\n");
+        reduceProgram = createComputeProgram(header + hizReduceSource);
+        cullProgram = createComputeProgram(header + hizCullSource);
+    }
+
+    void init() {
+        if (!supported) return;
+        compact = GLEW_ARB_indirect_parameters;
+
+        programCache.finish(occluderProgram);
+        programCache.finish(reduceProgram);
+        programCache.finish(cullProgram);
+        mvpLocation = glGetUniformLocation(occluderProgram, "modelViewProjection");
+        glUseProgram(reduceProgram);
+        glUniform1i(glGetUniformLocation(reduceProgram, "source"), 0);
+        glUseProgram(cullProgram);
+        glUniform1i(glGetUniformLocation(cullProgram, "hiz"), 0);
+        glUseProgram(0);
+
+        glGenTextures(1, &depthTexture);
+        glBindTexture(GL_TEXTURE_2D, depthTexture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, HIZ_WIDTH, HIZ_HEIGHT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        levels = 1;
+        while ((HIZ_WIDTH >> levels) > 0 || (HIZ_HEIGHT >> levels) > 0) levels++;
+        glGenTextures(1, &hizTexture);
+        glBindTexture(GL_TEXTURE_2D, hizTexture);
+        glTexStorage2D(GL_TEXTURE_2D, levels, GL_R32F, HIZ_WIDTH, HIZ_HEIGHT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glGenFramebuffers(1, &FBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTexture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cout << "Hi-Z framebuffer is incomplete, occlusion culling disabled" << std::endl;
+            supported = false;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    // Occluder depth pre-pass and pyramid. Leaves the Hi-Z framebuffer
+    // bound; the caller restores its own target and viewport.
+    void build(const Scene& scene, const glm::mat4& viewProjection) {
+        PROFILE_SCOPE("OcclusionCuller::build");
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glViewport(0, 0, HIZ_WIDTH, HIZ_HEIGHT);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glUseProgram(occluderProgram);
+        occluders = 0;
+        for (const auto& mesh : scene.meshes) {
+            if (!mesh->occluder || !mesh->resident()) continue;
+            glm::mat4 mvp = viewProjection * mesh->transform * mesh->geometry->dequantize;
+            glUniformMatrix4fv(mvpLocation, 1, GL_FALSE, glm::value_ptr(mvp));
+            glBindVertexArray(mesh->geometry->VAO);
+            mesh->geometry->drawElements();
+            occluders++;
+        }
+        glBindVertexArray(0);
+
+        glUseProgram(reduceProgram);
+        glActiveTexture(GL_TEXTURE0);
+        for (int level = 0; level < levels; ++level) {
+            glBindTexture(GL_TEXTURE_2D, level == 0 ? depthTexture : hizTexture);
+            glUniform1i(glGetUniformLocation(reduceProgram, "sourceLevel"), level == 0 ? 0 : level - 1);
+            glUniform1i(glGetUniformLocation(reduceProgram, "reduce"), level == 0 ? 0 : 1);
+            glBindImageTexture(0, hizTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+            int width = std::max(HIZ_WIDTH >> level, 1), height = std::max(HIZ_HEIGHT >> level, 1);
+            glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    // Binds the cull program and pyramid; IndirectDraws::cull binds the
+    // buffers and calls dispatchRun() per run
+    void beginCull(const glm::mat4& viewProjection) {
+        glUseProgram(cullProgram);
+        glUniformMatrix4fv(glGetUniformLocation(cullProgram, "viewProjection"), 1, GL_FALSE, glm::value_ptr(viewProjection));
+        glUniform1i(glGetUniformLocation(cullProgram, "hizLevels"), levels);
+        glUniform1i(glGetUniformLocation(cullProgram, "compact"), compact ? 1 : 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, hizTexture);
+    }
+
+    void dispatchRun(size_t run, size_t firstCommand, size_t commandCount) {
+        glUniform1i(glGetUniformLocation(cullProgram, "runIndex"), (GLint)run);
+        glUniform1i(glGetUniformLocation(cullProgram, "runFirst"), (GLint)firstCommand);
+        glUniform1i(glGetUniformLocation(cullProgram, "runCount"), (GLint)commandCount);
+        glDispatchCompute(1, 1, 1);
+    }
+
+    void destroy() {
+        if (FBO) glDeleteFramebuffers(1, &FBO);
+        GLuint textures[] = { depthTexture, hizTexture };
+        if (depthTexture) glDeleteTextures(2, textures);
+        GLuint programs[] = { occluderProgram, reduceProgram, cullProgram };
+        for (GLuint program : programs) {
+            if (program) glDeleteProgram(program);
+        }
+        FBO = depthTexture = hizTexture = occluderProgram = reduceProgram = cullProgram = 0;
+    }
+
+private:
+    GLuint FBO = 0, depthTexture = 0, hizTexture = 0;
+    GLuint occluderProgram = 0, reduceProgram = 0, cullProgram = 0;
+    GLint mvpLocation = -1;
+};
+
+// Forward shading programs: blocks, cluster samplers and shadow maps
+void configureForwardProgram(GLuint program) {
+    UniformBuffers::bindBlocks(program);
+    ClusteredLighting::bindSamplers(program);
+    ShadowMaps::bindSampler(program);
+}
+
+// Multi-draw indirect submission (GL 4.3 plus ARB_buffer_storage). Once the
+// queue is sorted, beginFrame() writes one ObjectUniforms record per draw
+// (per placement for prefab parts), one DrawElementsIndirectCommand per
+// queue item (per LOD group for prefab parts) and its world bounds straight
+// into persistently, coherently mapped buffers, split into RING_SIZE
+// regions that are fenced per frame so the CPU never writes what the GPU
+// may still read. Commands are grouped into runs of equal program, VAO,
+// blend state and index type; execute() then issues one
+// glMultiDrawElementsIndirect per run, so the GL call count no longer
+// grows with the mesh count. cull() may replace the commands with the
+// ones that pass OcclusionCuller in between.
+//
+// Shaders find their record through location 8, a divisor-1 attribute over
+// 0, 1, 2, ... that starts at each command's baseInstance (gl_DrawID would
+// need GL 4.6). Prefab parts draw from the pool VAO with the placement baked
+// into their records. RenderQueue::execute stays the GL 3.3 fallback.
+class IndirectDraws {
+public:
+    static const int RING_SIZE = 3;
+    bool supported = false;
+    LightVariants forwardVariants;
+    GLuint gbufferProgram = 0;
+
+    void requestPrograms() {
+        supported = GLEW_VERSION_4_3 && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage);
+        if (!supported) return;
+
+        std::string header = std::string("#version 430 core\n#define INDIRECT_DRAW\n");
+        std::string vertex = header + "#define VERTEX_STAGE\n" + frameDataSource + objectDataSource + vertexShaderSource;
+        forwardVariants.request(vertex, header, std::string(frameDataSource) + objectDataSource + lightingSource + lodDitherSource + fragmentShaderSource,
+            configureForwardProgram);
+        gbufferProgram = createShaderProgram(vertex, header + frameDataSource + objectDataSource + lodDitherSource + gbufferFragmentSource);
+    }
+
+    void init() {
+        if (!supported) return;
+
+        forwardVariants.init();
+        programCache.finish(gbufferProgram);
+        UniformBuffers::bindBlocks(gbufferProgram);
+
+        GLint alignment = 256;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        regionAlignment = (size_t)std::max(alignment, 1);
+    }
+
+    // Once the frame's queue is sorted: wait until the GPU is done with
+    // this frame's region, then write every record, command and bounds.
+    // separatePasses must match the execute() calls that follow.
+    void beginFrame(RenderQueue& queue, const UniformBuffers& uniforms, bool separatePasses) {
+        PROFILE_SCOPE("IndirectDraws::beginFrame");
+        // A LOD group per level in use, each placement in at most two
+        size_t recordsNeeded = 0, commandsNeeded = 0;
+        for (const DrawItem& item : queue.items) {
+            bool lods = item.prefab && item.prefab->lodsSelected;
+            recordsNeeded += item.prefab ? item.prefab->instances.size() * (lods ? 2 : 1) : 1;
+            commandsNeeded += lods ? LOD_LEVELS : 1;
+        }
+
+        region = frame % RING_SIZE;
+        waitFence(region);
+        readOcclusionResults(queue.stats);
+        if (recordsNeeded > recordCapacity || commandsNeeded > commandCapacity) grow(recordsNeeded, commandsNeeded);
+        recordCount = commandCount = 0;
+        runs.clear();
+        culled = false;
+        triangles = 0;
+
+        for (size_t i = 0; i < queue.items.size(); ++i) {
+            const DrawItem& item = queue.items[i];
+            Geometry& geometry = *item.mesh->geometry;
+            if (geometry.objectIndexGeneration != generation) attachObjectIndices(geometry);
+
+            // LOD levels are pooled like the part, so only the index type can end a run
+            auto addCommand = [&](const Geometry& drawn, size_t instanceCount, const AABB& bounds) {
+                const Run* run = runs.empty() ? nullptr : &runs.back();
+                if (!run || run->program != item.program || run->VAO != drawn.VAO || run->indexType != drawn.indexType
+                    || (separatePasses && run->transparent != item.transparent)) {
+                    runs.push_back({ item.program, drawn.VAO, drawn.indexType, item.transparent, i, i + 1, commandCount, 0 });
+                }
+                runs.back().lastItem = i + 1;
+                runs.back().commandCount++;
+
+                DrawCommand& command = commands()[commandCount];
+                command.count = (GLuint)drawn.indexCount;
+                command.instanceCount = (GLuint)instanceCount;
+                command.firstIndex = (GLuint)(drawn.indexOffset / (drawn.indexType == GL_UNSIGNED_SHORT ? 2 : 4));
+                command.baseVertex = drawn.baseVertex;
+                command.baseInstance = (GLuint)recordCount;
+                glm::vec4* commandBounds = this->bounds() + commandCount * 2;
+                commandBounds[0] = glm::vec4(bounds.min, 0.0f);
+                commandBounds[1] = glm::vec4(bounds.max, 0.0f);
+                commandCount++;
+                triangles += drawn.indexCount / 3 * instanceCount;
+            };
+
+            const ObjectUniforms& object = uniforms.objectRecords[item.mesh->objectSlot];
+            if (!item.prefab) {
+                addCommand(geometry, 1, item.mesh->worldBounds());
+                records()[recordCount++] = object;
+                continue;
+            }
+
+            // Placements are rigid, so their 3x3 carries normals unchanged.
+            // LOD levels share the part's dequantize, so one record fits all.
+            auto addPlacement = [&](const glm::mat4& placement, float fade) {
+                ObjectUniforms& record = records()[recordCount++];
+                record = object;
+                record.model = placement * object.model;
+                for (int column = 0; column < 3; ++column) {
+                    record.normalMatrix[column] = glm::vec4(glm::mat3(placement) * glm::vec3(object.normalMatrix[column]), 0.0f);
+                }
+                record.lodFade = fade;
+            };
+            const Prefab& prefab = *item.prefab;
+            if (!prefab.lodsSelected) {
+                AABB bounds;
+                for (const glm::mat4& placement : prefab.instances) bounds.expand(geometry.bounds.transformed(placement * item.mesh->transform));
+                addCommand(geometry, prefab.instances.size(), bounds);
+                for (const glm::mat4& placement : prefab.instances) addPlacement(placement, 0.0f);
+                continue;
+            }
+            for (const Prefab::LodGroup& group : prefab.lodGroups) {
+                if (group.part != item.mesh) continue;
+                AABB bounds;
+                for (size_t k = group.first; k < group.first + group.count; ++k) {
+                    bounds.expand(group.geometry->bounds.transformed(prefab.lodInstances[k].placement * item.mesh->transform));
+                }
+                addCommand(*group.geometry, group.count, bounds);
+                for (size_t k = group.first; k < group.first + group.count; ++k) {
+                    addPlacement(prefab.lodInstances[k].placement, prefab.lodInstances[k].fade);
+                }
+            }
+        }
+        glBindVertexArray(0);
+        inFrame = true;
+    }
+
+    // Runs the occlusion test over this frame's commands; execute() then
+    // draws the survivors
+    void cull(OcclusionCuller& culler, const glm::mat4& viewProjection) {
+        PROFILE_SCOPE("IndirectDraws::cull");
+        if (!inFrame || runs.empty()) return;
+
+        culler.beginCull(viewProjection);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, COMMAND_BINDING, commandBuffer, region * commandRegionBytes, commandRegionBytes);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, BOUNDS_BINDING, boundsBuffer, region * boundsRegionBytes, boundsRegionBytes);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CULLED_BINDING, culledBuffer);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, COUNT_BINDING, countBuffer, region * countRegionBytes, countRegionBytes);
+        for (size_t r = 0; r < runs.size(); ++r) culler.dispatchRun(r, runs[r].firstCommand, runs[r].commandCount);
+        glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+
+        culled = true;
+        compact = culler.compact;
+        regionRuns[region] = runs.size();
+        regionCommands[region] = commandCount;
+    }
+
+    void endFrame() {
+        if (!inFrame) return;
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        frame++;
+        inFrame = false;
+    }
+
+    // Same contract as RenderQueue::execute: draws items [first, last) and
+    // keeps the queue's stats, issuing the runs recorded by beginFrame()
+    void execute(RenderQueue& queue, bool separatePasses, size_t first = 0, size_t last = SIZE_MAX) {
+        PROFILE_SCOPE("IndirectDraws::execute");
+        QueueStats& stats = queue.stats;
+        last = std::min(last, queue.items.size());
+        if (first == 0) {
+            stats.draws = 0;
+            stats.stateChanges = 0;
+            stats.multiDraws = 0;
+            stats.triangles = triangles;
+        }
+        stats.draws += last - first;
+
+        // Prefab placements are baked into the records, so locations 4-7
+        // must read the identity again after any instanced draw
+        resetConstantAttributes();
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, culled ? culledBuffer : commandBuffer);
+        if (culled && compact) glBindBuffer(GL_PARAMETER_BUFFER_ARB, countBuffer);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, RECORD_BINDING, recordBuffer, region * recordRegionBytes, recordRegionBytes);
+
+        GLuint currentProgram = 0, currentVAO = 0;
+        int blending = -1;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            const Run& run = runs[r];
+            if (run.lastItem <= first || run.firstItem >= last) continue;
+
+            if (run.program != currentProgram) {
+                glUseProgram(run.program);
+                currentProgram = run.program;
+                stats.stateChanges++;
+            }
+            if (separatePasses && (int)run.transparent != blending) {
+                if (run.transparent) glEnable(GL_BLEND);
+                else glDisable(GL_BLEND);
+                glDepthMask(run.transparent ? GL_FALSE : GL_TRUE);
+                blending = run.transparent;
+                stats.stateChanges++;
+            }
+            if (run.VAO != currentVAO) {
+                glBindVertexArray(run.VAO);
+                currentVAO = run.VAO;
+                stats.stateChanges++;
+            }
+
+            // The culled stream is rewritten every frame, so it has no regions
+            size_t offset = (culled ? 0 : region * commandRegionBytes) + run.firstCommand * sizeof(DrawCommand);
+            if (culled && compact) {
+                GLintptr countOffset = (GLintptr)(region * countRegionBytes + r * sizeof(GLuint));
+                glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, run.indexType, (void*)offset, countOffset, (GLsizei)run.commandCount, 0);
+            }
+            else {
+                glMultiDrawElementsIndirect(GL_TRIANGLES, run.indexType, (void*)offset, (GLsizei)run.commandCount, 0);
+            }
+            stats.multiDraws++;
+        }
+
+        // Leave the defaults the rest of the frame expects
+        glEnable(GL_BLEND);
+        glDepthMask(GL_TRUE);
+        glBindVertexArray(0);
+        if (!separatePasses) stats.unsortedStateChanges = stats.stateChanges;
+    }
+
+    void destroy() {
+        for (int i = 0; i < RING_SIZE; ++i) waitFence(i);
+        release();
+        forwardVariants.destroy();
+        if (gbufferProgram) glDeleteProgram(gbufferProgram);
+        gbufferProgram = 0;
+    }
+
+private:
+    struct DrawCommand {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // Consecutive commands submitted by one multi-draw call
+    struct Run {
+        GLuint program, VAO;
+        GLenum indexType;
+        bool transparent;
+        size_t firstItem, lastItem; // queue items [first, last)
+        size_t firstCommand, commandCount;
+    };
+
+    // binding = 0 in objectDataSource, 1-4 in hizCullSource
+    static const GLuint RECORD_BINDING = 0, COMMAND_BINDING = 1, BOUNDS_BINDING = 2, CULLED_BINDING = 3, COUNT_BINDING = 4;
+    static const GLuint OBJECT_INDEX_LOCATION = 8;
+
+    GLuint recordBuffer = 0, commandBuffer = 0, boundsBuffer = 0, countBuffer = 0, culledBuffer = 0, objectIndexBuffer = 0;
+    unsigned char* recordMemory = nullptr;
+    unsigned char* commandMemory = nullptr;
+    unsigned char* boundsMemory = nullptr;
+    unsigned char* countMemory = nullptr;
+    size_t recordCapacity = 0, commandCapacity = 0; // per region; one run at most per command
+    size_t recordRegionBytes = 0, commandRegionBytes = 0, boundsRegionBytes = 0, countRegionBytes = 0;
+    size_t regionAlignment = 256;
+    size_t recordCount = 0, commandCount = 0;       // written so far this frame
+    size_t triangles = 0;                           // submitted this frame, before culling
+    std::vector<Run> runs;
+    size_t regionRuns[RING_SIZE] = {}, regionCommands[RING_SIZE] = {}; // culled in the region's last use
+    GLsync fences[RING_SIZE] = {};
+    unsigned int frame = 0, generation = 0;         // generation bumps when objectIndexBuffer is replaced
+    int region = 0;
+    bool inFrame = false, culled = false, compact = false;
+
+    ObjectUniforms* records() {
+        return (ObjectUniforms*)(recordMemory + region * recordRegionBytes);
+    }
+
+    DrawCommand* commands() {
+        return (DrawCommand*)(commandMemory + region * commandRegionBytes);
+    }
+
+    glm::vec4* bounds() {
+        return (glm::vec4*)(boundsMemory + region * boundsRegionBytes);
+    }
+
+    void waitFence(int index) {
+        if (!fences[index]) return;
+        while (glClientWaitSync(fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(fences[index]);
+        fences[index] = 0;
+    }
+
+    // The region's fence has passed, so the counts it last culled with are final
+    void readOcclusionResults(QueueStats& stats) {
+        if (!regionRuns[region]) return;
+        const GLuint* counts = (const GLuint*)(countMemory + region * countRegionBytes);
+        size_t visible = 0;
+        for (size_t r = 0; r < regionRuns[region]; ++r) visible += counts[r];
+        stats.occlusionCulled = regionCommands[region] - std::min(visible, regionCommands[region]);
+        regionRuns[region] = 0;
+    }
+
+    size_t alignRegion(size_t bytes) const {
+        return (bytes + regionAlignment - 1) / regionAlignment * regionAlignment;
+    }
+
+    // Growing replaces every region, so wait for all of them first
+    void grow(size_t recordsNeeded, size_t commandsNeeded) {
+        for (int i = 0; i < RING_SIZE; ++i) waitFence(i);
+        release();
+
+        recordCapacity = 1024;
+        while (recordCapacity < recordsNeeded) recordCapacity *= 2;
+        commandCapacity = 1024;
+        while (commandCapacity < commandsNeeded) commandCapacity *= 2;
+
+        const GLbitfield write = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        const GLbitfield read = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        recordRegionBytes = alignRegion(recordCapacity * sizeof(ObjectUniforms));
+        commandRegionBytes = alignRegion(commandCapacity * sizeof(DrawCommand));
+        boundsRegionBytes = alignRegion(commandCapacity * 2 * sizeof(glm::vec4));
+        countRegionBytes = alignRegion(commandCapacity * sizeof(GLuint));
+        recordBuffer = createMapped(RING_SIZE * recordRegionBytes, write, &recordMemory);
+        commandBuffer = createMapped(RING_SIZE * commandRegionBytes, write, &commandMemory);
+        boundsBuffer = createMapped(RING_SIZE * boundsRegionBytes, write, &boundsMemory);
+        countBuffer = createMapped(RING_SIZE * countRegionBytes, read, &countMemory);
+
+        glGenBuffers(1, &culledBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, culledBuffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, commandRegionBytes, NULL, GL_DYNAMIC_COPY);
+
+        std::vector<GLint> sequence(recordCapacity);
+        for (size_t i = 0; i < sequence.size(); ++i) sequence[i] = (GLint)i;
+        glGenBuffers(1, &objectIndexBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, objectIndexBuffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, sequence.size() * sizeof(GLint), sequence.data(), GL_STATIC_DRAW);
+        generation++;
+    }
+
+    GLuint createMapped(size_t bytes, GLbitfield flags, unsigned char** memory) {
+        GLuint buffer;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferStorage(GL_COPY_WRITE_BUFFER, bytes, NULL, flags);
+        *memory = (unsigned char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, bytes, flags);
+        return buffer;
+    }
+
+    void release() {
+        GLuint mapped[] = { recordBuffer, commandBuffer, boundsBuffer, countBuffer };
+        for (GLuint buffer : mapped) {
+            if (!buffer) continue;
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glDeleteBuffers(1, &buffer);
+        }
+        if (culledBuffer) glDeleteBuffers(1, &culledBuffer);
+        if (objectIndexBuffer) glDeleteBuffers(1, &objectIndexBuffer);
+        recordBuffer = commandBuffer = boundsBuffer = countBuffer = culledBuffer = objectIndexBuffer = 0;
+        recordMemory = commandMemory = boundsMemory = countMemory = nullptr;
+        recordCapacity = commandCapacity = 0;
+        for (size_t& runCount : regionRuns) runCount = 0;
+    }
+
+    // Once per geometry and generation; pooled geometries share the pool's
+    // VAO, so after the first of them the attach repeats the same state
+    void attachObjectIndices(Geometry& geometry) {
+        glBindVertexArray(geometry.VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, objectIndexBuffer);
+        glVertexAttribIPointer(OBJECT_INDEX_LOCATION, 1, GL_INT, sizeof(GLint), (void*)0);
+        glVertexAttribDivisor(OBJECT_INDEX_LOCATION, 1);
+        glEnableVertexAttribArray(OBJECT_INDEX_LOCATION);
+        geometry.objectIndexGeneration = generation;
+    }
+};
+
+// Per-pass GPU and CPU instrumentation. Each named scope gets a
+// GL_TIME_ELAPSED query, CPU submission time and, with
+// ARB_pipeline_statistics_query, vertex and fragment shader invocation
+// counts; GL_TIMESTAMP queries bracket the whole frame. Queries rotate
+// through a small ring and are read back RING_SIZE - 1 frames late, so
+// instrumentation never stalls the pipeline. Completed frames can be
+// logged one JSON line each.
+class PassTimer {
+public:
+    struct Pass {
+        std::string name;
+        GLuint timeQueries[3] = {};
+        GLuint vertexQueries[3] = {};
+        GLuint fragmentQueries[3] = {};
+        bool issued[3] = {};
+        double cpuSlots[3] = {};
+        double gpuMs = 0.0;
+        double cpuMs = 0.0;
+        GLuint64 vertexInvocations = 0;
+        GLuint64 fragmentInvocations = 0;
+        unsigned int lastFrame = 0;   // frame the pass was last issued in
+        unsigned int resultFrame = 0; // frame the current results belong to
+    };
+
+    std::vector<Pass> passes;
+    double frameGpuMs = 0.0;   // first to last GPU timestamp of the newest completed frame
+    std::ofstream* log = nullptr; // one JSON line per completed frame when set
+
+    void beginFrame() {
+        if (!frameQueries[0][0]) {
+            glGenQueries(RING_SIZE, frameQueries[0]);
+            glGenQueries(RING_SIZE, frameQueries[1]);
+            statistics = GLEW_ARB_pipeline_statistics_query;
+        }
+        glQueryCounter(frameQueries[0][frame % RING_SIZE], GL_TIMESTAMP);
+    }
+
+    // Passes run back to back; queries of one target cannot nest
+    void begin(const char* name) {
+        Pass* pass = nullptr;
+        for (Pass& p : passes) {
+            if (p.name == name) pass = &p;
+        }
+        if (!pass) {
+            passes.push_back(Pass());
+            pass = &passes.back();
+            pass->name = name;
+            glGenQueries(RING_SIZE, pass->timeQueries);
+            if (statistics) {
+                glGenQueries(RING_SIZE, pass->vertexQueries);
+                glGenQueries(RING_SIZE, pass->fragmentQueries);
+            }
+        }
+
+        current = pass - passes.data();
+        int slot = frame % RING_SIZE;
+        glBeginQuery(GL_TIME_ELAPSED, pass->timeQueries[slot]);
+        if (statistics) {
+            glBeginQuery(GL_VERTEX_SHADER_INVOCATIONS_ARB, pass->vertexQueries[slot]);
+            glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB, pass->fragmentQueries[slot]);
+        }
+        pass->issued[slot] = true;
+        pass->lastFrame = frame;
+        cpuStart = std::chrono::steady_clock::now();
+    }
+
+    void end() {
+        glEndQuery(GL_TIME_ELAPSED);
+        if (statistics) {
+            glEndQuery(GL_VERTEX_SHADER_INVOCATIONS_ARB);
+            glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+        }
+        passes[current].cpuSlots[frame % RING_SIZE] =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - cpuStart).count();
+    }
+
+    // Collects the frame issued RING_SIZE - 1 frames ago if the GPU has
+    // finished it; otherwise the previous results stay on display
+    void endFrame() {
+        glQueryCounter(frameQueries[1][frame % RING_SIZE], GL_TIMESTAMP);
+        frame++;
+        if (frame < RING_SIZE) return;
+
+        int slot = frame % RING_SIZE;
+        GLint available = 0;
+        glGetQueryObjectiv(frameQueries[1][slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return;
+
+        // The end timestamp is the last command of its frame, so every
+        // query issued before it is available too
+        GLuint64 start = 0, stop = 0;
+        glGetQueryObjectui64v(frameQueries[0][slot], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(frameQueries[1][slot], GL_QUERY_RESULT, &stop);
+        frameGpuMs = (stop - start) / 1.0e6;
+
+        for (Pass& pass : passes) {
+            if (!pass.issued[slot]) continue;
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(pass.timeQueries[slot], GL_QUERY_RESULT, &nanoseconds);
+            pass.gpuMs = nanoseconds / 1.0e6;
+            pass.cpuMs = pass.cpuSlots[slot];
+            if (statistics) {
+                glGetQueryObjectui64v(pass.vertexQueries[slot], GL_QUERY_RESULT, &pass.vertexInvocations);
+                glGetQueryObjectui64v(pass.fragmentQueries[slot], GL_QUERY_RESULT, &pass.fragmentInvocations);
+            }
+            pass.issued[slot] = false;
+            pass.resultFrame = frame - RING_SIZE;
+        }
+        if (log) writeLog(frame - RING_SIZE);
+    }
+
+    // Latest GPU time of a pass that ran in the last frame, 0 otherwise
+    double gpuMs(const char* name) const {
+        for (const Pass& pass : passes) {
+            if (pass.name == name && active(pass)) return pass.gpuMs;
+        }
+        return 0.0;
+    }
+
+    // "name gpu/cpu ms" for every pass that ran in the last frame
+    std::string summary() const {
+        std::string text;
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "gpu frame %.2f ms", frameGpuMs);
+        text += buffer;
+        for (const Pass& pass : passes) {
+            if (!active(pass)) continue;
+            snprintf(buffer, sizeof(buffer), ", %s %.2f/%.2f ms", pass.name.c_str(), pass.gpuMs, pass.cpuMs);
+            text += buffer;
+            if (statistics) {
+                snprintf(buffer, sizeof(buffer), " (%.0fk vs, %.0fk fs)", pass.vertexInvocations / 1000.0, pass.fragmentInvocations / 1000.0);
+                text += buffer;
+            }
+        }
+        return text;
+    }
+
+    // Bar overlay in the top-left corner: one row per pass, GPU time on
+    // top and CPU time below, scaled so a full row is 1/60 s. Uses scissored
+    // clears, so it needs no shader or font.
+    void drawOverlay(int width, int height) const {
+        const glm::vec3 palette[] = {
+            glm::vec3(0.90f, 0.30f, 0.25f), glm::vec3(0.25f, 0.70f, 0.35f), glm::vec3(0.25f, 0.45f, 0.90f),
+            glm::vec3(0.95f, 0.75f, 0.20f), glm::vec3(0.70f, 0.35f, 0.85f), glm::vec3(0.20f, 0.80f, 0.85f)
+        };
+        const float pixelsPerMs = std::min(300, width / 3) / 16.7f;
+        const int rowHeight = 12, margin = 8;
+
+        glEnable(GL_SCISSOR_TEST);
+        int row = 0;
+        for (const Pass& pass : passes) {
+            if (!active(pass)) continue;
+            glm::vec3 color = palette[(&pass - passes.data()) % 6];
+            int y = height - margin - (row + 1) * rowHeight;
+            glScissor(margin, y + 5, std::max(1, (int)(pass.gpuMs * pixelsPerMs)), 6);
+            glClearColor(color.x, color.y, color.z, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+            glScissor(margin, y + 2, std::max(1, (int)(pass.cpuMs * pixelsPerMs)), 2);
+            glClearColor(color.x * 0.5f, color.y * 0.5f, color.z * 0.5f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+            row++;
+        }
+        glDisable(GL_SCISSOR_TEST);
+    }
+
+    void destroy() {
+        for (Pass& pass : passes) {
+            glDeleteQueries(RING_SIZE, pass.timeQueries);
+            if (statistics) {
+                glDeleteQueries(RING_SIZE, pass.vertexQueries);
+                glDeleteQueries(RING_SIZE, pass.fragmentQueries);
+            }
+        }
+        if (frameQueries[0][0]) {
+            glDeleteQueries(RING_SIZE, frameQueries[0]);
+            glDeleteQueries(RING_SIZE, frameQueries[1]);
+        }
+        passes.clear();
+    }
+
+private:
+    static const int RING_SIZE = 3;
+    unsigned int frame = 0;
+    size_t current = 0;
+    bool statistics = false;
+    GLuint frameQueries[2][RING_SIZE] = {}; // start and end timestamps
+    std::chrono::steady_clock::time_point cpuStart;
+
+    bool active(const Pass& pass) const {
+        return pass.lastFrame + 1 == frame;
+    }
+
+    void writeLog(unsigned int completedFrame) {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "{\"frame\": %u, \"gpu_ms\": %.3f, \"passes\": {", completedFrame, frameGpuMs);
+        *log << buffer;
+        bool first = true;
+        for (const Pass& pass : passes) {
+            if (pass.resultFrame != completedFrame) continue; // did not run in that frame
+            snprintf(buffer, sizeof(buffer), "%s\"%s\": {\"gpu_ms\": %.3f, \"cpu_ms\": %.3f, \"vs_invocations\": %llu, \"fs_invocations\": %llu}",
+                first ? "" : ", ", pass.name.c_str(), pass.gpuMs, pass.cpuMs,
+                (unsigned long long)pass.vertexInvocations, (unsigned long long)pass.fragmentInvocations);
+            *log << buffer;
+            first = false;
+        }
+        *log << "}}\n";
+    }
+};
+
+// Deferred shading: opaque surfaces write albedo, normal, roughness and
+// metalness to a G-buffer, then one fullscreen pass shades each visible
+// pixel once. Point lights come from the clustered light lists, which act
+// as screen-space tiles, so hidden fragments never pay for lighting.
+// Transparent surfaces are drawn forward on top afterwards.
+class DeferredRenderer {
+public:
+    GLuint gbufferProgram = 0;
+    LightVariants lightingVariants;
+
+    void requestPrograms() {
+        std::string header = std::string(shaderVersion) + frameDataSource;
+        gbufferProgram = createShaderProgram(header + objectDataSource + vertexShaderSource,
+            header + objectDataSource + lodDitherSource + gbufferFragmentSource);
+        lightingVariants.request(std::string(shaderVersion) + fullscreenVertexSource, shaderVersion,
+            std::string(frameDataSource) + lightingSource + deferredLightingSource, configureLightingProgram);
+    }
+
+    void init() {
+        programCache.finish(gbufferProgram);
+        UniformBuffers::bindBlocks(gbufferProgram);
+        lightingVariants.init();
+
+        // Core profile needs a bound VAO even when no attributes are read
+        glGenVertexArrays(1, &emptyVAO);
+    }
+
+    // (Re)allocates the G-buffer when the framebuffer size changes
+    void resize(int newWidth, int newHeight) {
+        if (newWidth == width && newHeight == height && FBO) return;
+        releaseTargets();
+        width = newWidth;
+        height = newHeight;
+        if (width <= 0 || height <= 0) return;
+
+        glGenFramebuffers(1, &FBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        albedoTexture = createTarget(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        normalTexture = createTarget(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+        depthTexture = createTarget(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedoTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normalTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+
+        GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, drawBuffers);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cout << "G-buffer framebuffer is incomplete" << std::endl;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    // Geometry pass: the caller draws the opaque queue range in between
+    void beginGeometryPass() {
+        glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glViewport(0, 0, width, height);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glDisable(GL_BLEND);
+    }
+
+    // Lighting pass: shades the G-buffer into the target framebuffer and
+    // copies the opaque depth through gl_FragDepth (a depth blit into a
+    // multisampled scene target is not allowed)
+    void lightingPass(GLuint targetFramebuffer) {
+        glBindFramebuffer(GL_FRAMEBUFFER, targetFramebuffer);
+        glViewport(0, 0, width, height);
+
+        glActiveTexture(GL_TEXTURE0 + ALBEDO_UNIT);
+        glBindTexture(GL_TEXTURE_2D, albedoTexture);
+        glActiveTexture(GL_TEXTURE0 + NORMAL_UNIT);
+        glBindTexture(GL_TEXTURE_2D, normalTexture);
+        glActiveTexture(GL_TEXTURE0 + DEPTH_UNIT);
+        glBindTexture(GL_TEXTURE_2D, depthTexture);
+        glActiveTexture(GL_TEXTURE0);
+
+        glDepthFunc(GL_ALWAYS);
+        glUseProgram(lightingVariants.active);
+        glBindVertexArray(emptyVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        glDepthFunc(GL_LESS);
+        glEnable(GL_BLEND);
+    }
+
+    void destroy() {
+        releaseTargets();
+        if (emptyVAO) glDeleteVertexArrays(1, &emptyVAO);
+        if (gbufferProgram) glDeleteProgram(gbufferProgram);
+        lightingVariants.destroy();
+        emptyVAO = gbufferProgram = 0;
+    }
+
+private:
+    // Units 0-3 stay free for material textures; 4-6 belong to the clusters
+    enum { ALBEDO_UNIT = 7, NORMAL_UNIT = 8, DEPTH_UNIT = 9 };
+
+    static void configureLightingProgram(GLuint program) {
+        configureForwardProgram(program);
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "gAlbedo"), ALBEDO_UNIT);
+        glUniform1i(glGetUniformLocation(program, "gNormal"), NORMAL_UNIT);
+        glUniform1i(glGetUniformLocation(program, "gDepth"), DEPTH_UNIT);
+        glUseProgram(0);
+    }
+
+    GLuint FBO = 0, albedoTexture = 0, normalTexture = 0, depthTexture = 0, emptyVAO = 0;
+    int width = 0, height = 0;
+
+    GLuint createTarget(GLint internalFormat, GLenum format, GLenum type) {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return texture;
+    }
+
+    void releaseTargets() {
+        if (FBO) glDeleteFramebuffers(1, &FBO);
+        GLuint textures[] = { albedoTexture, normalTexture, depthTexture };
+        if (albedoTexture) glDeleteTextures(3, textures);
+        FBO = albedoTexture = normalTexture = depthTexture = 0;
+    }
+};
+
+// Offscreen target for the camera passes when they run below the output
+// resolution, with MSAA or ahead of a post-process anti-aliasing pass:
+// color and depth at the internal size, which present() resolves and
+// upscales into the output with a linear blit. Single-sampled storage is
+// textures, so post passes can read it; multisampled storage is
+// renderbuffers with a resolve texture. At the output size without MSAA
+// or post-processing the passes draw straight into the output and
+// present() does nothing.
+class SceneTarget {
+public:
+    GLuint framebuffer = 0; // what the camera passes draw into
+    int width = 0, height = 0, samples = 0;
+    int storedSamples = 0;  // what the driver allocated; it may round the request up
+
+    // Once per frame; reallocates only when the size, the sample count or
+    // the need for readable textures changes
+    void resize(int newWidth, int newHeight, int newSamples, bool readable, GLuint output, int outputWidth, int outputHeight) {
+        if (newSamples == 0 && !readable && newWidth == outputWidth && newHeight == outputHeight) {
+            releaseTargets();
+            framebuffer = output;
+            width = newWidth;
+            height = newHeight;
+            samples = storedSamples = 0;
+        }
+        else if (!FBO || newWidth != width || newHeight != height || newSamples != samples || (readable && !colorTexture())) {
+            releaseTargets();
+            width = newWidth;
+            height = newHeight;
+            samples = storedSamples = newSamples;
+            glGenFramebuffers(1, &FBO);
+            glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+            if (samples > 0) {
+                renderbuffers[0] = createRenderbuffer(GL_RGBA8, GL_COLOR_ATTACHMENT0);
+                renderbuffers[1] = createRenderbuffer(GL_DEPTH_COMPONENT24, GL_DEPTH_ATTACHMENT);
+            }
+            else {
+                textures[0] = createTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_COLOR_ATTACHMENT0);
+                textures[1] = createTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_DEPTH_ATTACHMENT);
+            }
+            checkStatus();
+
+            // A multisampled source only blits at 1:1, so scaling or reading resolves first
+            if (samples > 0 && (readable || width != outputWidth || height != outputHeight)) {
+                glGenFramebuffers(1, &resolveFBO);
+                glBindFramebuffer(GL_FRAMEBUFFER, resolveFBO);
+                resolveTexture = createTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_COLOR_ATTACHMENT0);
+                checkStatus();
+            }
+            framebuffer = FBO;
+        }
+    }
+
+    bool offscreen() const { return FBO != 0; }
+
+    // Single-sampled scene color for post passes (after resolve() with MSAA)
+    GLuint colorTexture() const { return samples > 0 ? resolveTexture : textures[0]; }
+    GLuint depthTexture() const { return textures[1]; }
+
+    void resolve() {
+        if (!resolveFBO) return;
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, FBO);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFBO);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+
+    // Resolves and upscales into the output and leaves it bound
+    void present(GLuint output, int outputWidth, int outputHeight) {
+        if (FBO) {
+            resolve();
+            bool scaled = width != outputWidth || height != outputHeight;
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, resolveFBO ? resolveFBO : FBO);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output);
+            glBlitFramebuffer(0, 0, width, height, 0, 0, outputWidth, outputHeight, GL_COLOR_BUFFER_BIT, scaled ? GL_LINEAR : GL_NEAREST);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, output);
+        glViewport(0, 0, outputWidth, outputHeight);
+    }
+
+    // GPU memory of the color and depth storage, counting 4 bytes per depth sample
+    size_t bytes() const {
+        if (!FBO) return 0;
+        size_t pixels = (size_t)width * height;
+        return pixels * 8 * std::max(1, storedSamples) + (resolveFBO ? pixels * 4 : 0);
+    }
+
+    void destroy() {
+        releaseTargets();
+        framebuffer = 0;
+    }
+
+private:
+    GLuint FBO = 0, renderbuffers[2] = {}, textures[2] = {}, resolveFBO = 0, resolveTexture = 0;
+
+    GLuint createRenderbuffer(GLenum format, GLenum attachment) {
+        GLuint renderbuffer;
+        glGenRenderbuffers(1, &renderbuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, format, width, height);
+        glGetRenderbufferParameteriv(GL_RENDERBUFFER, GL_RENDERBUFFER_SAMPLES, &storedSamples);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, attachment, GL_RENDERBUFFER, renderbuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        return renderbuffer;
+    }
+
+    GLuint createTexture(GLint internalFormat, GLenum format, GLenum type, GLenum attachment) {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, texture, 0);
+        return texture;
+    }
+
+    void checkStatus() {
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cout << "Scene target framebuffer is incomplete (" << width << "x" << height << ", " << samples << " samples)" << std::endl;
+        }
+    }
+
+    void releaseTargets() {
+        if (FBO) glDeleteFramebuffers(1, &FBO);
+        if (resolveFBO) glDeleteFramebuffers(1, &resolveFBO);
+        if (renderbuffers[0]) glDeleteRenderbuffers(2, renderbuffers);
+        if (textures[0]) glDeleteTextures(2, textures);
+        if (resolveTexture) glDeleteTextures(1, &resolveTexture);
+        FBO = resolveFBO = resolveTexture = 0;
+        renderbuffers[0] = renderbuffers[1] = textures[0] = textures[1] = 0;
+    }
+};
+
+// Anti-aliasing modes: post-process passes over a single-sampled scene, or
+// MSAA in the scene target (the governor may lower the sample count)
+enum AntiAliasingMode { AA_NONE, AA_FXAA, AA_SMAA, AA_TAA, AA_MSAA2, AA_MSAA4, AA_MSAA8, AA_MODE_COUNT };
+const char* AA_MODE_NAMES[AA_MODE_COUNT] = { "none", "fxaa", "smaa", "taa", "msaa2", "msaa4", "msaa8" };
+const int AA_MODE_SAMPLES[AA_MODE_COUNT] = { 0, 0, 0, 0, 2, 4, 8 };
+
+bool isPostProcessAA(AntiAliasingMode mode) {
+    return mode == AA_FXAA || mode == AA_SMAA || mode == AA_TAA;
+}
+
+// FXAA-style single pass: where the local luma range is high, blur along
+// the edge, i.e. across the luma gradient, and fall back to the shorter
+// blur when the longer one overshoots the range. Runs at the output size,
+// so it upscales in the same pass.
+const char* fxaaSource = R"(
+out vec4 FragColor;
+
+uniform sampler2D sceneColor;
+uniform vec2 outputSize;
+
+float luma(vec3 color) { return dot(color, vec3(0.299, 0.587, 0.114)); }
+
+void main() {
+    vec2 texel = 1.0 / vec2(textureSize(sceneColor, 0));
+    vec2 uv = gl_FragCoord.xy / outputSize;
+    vec3 rgbM = texture(sceneColor, uv).rgb;
+    float lumaM = luma(rgbM);
+    float lumaNW = luma(texture(sceneColor, uv + vec2(-1.0, 1.0) * texel).rgb);
+    float lumaNE = luma(texture(sceneColor, uv + vec2(1.0, 1.0) * texel).rgb);
+    float lumaSW = luma(texture(sceneColor, uv + vec2(-1.0, -1.0) * texel).rgb);
+    float lumaSE = luma(texture(sceneColor, uv + vec2(1.0, -1.0) * texel).rgb);
+    float lumaMin = min(lumaM, min(min(lumaNW, lumaNE), min(lumaSW, lumaSE)));
+    float lumaMax = max(lumaM, max(max(lumaNW, lumaNE), max(lumaSW, lumaSE)));
+    if(lumaMax - lumaMin < max(0.0312, lumaMax * 0.125)) {
+        FragColor = vec4(rgbM, 1.0);
+        return;
+    }
+
+    vec2 dir = vec2((lumaNW + lumaNE) - (lumaSW + lumaSE), (lumaNW + lumaSW) - (lumaNE + lumaSE));
+    float dirReduce = max((lumaNW + lumaNE + lumaSW + lumaSE) * (0.25 / 8.0), 1.0 / 128.0);
+    float rcpDirMin = 1.0 / (min(abs(dir.x), abs(dir.y)) + dirReduce);
+    dir = clamp(dir * rcpDirMin, -8.0, 8.0) * texel;
+
+    vec3 rgbA = 0.5 * (texture(sceneColor, uv + dir * (1.0 / 3.0 - 0.5)).rgb + texture(sceneColor, uv + dir * (2.0 / 3.0 - 0.5)).rgb);
+    vec3 rgbB = rgbA * 0.5 + 0.25 * (texture(sceneColor, uv - dir * 0.5).rgb + texture(sceneColor, uv + dir * 0.5).rgb);
+    float lumaB = luma(rgbB);
+    FragColor = vec4(lumaB < lumaMin || lumaB > lumaMax ? rgbA : rgbB, 1.0);
+}
+)";
+
+// SMAA-lite, pass 1: luma edges to the left and lower neighbor, with
+// SMAA's local contrast adaptation (an edge next to one more than twice as
+// strong is dropped). Pixels without edges are discarded over a cleared target.
+const char* smaaEdgeSource = R"(
+out vec2 Edges; // x = edge to the left neighbor, y = edge to the neighbor below
+
+uniform sampler2D sceneColor;
+
+const float THRESHOLD = 0.05;
+
+float luma(ivec2 pixel) {
+    ivec2 size = textureSize(sceneColor, 0);
+    return dot(texelFetch(sceneColor, clamp(pixel, ivec2(0), size - 1), 0).rgb, vec3(0.299, 0.587, 0.114));
+}
+
+void main() {
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float center = luma(pixel);
+    vec2 delta = abs(center - vec2(luma(pixel - ivec2(1, 0)), luma(pixel - ivec2(0, 1))));
+    vec2 edges = step(THRESHOLD, delta);
+    if(edges.x + edges.y == 0.0) discard;
+
+    float strongest = max(max(delta.x, delta.y), max(abs(center - luma(pixel + ivec2(1, 0))), abs(center - luma(pixel + ivec2(0, 1)))));
+    Edges = edges * step(strongest, 2.0 * delta);
+}
+)";
+
+// SMAA-lite, pass 2: the blending weights and the blend in one pass, with
+// a short search in place of SMAA's precomputed area and search textures.
+// Each of a pixel's four edges is followed both ways to the ends of its
+// run (at most MAX_SEARCH pixels). An end whose crossing edge lies on this
+// pixel's side means the silhouette bends into this pixel (MLAA's L and Z
+// shapes): the blend line falls from half a pixel at that end to zero at
+// the middle of the run, or at the far end when nothing crosses there, and
+// the area under it is how much of the neighbor's color this pixel takes.
+const char* smaaBlendSource = R"(
+out vec4 FragColor;
+
+uniform sampler2D sceneColor;
+uniform sampler2D edgeTexture;
+
+const int MAX_SEARCH = 8;
+
+ivec2 size;
+
+bool edgeAt(ivec2 pixel, int axis) {
+    return texelFetch(edgeTexture, clamp(pixel, ivec2(0), size - 1), 0)[axis] > 0.5;
+}
+
+// Area under 0.5 * (1 - t / span) over this pixel's stretch [d, d + 1]
+float ramp(float d, float span) {
+    float b = min(d + 1.0, span);
+    if(b <= d) return 0.0;
+    return 0.5 * ((b - d) - (b * b - d * d) / (2.0 * span));
+}
+
+// The edge between two pixels is stored in the right or upper one
+float coverage(ivec2 mine, ivec2 other, int axis, ivec2 along) {
+    ivec2 stored = max(mine, other);
+    if(!edgeAt(stored, axis)) return 0.0;
+    int down = 0, up = 0;
+    while(down < MAX_SEARCH && edgeAt(stored - (down + 1) * along, axis)) down++;
+    while(up < MAX_SEARCH && edgeAt(stored + (up + 1) * along, axis)) up++;
+
+    // Crossing edges below the first and above the last pixel of the run;
+    // only one on exactly one side is a bend
+    int cross = 1 - axis;
+    bool mineDown = edgeAt(mine - down * along, cross), otherDown = edgeAt(other - down * along, cross);
+    bool mineUp = edgeAt(mine + (up + 1) * along, cross), otherUp = edgeAt(other + (up + 1) * along, cross);
+    bool bendsDown = mineDown != otherDown, bendsUp = mineUp != otherUp;
+    float runLength = float(down + up + 1);
+    float area = 0.0;
+    if(bendsDown && mineDown) area = max(area, ramp(float(down), bendsUp ? runLength * 0.5 : runLength));
+    if(bendsUp && mineUp) area = max(area, ramp(float(up), bendsDown ? runLength * 0.5 : runLength));
+    return area;
+}
+
+vec3 colorAt(ivec2 pixel) {
+    return texelFetch(sceneColor, clamp(pixel, ivec2(0), size - 1), 0).rgb;
+}
+
+void main() {
+    size = textureSize(sceneColor, 0);
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec4 weights = vec4(
+        coverage(pixel, pixel - ivec2(1, 0), 0, ivec2(0, 1)),
+        coverage(pixel, pixel + ivec2(1, 0), 0, ivec2(0, 1)),
+        coverage(pixel, pixel - ivec2(0, 1), 1, ivec2(1, 0)),
+        coverage(pixel, pixel + ivec2(0, 1), 1, ivec2(1, 0)));
+    vec3 color = colorAt(pixel);
+    float total = weights.x + weights.y + weights.z + weights.w;
+    if(total > 0.0) {
+        weights /= max(total, 1.0);
+        color = color * max(1.0 - total, 0.0)
+            + weights.x * colorAt(pixel - ivec2(1, 0)) + weights.y * colorAt(pixel + ivec2(1, 0))
+            + weights.z * colorAt(pixel - ivec2(0, 1)) + weights.w * colorAt(pixel + ivec2(0, 1));
+    }
+    FragColor = vec4(color, 1.0);
+}
+)";
+
+// TAA resolve: the camera is jittered by a sub-pixel Halton offset each
+// frame and this pass folds the new frame into the accumulated history.
+// The history is fetched where the surface was last frame (depth
+// reprojection; the scene itself does not move) and clamped to the color
+// range around the pixel, which rejects stale history at disocclusions.
+const char* taaSource = R"(
+out vec4 FragColor;
+
+uniform sampler2D sceneColor;
+uniform sampler2D sceneDepth;
+uniform sampler2D history;
+uniform mat4 reprojection;   // this frame's clip space to last frame's, both unjittered
+uniform float historyWeight; // 0 right after a reset
+
+void main() {
+    ivec2 size = textureSize(sceneColor, 0);
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec3 current = texelFetch(sceneColor, pixel, 0).rgb;
+
+    // The nearest depth around, so silhouettes reproject with the foreground
+    vec3 low = current, high = current;
+    float depth = 1.0;
+    for(int y = -1; y <= 1; ++y) {
+        for(int x = -1; x <= 1; ++x) {
+            ivec2 neighbor = clamp(pixel + ivec2(x, y), ivec2(0), size - 1);
+            vec3 color = texelFetch(sceneColor, neighbor, 0).rgb;
+            low = min(low, color);
+            high = max(high, color);
+            depth = min(depth, texelFetch(sceneDepth, neighbor, 0).r);
+        }
+    }
+
+    vec2 uv = (vec2(pixel) + 0.5) / vec2(size);
+    vec4 previous = reprojection * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec2 historyUv = previous.xy / previous.w * 0.5 + 0.5;
+    float weight = historyWeight;
+    if(any(lessThan(historyUv, vec2(0.0))) || any(greaterThan(historyUv, vec2(1.0)))) weight = 0.0;
+
+    vec3 past = clamp(texture(history, historyUv).rgb, low, high);
+    FragColor = vec4(mix(current, past, weight), 1.0);
+}
+)";
+
+// Post-process anti-aliasing over the scene target's textures. FXAA
+// writes the output directly; SMAA-lite and TAA work at the internal size
+// and blit into the output, upscaling when the governor lowered the
+// resolution. Targets are sized for the current mode only, so bytes() is
+// that mode's memory.
+class PostAntiAliasing {
+public:
+    void requestPrograms() {
+        std::string vertex = std::string(shaderVersion) + fullscreenVertexSource;
+        fxaaProgram = createShaderProgram(vertex, std::string(shaderVersion) + fxaaSource);
+        edgeProgram = createShaderProgram(vertex, std::string(shaderVersion) + smaaEdgeSource);
+        blendProgram = createShaderProgram(vertex, std::string(shaderVersion) + smaaBlendSource);
+        taaProgram = createShaderProgram(vertex, std::string(shaderVersion) + taaSource);
+    }
+
+    void init() {
+        GLuint programs[] = { fxaaProgram, edgeProgram, blendProgram, taaProgram };
+        for (GLuint program : programs) {
+            programCache.finish(program);
+            glUseProgram(program);
+            glUniform1i(glGetUniformLocation(program, "sceneColor"), COLOR_UNIT);
+            glUniform1i(glGetUniformLocation(program, "sceneDepth"), DEPTH_UNIT);
+            glUniform1i(glGetUniformLocation(program, "edgeTexture"), AUX_UNIT);
+            glUniform1i(glGetUniformLocation(program, "history"), AUX_UNIT);
+        }
+        glUseProgram(0);
+        outputSizeLocation = glGetUniformLocation(fxaaProgram, "outputSize");
+        reprojectionLocation = glGetUniformLocation(taaProgram, "reprojection");
+        historyWeightLocation = glGetUniformLocation(taaProgram, "historyWeight");
+        glGenVertexArrays(1, &emptyVAO);
+    }
+
+    // This frame's sub-pixel camera offset in NDC, from an 8-entry Halton (2, 3) sequence
+    glm::vec2 jitter(int width, int height) const {
+        int index = frame % 8 + 1;
+        return glm::vec2((halton(index, 2) - 0.5f) * 2.0f / width, (halton(index, 3) - 0.5f) * 2.0f / height);
+    }
+
+    // TAA still accumulating after the camera last moved; keeps on-demand
+    // rendering going until the still image has converged
+    bool converging() const { return stillFrames < CONVERGE_FRAMES; }
+
+    void resetHistory() {
+        historyValid = false;
+        stillFrames = 0;
+    }
+
+    // Runs the mode's passes from the scene target into the output and
+    // leaves the output bound. viewProjection is this frame's, unjittered.
+    void apply(AntiAliasingMode mode, SceneTarget& target, const glm::mat4& viewProjection, GLuint output, int outputWidth, int outputHeight) {
+        int width = target.width, height = target.height;
+        bool scaled = width != outputWidth || height != outputHeight;
+        resize(mode, width, height, scaled);
+        target.resolve();
+
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_BLEND);
+        glBindVertexArray(emptyVAO);
+        glActiveTexture(GL_TEXTURE0 + COLOR_UNIT);
+        glBindTexture(GL_TEXTURE_2D, target.colorTexture());
+
+        if (mode == AA_FXAA) {
+            glBindFramebuffer(GL_FRAMEBUFFER, output);
+            glViewport(0, 0, outputWidth, outputHeight);
+            glUseProgram(fxaaProgram);
+            glUniform2f(outputSizeLocation, (float)outputWidth, (float)outputHeight);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+        }
+        else if (mode == AA_SMAA) {
+            glBindFramebuffer(GL_FRAMEBUFFER, edgeFBO);
+            glViewport(0, 0, width, height);
+            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+            glUseProgram(edgeProgram);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, scaled ? colorFBO[0] : output);
+            glActiveTexture(GL_TEXTURE0 + AUX_UNIT);
+            glBindTexture(GL_TEXTURE_2D, edgeTexture);
+            glUseProgram(blendProgram);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            if (scaled) blit(colorFBO[0], width, height, output, outputWidth, outputHeight);
+        }
+        else if (mode == AA_TAA) {
+            stillFrames = viewProjection == previousViewProjection ? stillFrames + 1 : 0;
+            int next = 1 - current;
+            glBindFramebuffer(GL_FRAMEBUFFER, colorFBO[next]);
+            glViewport(0, 0, width, height);
+            glActiveTexture(GL_TEXTURE0 + DEPTH_UNIT);
+            glBindTexture(GL_TEXTURE_2D, target.depthTexture());
+            glActiveTexture(GL_TEXTURE0 + AUX_UNIT);
+            glBindTexture(GL_TEXTURE_2D, colorTexture[current]);
+            glUseProgram(taaProgram);
+            glm::mat4 reprojection = previousViewProjection * glm::inverse(viewProjection);
+            glUniformMatrix4fv(reprojectionLocation, 1, GL_FALSE, glm::value_ptr(reprojection));
+            glUniform1f(historyWeightLocation, historyValid ? HISTORY_WEIGHT : 0.0f);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            blit(colorFBO[next], width, height, output, outputWidth, outputHeight);
+
+            current = next;
+            previousViewProjection = viewProjection;
+            historyValid = true;
+        }
+        frame++;
+
+        // Unbound again, so no pass samples a texture it renders into
+        GLenum units[] = { COLOR_UNIT, DEPTH_UNIT, AUX_UNIT };
+        for (GLenum unit : units) {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindVertexArray(0);
+        glUseProgram(0);
+        glEnable(GL_DEPTH_TEST);
+        glEnable(GL_BLEND);
+        glBindFramebuffer(GL_FRAMEBUFFER, output);
+        glViewport(0, 0, outputWidth, outputHeight);
+    }
+
+    // When switching to a mode without post passes
+    void releaseTargets() {
+        if (edgeFBO) glDeleteFramebuffers(1, &edgeFBO);
+        if (edgeTexture) glDeleteTextures(1, &edgeTexture);
+        for (int i = 0; i < 2; ++i) {
+            if (colorFBO[i]) glDeleteFramebuffers(1, &colorFBO[i]);
+            if (colorTexture[i]) glDeleteTextures(1, &colorTexture[i]);
+            colorFBO[i] = colorTexture[i] = 0;
+        }
+        edgeFBO = edgeTexture = 0;
+        targetMode = AA_NONE;
+        colorCount = 0;
+    }
+
+    size_t bytes() const {
+        size_t pixels = (size_t)width * height;
+        return (edgeTexture ? pixels * 2 : 0) + (colorTexture[0] ? pixels * 4 : 0) + (colorTexture[1] ? pixels * 4 : 0);
+    }
+
+    void destroy() {
+        releaseTargets();
+        GLuint programs[] = { fxaaProgram, edgeProgram, blendProgram, taaProgram };
+        for (GLuint program : programs) {
+            if (program) glDeleteProgram(program);
+        }
+        if (emptyVAO) glDeleteVertexArrays(1, &emptyVAO);
+        fxaaProgram = edgeProgram = blendProgram = taaProgram = emptyVAO = 0;
+    }
+
+private:
+    enum { COLOR_UNIT = 11, DEPTH_UNIT = 12, AUX_UNIT = 13 }; // after the shadow unit
+    static const int CONVERGE_FRAMES = 16;
+    static constexpr float HISTORY_WEIGHT = 0.9f;
+
+    GLuint fxaaProgram = 0, edgeProgram = 0, blendProgram = 0, taaProgram = 0, emptyVAO = 0;
+    GLint outputSizeLocation = -1, reprojectionLocation = -1, historyWeightLocation = -1;
+    GLuint edgeFBO = 0, edgeTexture = 0, colorFBO[2] = {}, colorTexture[2] = {};
+    AntiAliasingMode targetMode = AA_NONE;
+    int width = 0, height = 0, colorCount = 0;
+    int current = 0;
+    unsigned int frame = 0;
+    int stillFrames = 0;
+    bool historyValid = false;
+    glm::mat4 previousViewProjection = glm::mat4(1.0f);
+
+    static float halton(int index, int base) {
+        float result = 0.0f, fraction = 1.0f / base;
+        for (; index > 0; index /= base, fraction /= base) result += fraction * (index % base);
+        return result;
+    }
+
+    // SMAA needs the edge texture, plus a color target when it has to
+    // upscale; TAA needs two colors to ping-pong its history
+    void resize(AntiAliasingMode mode, int newWidth, int newHeight, bool scaled) {
+        int colors = mode == AA_TAA ? 2 : mode == AA_SMAA && scaled ? 1 : 0;
+        if (mode == targetMode && newWidth == width && newHeight == height && colors == colorCount) return;
+        releaseTargets();
+        resetHistory();
+        targetMode = mode;
+        width = newWidth;
+        height = newHeight;
+        colorCount = colors;
+        if (mode == AA_SMAA) edgeTexture = createTarget(edgeFBO, GL_RG8, GL_RG);
+        for (int i = 0; i < colors; ++i) colorTexture[i] = createTarget(colorFBO[i], GL_RGBA8, GL_RGBA);
+    }
+
+    GLuint createTarget(GLuint& fbo, GLint internalFormat, GLenum format) {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cout << "Anti-aliasing framebuffer is incomplete" << std::endl;
+        }
+        return texture;
+    }
+
+    void blit(GLuint source, int sourceWidth, int sourceHeight, GLuint output, int outputWidth, int outputHeight) {
+        bool scaled = sourceWidth != outputWidth || sourceHeight != outputHeight;
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, source);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output);
+        glBlitFramebuffer(0, 0, sourceWidth, sourceHeight, 0, 0, outputWidth, outputHeight, GL_COLOR_BUFFER_BIT, scaled ? GL_LINEAR : GL_NEAREST);
+    }
+
+};
+
+// Frame-time governor: holds the frame time near a target by trading
+// image quality for speed. Each frame's cost is the larger of the GPU frame
+// time (PassTimer, a few frames late) and the CPU time of render(),
+// smoothed by an exponential moving average. Over budget, it steps one knob
+// down, MSAA samples first, then the internal resolution, then the
+// cylinder LOD detail; with clear headroom it steps back up in reverse
+// order. After a step the average restarts once the old setting's GPU
+// times are through, and the next decision waits SETTLE_FRAMES; an upgrade
+// that is undone right away holds further upgrades for a while, so it
+// does not oscillate. Every step is logged.
+const float GOVERNOR_SCALES[] = { 1.0f, 0.85f, 0.7f, 0.6f, 0.5f }; // internal resolution per axis
+const int GOVERNOR_SAMPLES[] = { 8, 4, 2, 0 };                      // MSAA, capped at maxSamples
+const float GOVERNOR_DETAIL[] = { 1.0f, 0.6f, 0.35f };              // scales the projected size LODs are picked by
+
+class FrameGovernor {
+public:
+    bool enabled = false;
+    double targetMs = 1000.0 / 60.0;
+    int maxSamples = 4;     // MSAA ceiling and the setting while disabled
+    double smoothedMs = 0.0;
+    int changes = 0;
+    std::ostream* log = &std::cout;
+
+    float scale() const { return GOVERNOR_SCALES[scaleStep]; }
+    int samples() const { return std::min(GOVERNOR_SAMPLES[sampleStep], maxSamples); }
+    float detail() const { return GOVERNOR_DETAIL[detailStep]; }
+    int scaled(int size) const { return std::max(1, (int)(size * scale() + 0.5f)); }
+
+    // Disabling goes back to full quality
+    void setEnabled(bool on) {
+        enabled = on;
+        reset();
+        *log << "Governor " << (on ? "ON" : "OFF") << ": target " << targetMs << " ms, " << settings() << std::endl;
+    }
+
+    // Back to full quality with a fresh average
+    void reset() {
+        scaleStep = detailStep = 0;
+        sampleStep = firstSampleStep();
+        sinceChange = sinceUpgrade = holdUpgrades = 0;
+        holdLength = SETTLE_FRAMES * 4;
+        smoothedMs = 0.0;
+    }
+
+    // Still measuring the last step; keeps frames coming while idle
+    bool adjusting() const { return enabled && changes > 0 && sinceChange < SETTLE_FRAMES; }
+
+    void update(double gpuMs, double cpuMs) {
+        if (!enabled) return;
+        sinceUpgrade++;
+        if (holdUpgrades > 0) holdUpgrades--;
+        if (++sinceChange <= RESULT_LAG) return;
+        double frameMs = std::max(gpuMs, cpuMs);
+        smoothedMs = sinceChange == RESULT_LAG + 1 ? frameMs : smoothedMs + SMOOTHING * (frameMs - smoothedMs);
+        if (sinceChange < SETTLE_FRAMES) return;
+
+        if (smoothedMs > targetMs * OVER_BUDGET) {
+            // Undoing the last upgrade: that setting does not fit, back off longer each time
+            if (sinceUpgrade < SETTLE_FRAMES * 2) {
+                holdUpgrades = holdLength;
+                holdLength = std::min(holdLength * 2, SETTLE_FRAMES * 64);
+            }
+            if (sampleStep < SAMPLE_STEPS - 1) step("msaa", sampleStep, +1, gpuMs, cpuMs);
+            else if (scaleStep < SCALE_STEPS - 1) step("render scale", scaleStep, +1, gpuMs, cpuMs);
+            else if (detailStep < DETAIL_STEPS - 1) step("cylinder detail", detailStep, +1, gpuMs, cpuMs);
+        }
+        else if (smoothedMs < targetMs * UNDER_BUDGET && holdUpgrades == 0) {
+            bool upgraded = true;
+            if (detailStep > 0) step("cylinder detail", detailStep, -1, gpuMs, cpuMs);
+            else if (scaleStep > 0) step("render scale", scaleStep, -1, gpuMs, cpuMs);
+            else if (sampleStep > firstSampleStep()) step("msaa", sampleStep, -1, gpuMs, cpuMs);
+            else upgraded = false;
+            if (upgraded) sinceUpgrade = 0;
+        }
+    }
 
-    GLuint shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
+    std::string settings() const {
+        char text[96];
+        snprintf(text, sizeof(text), "render scale %.0f%%, msaa %dx, cylinder detail %.0f%%", scale() * 100.0f, samples(), detail() * 100.0f);
+        return text;
+    }
 
-    int success;
-    char infoLog[512];
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-        std::cout << "Shader program linking failed: " << infoLog << std::endl;
+    std::string summary() const {
+        if (!enabled) return "governor off";
+        char text[64];
+        snprintf(text, sizeof(text), "governor %.1f/%.1f ms: ", smoothedMs, targetMs);
+        return text + settings();
     }
 
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
+private:
+    static const int RESULT_LAG = 3;     // PassTimer's query ring
+    static const int SETTLE_FRAMES = 12;
+    static constexpr double SMOOTHING = 0.2;
+    static constexpr double OVER_BUDGET = 1.05;  // step down above the target plus 5%
+    static constexpr double UNDER_BUDGET = 0.7; // step up below 70% of the target
+    static const int SCALE_STEPS = sizeof(GOVERNOR_SCALES) / sizeof(GOVERNOR_SCALES[0]);
+    static const int SAMPLE_STEPS = sizeof(GOVERNOR_SAMPLES) / sizeof(GOVERNOR_SAMPLES[0]);
+    static const int DETAIL_STEPS = sizeof(GOVERNOR_DETAIL) / sizeof(GOVERNOR_DETAIL[0]);
+
+    int scaleStep = 0, sampleStep = 1, detailStep = 0;
+    int sinceChange = 0, sinceUpgrade = 0;
+    int holdUpgrades = 0, holdLength = SETTLE_FRAMES * 4;
+
+    // Highest entry within the ceiling, so a step always changes the count
+    int firstSampleStep() const {
+        int first = 0;
+        while (first < SAMPLE_STEPS - 1 && GOVERNOR_SAMPLES[first] > maxSamples) first++;
+        return first;
+    }
 
-    return shaderProgram;
-}
+    void step(const char* knob, int& index, int direction, double gpuMs, double cpuMs) {
+        std::string before = settings();
+        index += direction;
+        sinceChange = 0;
+        changes++;
+        char text[160];
+        snprintf(text, sizeof(text), "Governor: %s %s (frame %.1f ms %s the %.1f ms target; gpu %.1f, cpu %.1f ms): ",
+            knob, direction > 0 ? "down" : "up", smoothedMs, direction > 0 ? "over" : "well under", targetMs, gpuMs, cpuMs);
+        *log << text << before << " -> " << settings() << std::endl;
+    }
+};
 
 // Global variables
 Scene scene;
 Camera camera;
-GLuint shaderProgram;
+LightVariants forwardVariants; // the forward shading program (direct submission) and its light variants
+UniformBuffers uniforms;
+RenderQueue renderQueue;
+ClusteredLighting clusteredLighting;
+DeferredRenderer deferredRenderer;
+ShadowMaps shadowMaps;
+IndirectDraws indirectDraws;
+OcclusionCuller occlusionCuller;
+PassTimer passTimer;
+SceneTarget sceneTarget;
+FrameGovernor governor;
+PostAntiAliasing postAntiAliasing;
+AntiAliasingMode antiAliasing = AA_MSAA4; // A key cycles the modes
+int supportedSamples = 0;                 // GL_MAX_SAMPLES
+bool showPassOverlay = false; // O key shows per-pass GPU/CPU time bars
+bool useDeferredShading = false; // G key switches between forward and deferred shading
+bool useClusteredLighting = true; // K key toggles back to looping over every light
+bool useSortedQueue = true; // Q key toggles back to insertion order for comparison
+bool useIndirectDraws = true; // M key toggles back to one draw call per item (when MDI is supported)
+bool useLods = true;           // V key toggles prefab part LOD selection
+bool useOcclusionCulling = true; // H key toggles Hi-Z occlusion culling (indirect path only)
+bool useLodCrossfade = true;   // F key toggles the dithered crossfade between LOD levels
+bool useLightVariants = true;  // P key toggles back to the generic light loop
+Prefab::LodStats lodStats;     // last frame's LOD selection
+
+// Render on demand: a frame is drawn only when input, the camera, the
+// lighting or an animation changed something; otherwise the main loop
+// sleeps in glfwWaitEventsTimeout instead of presenting the same image
+struct RedrawState {
+    bool onDemand = true;     // I key toggles continuous rendering for comparison
+    double frameBudget = 0.0; // minimum seconds between frames, 0 = uncapped
+    bool dirty = true;        // set by the input callbacks, cleared once a frame is drawn
+    double lastFrameTime = 0.0;
+
+    void request() { dirty = true; }
+
+    // Changes that keep coming without input: the overview orbit, LOD fades,
+    // geometry that is still uploading, the governor measuring a step and
+    // TAA converging
+    bool animating() const {
+        return camera.mode == 1 || lodStats.fading > 0 || geometryUploader.busy() || governor.adjusting()
+            || (antiAliasing == AA_TAA && postAntiAliasing.converging());
+    }
+
+    bool wanted() const { return !onDemand || dirty || animating(); }
+};
+RedrawState redraw;
+
+// CPU utilization (100% = one busy core) and frame rate between samples
+struct CpuMeter {
+    double lastWall = 0.0, lastCpu = 0.0;
+    int frames = 0;
+    double percent = 0.0, framesPerSecond = 0.0;
+
+    void sample(double wall) {
+        double cpu = cpuusage::processSeconds();
+        if (wall > lastWall) {
+            percent = 100.0 * (cpu - lastCpu) / (wall - lastWall);
+            framesPerSecond = frames / (wall - lastWall);
+        }
+        lastWall = wall;
+        lastCpu = cpu;
+        frames = 0;
+    }
+
+    std::string summary() const {
+        char text[96];
+        snprintf(text, sizeof(text), "cpu %.0f%% at %.1f fps (%s)", percent, framesPerSecond,
+            redraw.onDemand ? "on demand" : "continuous");
+        return text;
+    }
+};
+CpuMeter cpuMeter;
 int windowWidth = 1200, windowHeight = 800;
+GLuint outputFramebuffer = 0; // the window, or the offscreen target in benchmark mode
+bool useStaticBatching = true; // B key toggles back to the per-mesh path for comparison
+bool useFrustumCulling = true; // C key toggles BVH frustum culling
+SceneBVH sceneBVH;
+CullStats cullStats;
+std::vector<Mesh*> visibleMeshes;
+bool sceneFromSnapshot = false; // startup mapped a scene snapshot instead of generating
+double sceneSetupMs = 0.0;      // scene generation or snapshot load, excluding writing one
+double startupMs = 0.0;         // main() to the first frame: context, programs and scene
 bool mousePressed = false;
 double lastMouseX, lastMouseY;
 
+// MSAA modes set the governor's sample ceiling, capped at what the
+// driver supports; post-process modes render the scene single-sampled
+void setAntiAliasing(AntiAliasingMode mode) {
+    antiAliasing = mode;
+    governor.maxSamples = std::min(AA_MODE_SAMPLES[mode], supportedSamples);
+    governor.reset();
+    postAntiAliasing.resetHistory();
+    if (!isPostProcessAA(mode)) postAntiAliasing.releaseTargets();
+}
+
+// Cost of the current mode: the GPU time of its own pass (the post pass,
+// or the MSAA resolve in present), the whole GPU frame (MSAA makes every
+// scene pass dearer) and the memory of the scene and post targets
+std::string antiAliasingReport() {
+    std::string name = AA_MODE_NAMES[antiAliasing];
+    if (sceneTarget.storedSamples != AA_MODE_SAMPLES[antiAliasing]) name += " at " + std::to_string(sceneTarget.storedSamples) + "x";
+    char text[128];
+    snprintf(text, sizeof(text), ": %.2f ms aa pass, %.2f ms gpu frame, %.1f MB of targets",
+        passTimer.gpuMs("antialiasing") + passTimer.gpuMs("present"), passTimer.frameGpuMs,
+        (sceneTarget.bytes() + postAntiAliasing.bytes()) / (1024.0 * 1024.0));
+    return name + text;
+}
+
 // Input callbacks
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) {
     if (button == GLFW_MOUSE_BUTTON_LEFT) {
@@ -648,15 +5082,18 @@ void cursorPosCallback(GLFWwindow* window, double xpos, double ypos) {
         camera.rotate(deltaX, deltaY);
         lastMouseX = xpos;
         lastMouseY = ypos;
+        redraw.request();
     }
 }
 
 void scrollCallback(GLFWwindow* window, double xoffset, double yoffset) {
     camera.zoom((float)yoffset);
+    redraw.request();
 }
 
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
     if (action == GLFW_PRESS) {
+        redraw.request(); // every binding changes the camera, the lighting or a render path
         switch (key) {
         case GLFW_KEY_ESCAPE:
             glfwSetWindowShouldClose(window, true);
@@ -676,11 +5113,85 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
         case GLFW_KEY_L:
             scene.toggleLighting();
             break;
+        case GLFW_KEY_Q:
+            std::cout << "Render queue " << (useSortedQueue ? "sorted" : "insertion order") << ": "
+                << renderQueue.stats.draws << " draws, " << renderQueue.stats.stateChanges << " state changes ("
+                << renderQueue.stats.unsortedStateChanges - renderQueue.stats.stateChanges << " avoided), "
+                << renderQueue.stats.multiDraws << " multi-draw calls, " << renderQueue.stats.occlusionCulled
+                << " occluded commands, overdraw " << renderQueue.stats.overdraw << std::endl;
+            useSortedQueue = !useSortedQueue;
+            break;
+        case GLFW_KEY_K:
+            useClusteredLighting = !useClusteredLighting;
+            std::cout << "Clustered lighting " << (useClusteredLighting ? "ON" : "OFF") << std::endl;
+            break;
+        case GLFW_KEY_G:
+            useDeferredShading = !useDeferredShading;
+            std::cout << (useDeferredShading ? "Deferred" : "Forward") << " shading" << std::endl;
+            break;
+        case GLFW_KEY_O:
+            showPassOverlay = !showPassOverlay;
+            std::cout << "Pass timings: " << passTimer.summary() << std::endl;
+            break;
+        case GLFW_KEY_S:
+            shadowMaps.enabled = !shadowMaps.enabled;
+            std::cout << "Shadows " << (shadowMaps.enabled ? "ON" : "OFF") << " (static cache rebuilt "
+                << shadowMaps.staticRenders << " times)" << std::endl;
+            break;
+        case GLFW_KEY_C:
+            useFrustumCulling = !useFrustumCulling;
+            std::cout << "Frustum culling " << (useFrustumCulling ? "ON" : "OFF") << std::endl;
+            break;
+        case GLFW_KEY_M:
+            useIndirectDraws = !useIndirectDraws;
+            if (!indirectDraws.supported) std::cout << "Multi-draw indirect needs GL 4.3 and ARB_buffer_storage" << std::endl;
+            else std::cout << "Multi-draw indirect " << (useIndirectDraws ? "ON" : "OFF") << std::endl;
+            break;
+        case GLFW_KEY_H:
+            useOcclusionCulling = !useOcclusionCulling;
+            if (!occlusionCuller.supported || !indirectDraws.supported) std::cout << "Occlusion culling needs GL 4.3 and multi-draw indirect" << std::endl;
+            else std::cout << "Hi-Z occlusion culling " << (useOcclusionCulling ? "ON" : "OFF") << " ("
+                << occlusionCuller.occluders << " occluders, " << renderQueue.stats.occlusionCulled << " commands culled)" << std::endl;
+            break;
+        case GLFW_KEY_V:
+            useLods = !useLods;
+            std::cout << "Prefab LOD " << (useLods ? "ON" : "OFF") << " (was " << renderQueue.stats.triangles << " triangles, levels 48/24/12/6/box: "
+                << lodStats.placements[0] << "/" << lodStats.placements[1] << "/" << lodStats.placements[2] << "/"
+                << lodStats.placements[3] << "/" << lodStats.placements[4] << ")" << std::endl;
+            break;
+        case GLFW_KEY_F:
+            useLodCrossfade = !useLodCrossfade;
+            std::cout << "LOD crossfade " << (useLodCrossfade ? "ON" : "OFF") << std::endl;
+            break;
+        case GLFW_KEY_B:
+            useStaticBatching = !useStaticBatching;
+            std::cout << "Static batching " << (useStaticBatching ? "ON" : "OFF") << ": "
+                << scene.countDrawCalls(useStaticBatching) << " draw calls" << std::endl;
+            break;
         case GLFW_KEY_R:
             camera.theta = M_PI / 3.0f;
             camera.phi = M_PI / 4.0f;
             camera.updatePosition();
             break;
+        case GLFW_KEY_P:
+            useLightVariants = !useLightVariants;
+            std::cout << "Light-count shader variants " << (useLightVariants ? "ON" : "OFF") << " ("
+                << forwardVariants.built() + indirectDraws.forwardVariants.built() + deferredRenderer.lightingVariants.built()
+                << " built)" << std::endl;
+            break;
+        case GLFW_KEY_D:
+            governor.setEnabled(!governor.enabled);
+            break;
+        case GLFW_KEY_A: {
+            std::string before = antiAliasingReport();
+            setAntiAliasing((AntiAliasingMode)((antiAliasing + 1) % AA_MODE_COUNT));
+            std::cout << "Anti-aliasing " << AA_MODE_NAMES[antiAliasing] << " (was " << before << ")" << std::endl;
+            break;
+        }
+        case GLFW_KEY_I:
+            std::cout << "Render on demand " << (redraw.onDemand ? "OFF" : "ON") << " (was " << cpuMeter.summary() << ")" << std::endl;
+            redraw.onDemand = !redraw.onDemand;
+            break;
         }
     }
 }
@@ -690,48 +5201,47 @@ void framebufferSizeCallback(GLFWwindow* window, int width, int height) {
     windowHeight = height;
     camera.aspect = (float)width / (float)height;
     glViewport(0, 0, width, height);
+    redraw.request();
+}
+
+// The window was uncovered or resized and its contents are gone
+void windowRefreshCallback(GLFWwindow* window) {
+    redraw.request();
 }
 
 // Scene initialization
 void initializeScene() {
+    PROFILE_FUNCTION();
     // Create floor
+    SceneNode* floorNode = scene.root.addChild("floor");
     auto floorMeshes = createOriginalFloor();
     for (auto& mesh : floorMeshes) {
-        scene.addMesh(std::move(mesh));
+        scene.addMesh(std::move(mesh), floorNode);
     }
 
     // Create walls
+    SceneNode* wallNode = scene.root.addChild("walls");
     auto wallMeshes = createOriginalWalls();
     for (auto& mesh : wallMeshes) {
-        scene.addMesh(std::move(mesh));
+        scene.addMesh(std::move(mesh), wallNode);
     }
 
-    // Create tables
-    auto table1Meshes = createEnhancedTable(-5.0f, -5.0f);
-    for (auto& mesh : table1Meshes) {
-        scene.addMesh(std::move(mesh));
-    }
+    // Furniture nodes carry the placements; prefab parts are the third level
+    SceneNode* furnitureNode = scene.root.addChild("furniture");
 
-    auto table2Meshes = createEnhancedTable(3.0f, -5.0f);
-    for (auto& mesh : table2Meshes) {
-        scene.addMesh(std::move(mesh));
-    }
+    // Create tables
+    // Furniture is never moved at runtime, so it goes into the cached shadow maps
+    Prefab* table = scene.addPrefab(createTablePrefab());
+    table->isStatic = true;
+    table->place(placeFurniture(furnitureNode, "table1", -5.0f, -5.0f));
+    table->place(placeFurniture(furnitureNode, "table2", 3.0f, -5.0f));
 
     // Create chairs
-    auto chair1Meshes = createEnhancedChair(-6.0f, -5.0f, 1.6f);
-    for (auto& mesh : chair1Meshes) {
-        scene.addMesh(std::move(mesh));
-    }
-
-    auto chair2Meshes = createEnhancedChair(-3.5f, -5.0f, -1.6f);
-    for (auto& mesh : chair2Meshes) {
-        scene.addMesh(std::move(mesh));
-    }
-
-    auto chair3Meshes = createEnhancedChair(-5.0f, -3.5f, M_PI);
-    for (auto& mesh : chair3Meshes) {
-        scene.addMesh(std::move(mesh));
-    }
+    Prefab* chair = scene.addPrefab(createChairPrefab());
+    chair->isStatic = true;
+    chair->place(placeFurniture(furnitureNode, "chair1", -6.0f, -5.0f, 1.6f));
+    chair->place(placeFurniture(furnitureNode, "chair2", -3.5f, -5.0f, -1.6f));
+    chair->place(placeFurniture(furnitureNode, "chair3", -5.0f, -3.5f, M_PI));
 
     // Add lighting
     Light ambientLight = { 2, glm::vec3(0), glm::vec3(1.0f, 1.0f, 1.0f), 0.3f };
@@ -752,46 +5262,1085 @@ void initializeScene() {
 
     Light pendantLight3 = { 1, glm::vec3(1, 7.8f, -3), glm::vec3(1.0f, 1.0f, 0.8f), 1.2f };
     scene.addLight(pendantLight3);
+
+    // Resolve world matrices, then merge the floor and walls into per-material batches
+    scene.updateTransforms();
+    scene.buildStaticBatches();
+}
+
+// Binary scene snapshot: the built scene (vertex and index blobs in the GPU
+// layout, geometry regions, scene nodes, meshes, prefabs with their LOD
+// chains, static batches, lights and the index order report) in one file,
+// written once after initializeScene() and mapped at later startups. The
+// pooled vertex and index sections go to the geometry pool straight from
+// the mapped pages; static batches get their own buffers from the owned
+// sections, as when generated. The header carries a version, the vertex
+// format and index order the blobs were packed with (a mismatch means
+// regenerate) and an FNV-1a checksum of everything after it. Nothing ties
+// the file to the code that generated it, so snapshots are opt-in
+// (--snapshot) and must be deleted after changing the scene generation.
+const uint32_t SNAPSHOT_VERSION = 4;
+
+enum SnapshotSection {
+    SNAPSHOT_VERTICES, SNAPSHOT_INDICES, SNAPSHOT_GEOMETRIES, SNAPSHOT_NODES, SNAPSHOT_MESHES,
+    SNAPSHOT_PREFABS, SNAPSHOT_PARTS, SNAPSHOT_PLACEMENTS, SNAPSHOT_BATCHES, SNAPSHOT_LIGHTS, SNAPSHOT_LODS,
+    SNAPSHOT_OWNED_VERTICES, SNAPSHOT_OWNED_INDICES, SNAPSHOT_INDEX_REPORTS,
+    SNAPSHOT_SECTION_COUNT
+};
+
+struct SnapshotHeader {
+    char magic[8]; // "YSWSCENE"
+    uint32_t version;
+    uint32_t vertexFormat;
+    uint32_t vertexStride;
+    uint32_t indexOrder;
+    uint64_t checksum; // FNV-1a of every byte after the header
+    struct {
+        uint64_t offset; // from the start of the file, 16-byte aligned
+        uint64_t bytes;
+    } sections[SNAPSHOT_SECTION_COUNT];
+};
+
+struct SnapshotGeometry {
+    int32_t baseVertex;   // into the vertex section, or the owned one
+    uint32_t vertexCount;
+    uint64_t indexOffset; // bytes into the index section, or the owned one
+    uint32_t indexCount;
+    uint32_t indexType;
+    glm::vec3 boundsMin, boundsMax;
+    glm::mat4 dequantize;
+    uint32_t ownsBuffers; // 1: own buffers from the owned sections (static batches), 0: pooled
+};
+
+struct SnapshotNode {
+    int32_t parent; // earlier in the section, -1 for the root
+    char name[28];
+    glm::mat4 local;
+};
+
+enum SnapshotMeshFlags {
+    SNAPSHOT_CAST_SHADOW = 1, SNAPSHOT_RECEIVE_SHADOW = 2, SNAPSHOT_STATIC = 4, SNAPSHOT_BATCHED = 8, SNAPSHOT_TRANSPARENT = 16,
+    SNAPSHOT_OCCLUDER = 32
+};
+
+// Meshes, prefab parts and static batches; transform is the part's local
+// transform for parts and unused otherwise
+struct SnapshotMesh {
+    uint32_t geometry;
+    int32_t node; // -1 for parts and batches
+    uint32_t flags;
+    float roughness, metalness, opacity;
+    glm::vec3 color;
+    glm::mat4 transform;
+    uint32_t firstLod, lodCount; // geometry indices in the LOD section
+};
+
+struct SnapshotPrefab {
+    char name[28];
+    uint32_t isStatic;
+    uint32_t firstPart, partCount;
+    uint32_t firstPlacement, placementCount; // node indices in the placement section
+};
+
+struct SnapshotLight {
+    int32_t type;
+    glm::vec3 position;
+    glm::vec3 color;
+    float intensity;
+    float radius;
+};
+
+// GeometryCache::indexReports, one per shape; the loaded geometry has no
+// indices left to analyze
+struct SnapshotCacheStats {
+    uint64_t transformed, triangles, vertices;
+    float acmr, atvr;
+};
+
+struct SnapshotIndexReport {
+    SnapshotCacheStats before, after;
+    uint64_t geometries;
+};
+
+// Read-only view of a whole file: mmap where available, otherwise read
+class MappedFile {
+public:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+
+    bool open(const std::string& path) {
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        madvise(mapped, (size_t)info.st_size, MADV_SEQUENTIAL);
+        data = (const unsigned char*)mapped;
+        size = (size_t)info.st_size;
+        return true;
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file) return false;
+        fallback.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = fallback.data();
+        size = fallback.size();
+        return size > 0;
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data) munmap((void*)data, size);
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    std::vector<unsigned char> fallback;
+#endif
+};
+
+bool writeSceneSnapshot(const std::string& path) {
+    PROFILE_FUNCTION();
+    std::vector<unsigned char> sections[SNAPSHOT_SECTION_COUNT];
+    auto append = [&](SnapshotSection section, const void* data, size_t bytes) {
+        const unsigned char* begin = (const unsigned char*)data;
+        sections[section].insert(sections[section].end(), begin, begin + bytes);
+    };
+
+    // Every unique geometry, packed the way GeometryPool::add or the owning
+    // Geometry constructor would pack it
+    std::map<const Geometry*, uint32_t> geometryIndices;
+    size_t baseVertex = 0, ownedBaseVertex = 0;
+    auto geometryIndex = [&](const std::shared_ptr<Geometry>& geometry) {
+        auto found = geometryIndices.find(geometry.get());
+        if (found != geometryIndices.end()) return found->second;
+
+        bool owned = geometry->ownsBuffers;
+        SnapshotSection vertexSection = owned ? SNAPSHOT_OWNED_VERTICES : SNAPSHOT_VERTICES;
+        SnapshotSection indexSection = owned ? SNAPSHOT_OWNED_INDICES : SNAPSHOT_INDICES;
+        size_t& nextVertex = owned ? ownedBaseVertex : baseVertex;
+        std::vector<unsigned char> vertices = geometry->packVertices();
+        std::vector<unsigned char> indices = geometry->packIndices();
+        sections[indexSection].resize((sections[indexSection].size() + 3) & ~(size_t)3);
+
+        SnapshotGeometry record = {};
+        record.baseVertex = (int32_t)nextVertex;
+        record.vertexCount = (uint32_t)geometry->vertices.size();
+        record.indexOffset = sections[indexSection].size();
+        record.indexCount = (uint32_t)geometry->indices.size();
+        record.indexType = geometry->indexType;
+        record.boundsMin = geometry->bounds.min;
+        record.boundsMax = geometry->bounds.max;
+        record.dequantize = geometry->dequantize;
+        record.ownsBuffers = owned ? 1 : 0;
+        append(vertexSection, vertices.data(), vertices.size());
+        append(indexSection, indices.data(), indices.size());
+        append(SNAPSHOT_GEOMETRIES, &record, sizeof(record));
+
+        nextVertex += geometry->vertices.size();
+        uint32_t index = (uint32_t)geometryIndices.size();
+        geometryIndices.emplace(geometry.get(), index);
+        return index;
+    };
+    auto meshRecord = [&](const Mesh& mesh, int32_t node, const glm::mat4& transform) {
+        SnapshotMesh record = {};
+        record.geometry = geometryIndex(mesh.geometry);
+        record.node = node;
+        record.flags = (mesh.castShadow ? SNAPSHOT_CAST_SHADOW : 0) | (mesh.receiveShadow ? SNAPSHOT_RECEIVE_SHADOW : 0)
+            | (mesh.isStatic ? SNAPSHOT_STATIC : 0) | (mesh.batched ? SNAPSHOT_BATCHED : 0)
+            | (mesh.material.transparent ? SNAPSHOT_TRANSPARENT : 0) | (mesh.occluder ? SNAPSHOT_OCCLUDER : 0);
+        record.roughness = mesh.material.roughness;
+        record.metalness = mesh.material.metalness;
+        record.opacity = mesh.material.opacity;
+        record.color = mesh.material.color;
+        record.transform = transform;
+        record.firstLod = (uint32_t)(sections[SNAPSHOT_LODS].size() / sizeof(uint32_t));
+        record.lodCount = (uint32_t)mesh.lods.size();
+        for (const auto& lod : mesh.lods) {
+            uint32_t index = geometryIndex(lod);
+            append(SNAPSHOT_LODS, &index, sizeof(index));
+        }
+        return record;
+    };
+
+    // Nodes depth first, so every parent precedes its children
+    std::map<const SceneNode*, int32_t> nodeIndices;
+    std::vector<std::pair<const SceneNode*, int32_t>> stack = { { &scene.root, -1 } };
+    while (!stack.empty()) {
+        const SceneNode* node = stack.back().first;
+        SnapshotNode record = {};
+        record.parent = stack.back().second;
+        strncpy(record.name, node->name.c_str(), sizeof(record.name) - 1);
+        record.local = node->local;
+        stack.pop_back();
+
+        int32_t index = (int32_t)nodeIndices.size();
+        nodeIndices.emplace(node, index);
+        append(SNAPSHOT_NODES, &record, sizeof(record));
+        for (auto child = node->children.rbegin(); child != node->children.rend(); ++child) {
+            stack.push_back({ child->get(), index });
+        }
+    }
+
+    for (const auto& mesh : scene.meshes) {
+        SnapshotMesh record = meshRecord(*mesh, mesh->node ? nodeIndices[mesh->node] : -1, mesh->transform);
+        append(SNAPSHOT_MESHES, &record, sizeof(record));
+    }
+
+    uint32_t partCount = 0, placementCount = 0;
+    for (const auto& prefab : scene.prefabs) {
+        SnapshotPrefab record = {};
+        strncpy(record.name, prefab->name.c_str(), sizeof(record.name) - 1);
+        record.isStatic = prefab->isStatic ? 1 : 0;
+        record.firstPart = partCount;
+        record.partCount = (uint32_t)prefab->parts.size();
+        record.firstPlacement = placementCount;
+        record.placementCount = (uint32_t)prefab->placements.size();
+        append(SNAPSHOT_PREFABS, &record, sizeof(record));
+
+        for (const auto& part : prefab->parts) {
+            SnapshotMesh partRecord = meshRecord(*part, -1, part->transform);
+            append(SNAPSHOT_PARTS, &partRecord, sizeof(partRecord));
+        }
+        for (SceneNode* placement : prefab->placements) {
+            int32_t node = nodeIndices[placement];
+            append(SNAPSHOT_PLACEMENTS, &node, sizeof(node));
+        }
+        partCount += record.partCount;
+        placementCount += record.placementCount;
+    }
+
+    for (const auto& batch : scene.staticBatches) {
+        SnapshotMesh record = meshRecord(*batch, -1, batch->transform);
+        append(SNAPSHOT_BATCHES, &record, sizeof(record));
+    }
+
+    for (const Light& light : scene.lights) {
+        SnapshotLight record = { light.type, light.position, light.color, light.intensity, light.radius };
+        append(SNAPSHOT_LIGHTS, &record, sizeof(record));
+    }
+
+    auto cacheStats = [](const meshopt::CacheStats& stats) {
+        SnapshotCacheStats record = { stats.transformed, stats.triangles, stats.vertices, stats.acmr, stats.atvr };
+        return record;
+    };
+    for (const GeometryCache::IndexReport& report : geometryCache.indexReports) {
+        SnapshotIndexReport record = { cacheStats(report.before), cacheStats(report.after), report.geometries };
+        append(SNAPSHOT_INDEX_REPORTS, &record, sizeof(record));
+    }
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, "YSWSCENE", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.vertexFormat = vertexFormat;
+    header.vertexStride = (uint32_t)vertexStride();
+    header.indexOrder = indexOrder;
+
+    std::vector<unsigned char> payload;
+    for (int i = 0; i < SNAPSHOT_SECTION_COUNT; ++i) {
+        payload.resize((payload.size() + 15) & ~(size_t)15);
+        header.sections[i].offset = sizeof(SnapshotHeader) + payload.size();
+        header.sections[i].bytes = sections[i].size();
+        payload.insert(payload.end(), sections[i].begin(), sections[i].end());
+    }
+    header.checksum = shadercache::fnv1a(payload.data(), payload.size());
+
+    // Write under a temporary name, so a crash never leaves a torn snapshot
+    std::string temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)payload.data(), payload.size());
+    file.close();
+    if (!file || rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cout << "Failed to write scene snapshot " << path << std::endl;
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Rebuilds the scene from a snapshot; false (with the scene untouched) when
+// the file is missing, corrupt, from another version or packed for another
+// vertex format or index order
+bool loadSceneSnapshot(const std::string& path) {
+    PROFILE_FUNCTION();
+    auto file = std::make_shared<MappedFile>(); // stays mapped until the geometry upload has read it
+    if (!file->open(path)) return false;
+
+    const SnapshotHeader* header = (const SnapshotHeader*)file->data;
+    if (file->size < sizeof(SnapshotHeader) || memcmp(header->magic, "YSWSCENE", 8) != 0) {
+        std::cout << "Scene snapshot " << path << " is not a snapshot, regenerating" << std::endl;
+        return false;
+    }
+    if (header->version != SNAPSHOT_VERSION || header->vertexFormat != (uint32_t)vertexFormat
+        || header->vertexStride != vertexStride() || header->indexOrder != (uint32_t)indexOrder) {
+        std::cout << "Scene snapshot " << path << " is stale, regenerating" << std::endl;
+        return false;
+    }
+
+    const size_t recordSizes[SNAPSHOT_SECTION_COUNT] = { vertexStride(), 1, sizeof(SnapshotGeometry), sizeof(SnapshotNode),
+        sizeof(SnapshotMesh), sizeof(SnapshotPrefab), sizeof(SnapshotMesh), sizeof(int32_t), sizeof(SnapshotMesh), sizeof(SnapshotLight),
+        sizeof(uint32_t), vertexStride(), 1, sizeof(SnapshotIndexReport) };
+    for (int i = 0; i < SNAPSHOT_SECTION_COUNT; ++i) {
+        uint64_t offset = header->sections[i].offset, bytes = header->sections[i].bytes;
+        if (offset < sizeof(SnapshotHeader) || offset % 16 != 0 || offset > file->size || bytes > file->size - offset || bytes % recordSizes[i] != 0) {
+            std::cout << "Scene snapshot " << path << " is truncated, regenerating" << std::endl;
+            return false;
+        }
+    }
+    if (shadercache::fnv1a(file->data + sizeof(SnapshotHeader), file->size - sizeof(SnapshotHeader)) != header->checksum) {
+        std::cout << "Scene snapshot " << path << " failed its checksum, regenerating" << std::endl;
+        return false;
+    }
+
+    auto section = [&](SnapshotSection i) { return file->data + header->sections[i].offset; };
+    auto count = [&](SnapshotSection i) { return (size_t)(header->sections[i].bytes / recordSizes[i]); };
+    const SnapshotGeometry* geometryRecords = (const SnapshotGeometry*)section(SNAPSHOT_GEOMETRIES);
+    const SnapshotNode* nodeRecords = (const SnapshotNode*)section(SNAPSHOT_NODES);
+    const SnapshotMesh* meshRecords = (const SnapshotMesh*)section(SNAPSHOT_MESHES);
+    const SnapshotPrefab* prefabRecords = (const SnapshotPrefab*)section(SNAPSHOT_PREFABS);
+    const SnapshotMesh* partRecords = (const SnapshotMesh*)section(SNAPSHOT_PARTS);
+    const int32_t* placementRecords = (const int32_t*)section(SNAPSHOT_PLACEMENTS);
+    const SnapshotMesh* batchRecords = (const SnapshotMesh*)section(SNAPSHOT_BATCHES);
+    const SnapshotLight* lightRecords = (const SnapshotLight*)section(SNAPSHOT_LIGHTS);
+    const uint32_t* lodRecords = (const uint32_t*)section(SNAPSHOT_LODS);
+    const SnapshotIndexReport* reportRecords = (const SnapshotIndexReport*)section(SNAPSHOT_INDEX_REPORTS);
+
+    // Cross references are checked before anything is built
+    size_t vertexTotal = count(SNAPSHOT_VERTICES), indexBytes = count(SNAPSHOT_INDICES);
+    size_t geometryCount = count(SNAPSHOT_GEOMETRIES), nodeCount = count(SNAPSHOT_NODES);
+    bool valid = nodeCount > 0 && nodeRecords[0].parent == -1 && count(SNAPSHOT_INDEX_REPORTS) == GeometryCache::SHAPE_COUNT;
+    for (size_t i = 0; i < geometryCount && valid; ++i) {
+        const SnapshotGeometry& g = geometryRecords[i];
+        size_t indexSize = g.indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+        size_t vertices = g.ownsBuffers ? count(SNAPSHOT_OWNED_VERTICES) : vertexTotal;
+        size_t bytes = g.ownsBuffers ? count(SNAPSHOT_OWNED_INDICES) : indexBytes;
+        valid = g.ownsBuffers <= 1 && g.baseVertex >= 0 && (size_t)g.baseVertex + g.vertexCount <= vertices
+            && (g.indexType == GL_UNSIGNED_SHORT || g.indexType == GL_UNSIGNED_INT)
+            && g.indexOffset % indexSize == 0 && g.indexOffset + (uint64_t)g.indexCount * indexSize <= bytes;
+    }
+    for (size_t i = 1; i < nodeCount && valid; ++i) valid = nodeRecords[i].parent >= 0 && (size_t)nodeRecords[i].parent < i;
+    auto validMeshes = [&](const SnapshotMesh* records, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            if (records[i].geometry >= geometryCount || records[i].node >= (int32_t)nodeCount || records[i].node == 0) return false;
+            if ((records[i].lodCount != 0 && records[i].lodCount != LOD_LEVELS)
+                || (uint64_t)records[i].firstLod + records[i].lodCount > count(SNAPSHOT_LODS)) return false;
+        }
+        return true;
+    };
+    for (size_t i = 0; i < count(SNAPSHOT_LODS) && valid; ++i) valid = lodRecords[i] < geometryCount;
+    valid = valid && validMeshes(meshRecords, count(SNAPSHOT_MESHES)) && validMeshes(partRecords, count(SNAPSHOT_PARTS))
+        && validMeshes(batchRecords, count(SNAPSHOT_BATCHES));
+    for (size_t i = 0; i < count(SNAPSHOT_PREFABS) && valid; ++i) {
+        const SnapshotPrefab& p = prefabRecords[i];
+        valid = (uint64_t)p.firstPart + p.partCount <= count(SNAPSHOT_PARTS)
+            && (uint64_t)p.firstPlacement + p.placementCount <= count(SNAPSHOT_PLACEMENTS);
+    }
+    for (size_t i = 0; i < count(SNAPSHOT_PLACEMENTS) && valid; ++i) {
+        valid = placementRecords[i] > 0 && (size_t)placementRecords[i] < nodeCount;
+    }
+    if (!valid) {
+        std::cout << "Scene snapshot " << path << " is inconsistent, regenerating" << std::endl;
+        return false;
+    }
+
+    geometryCache.clear();
+    auto upload = geometryCache.pool.load(section(SNAPSHOT_VERTICES), vertexTotal, section(SNAPSHOT_INDICES), indexBytes, file);
+    auto cacheStats = [](const SnapshotCacheStats& record) {
+        meshopt::CacheStats stats;
+        stats.transformed = (size_t)record.transformed;
+        stats.triangles = (size_t)record.triangles;
+        stats.vertices = (size_t)record.vertices;
+        stats.acmr = record.acmr;
+        stats.atvr = record.atvr;
+        return stats;
+    };
+    for (int shape = 0; shape < GeometryCache::SHAPE_COUNT; ++shape) {
+        GeometryCache::IndexReport& report = geometryCache.indexReports[shape];
+        report.before = cacheStats(reportRecords[shape].before);
+        report.after = cacheStats(reportRecords[shape].after);
+        report.geometries = (size_t)reportRecords[shape].geometries;
+    }
+
+    std::vector<std::shared_ptr<Geometry>> geometries(geometryCount);
+    for (size_t i = 0; i < geometryCount; ++i) {
+        const SnapshotGeometry& record = geometryRecords[i];
+        auto geometry = std::make_shared<Geometry>();
+        geometry->vertexCount = record.vertexCount;
+        geometry->indexCount = record.indexCount;
+        geometry->indexType = record.indexType;
+        geometry->bounds.min = record.boundsMin;
+        geometry->bounds.max = record.boundsMax;
+        geometry->dequantize = record.dequantize;
+        if (record.ownsBuffers) {
+            size_t indexSize = record.indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+            geometry->loadPacked(section(SNAPSHOT_OWNED_VERTICES) + record.baseVertex * vertexStride(),
+                section(SNAPSHOT_OWNED_INDICES) + record.indexOffset, record.indexCount * indexSize, file);
+        }
+        else {
+            geometry->VAO = geometryCache.pool.VAO;
+            geometry->baseVertex = record.baseVertex;
+            geometry->indexOffset = record.indexOffset;
+            geometry->upload = upload;
+        }
+        geometries[i] = geometry;
+    }
+
+    std::vector<SceneNode*> nodes(nodeCount);
+    nodes[0] = &scene.root;
+    scene.root.setLocal(nodeRecords[0].local);
+    for (size_t i = 1; i < nodeCount; ++i) {
+        const SnapshotNode& record = nodeRecords[i];
+        nodes[i] = nodes[record.parent]->addChild(std::string(record.name, strnlen(record.name, sizeof(record.name))), record.local);
+    }
+
+    auto createMesh = [&](const SnapshotMesh& record) {
+        Material material;
+        material.color = record.color;
+        material.roughness = record.roughness;
+        material.metalness = record.metalness;
+        material.opacity = record.opacity;
+        material.transparent = (record.flags & SNAPSHOT_TRANSPARENT) != 0;
+        auto mesh = std::make_unique<Mesh>(geometries[record.geometry], material);
+        mesh->transform = record.transform;
+        mesh->castShadow = (record.flags & SNAPSHOT_CAST_SHADOW) != 0;
+        mesh->receiveShadow = (record.flags & SNAPSHOT_RECEIVE_SHADOW) != 0;
+        mesh->isStatic = (record.flags & SNAPSHOT_STATIC) != 0;
+        mesh->batched = (record.flags & SNAPSHOT_BATCHED) != 0;
+        mesh->occluder = (record.flags & SNAPSHOT_OCCLUDER) != 0;
+        for (uint32_t lod = 0; lod < record.lodCount; ++lod) mesh->lods.push_back(geometries[lodRecords[record.firstLod + lod]]);
+        return mesh;
+    };
+
+    for (size_t i = 0; i < count(SNAPSHOT_MESHES); ++i) {
+        auto mesh = createMesh(meshRecords[i]);
+        if (meshRecords[i].node > 0) nodes[meshRecords[i].node]->attach(mesh.get());
+        scene.meshes.push_back(std::move(mesh));
+    }
+
+    for (size_t i = 0; i < count(SNAPSHOT_PREFABS); ++i) {
+        const SnapshotPrefab& record = prefabRecords[i];
+        auto prefab = std::make_unique<Prefab>(std::string(record.name, strnlen(record.name, sizeof(record.name))), geometryCache.pool);
+        prefab->isStatic = record.isStatic != 0;
+        for (uint32_t part = 0; part < record.partCount; ++part) {
+            prefab->addPart(createMesh(partRecords[record.firstPart + part]));
+        }
+        Prefab* added = scene.addPrefab(std::move(prefab));
+        for (uint32_t placement = 0; placement < record.placementCount; ++placement) {
+            added->place(nodes[placementRecords[record.firstPlacement + placement]]);
+        }
+    }
+
+    for (size_t i = 0; i < count(SNAPSHOT_BATCHES); ++i) {
+        scene.staticBatches.push_back(createMesh(batchRecords[i]));
+    }
+
+    for (size_t i = 0; i < count(SNAPSHOT_LIGHTS); ++i) {
+        const SnapshotLight& record = lightRecords[i];
+        Light light = { record.type, record.position, record.color, record.intensity, record.radius };
+        scene.addLight(light);
+    }
+
+    scene.objectsDirty = true;
+    scene.boundsDirty = true;
+    scene.staticVersion++;
+    scene.updateTransforms();
+    return true;
+}
+
+// Startup: map the snapshot when it is current, otherwise generate the
+// scene and write the snapshot for the next launch. An empty path always
+// generates.
+void setupScene(const std::string& snapshotPath) {
+    auto start = std::chrono::steady_clock::now();
+    sceneFromSnapshot = !snapshotPath.empty() && loadSceneSnapshot(snapshotPath);
+    if (!sceneFromSnapshot) initializeScene();
+    sceneSetupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    if (!sceneFromSnapshot && !snapshotPath.empty()) writeSceneSnapshot(snapshotPath);
+}
+
+// Frustum culling: rebuild the BVH when the mesh set changes, refit it when
+// transforms change, then collect the meshes that survive the frustum test
+void cullScene(const glm::mat4& viewProjection) {
+    PROFILE_FUNCTION();
+    auto start = std::chrono::steady_clock::now();
+
+    if (sceneBVH.builtMeshCount != scene.meshes.size()) {
+        sceneBVH.build(scene.meshes);
+        scene.boundsDirty = false;
+    }
+    else if (scene.boundsDirty) {
+        sceneBVH.refit();
+        scene.boundsDirty = false;
+    }
+
+    Frustum frustum;
+    frustum.extract(viewProjection);
+
+    cullStats = CullStats();
+    visibleMeshes.clear();
+    sceneBVH.cull(frustum, visibleMeshes, cullStats);
+    cullStats.meshesDrawn = visibleMeshes.size();
+    cullStats.meshesCulled = scene.meshes.size() - visibleMeshes.size();
+
+    cullStats.microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Points every lighting program at its variant for the scene's current
+// lights; until a new variant has built, the generic program draws
+void selectLightVariants(bool wait) {
+    PROFILE_FUNCTION();
+    if (!useLightVariants) {
+        forwardVariants.useGeneric();
+        indirectDraws.forwardVariants.useGeneric();
+        deferredRenderer.lightingVariants.useGeneric();
+        return;
+    }
+    LightConfig config = LightConfig::of(scene.lights, useClusteredLighting);
+    forwardVariants.select(config, wait);
+    if (indirectDraws.supported) indirectDraws.forwardVariants.select(config, wait);
+    deferredRenderer.lightingVariants.select(config, wait);
 }
 
 // Render function
 void render() {
+    PROFILE_FUNCTION();
+    auto cpuStart = std::chrono::steady_clock::now();
+    passTimer.beginFrame();
+
+    // The camera passes draw at the governor's resolution and sample count;
+    // post-process anti-aliasing reads the scene back from textures
+    bool postProcess = isPostProcessAA(antiAliasing);
+    sceneTarget.resize(governor.scaled(windowWidth), governor.scaled(windowHeight), governor.samples(), postProcess,
+        outputFramebuffer, windowWidth, windowHeight);
+    int width = sceneTarget.width, height = sceneTarget.height;
+    camera.jitter = antiAliasing == AA_TAA ? postAntiAliasing.jitter(width, height) : glm::vec2(0.0f);
+
+    // Geometry whose background upload has landed joins this frame's draws;
+    // the cached static shadow maps are re-rendered to include it
+    if (geometryUploader.poll() > 0) scene.staticVersion++;
+
+    // Only nodes that moved (or sit under one that moved) are recomputed
+    scene.updateTransforms();
+
+    // Camera every frame; lights, transforms and materials only when they change
+    glm::ivec4 clusterDims(ClusteredLighting::TILES_X, ClusteredLighting::TILES_Y, ClusteredLighting::SLICES, useClusteredLighting ? 1 : 0);
+    uniforms.uploadFrame(camera, clusteredLighting.scale(width, height, camera), clusterDims);
+    uniforms.uploadLights(scene);
+    uniforms.uploadObjects(scene);
+    selectLightVariants(false);
+    if (useClusteredLighting) {
+        clusteredLighting.update(scene, camera);
+        clusteredLighting.bind();
+    }
+
+    // Re-renders only when lights or static casters changed, or dynamic casters exist
+    passTimer.begin("shadows");
+    shadowMaps.update(scene, uniforms);
+    shadowMaps.bind();
+    passTimer.end();
+
+    passTimer.begin("clear");
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneTarget.framebuffer);
+    glViewport(0, 0, width, height);
     glClearColor(scene.backgroundColor.x, scene.backgroundColor.y, scene.backgroundColor.z, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    passTimer.end();
+
+    glm::mat4 viewProjection = camera.getProjectionMatrix() * camera.getViewMatrix();
+    Frustum frustum;
+    frustum.extract(viewProjection);
+
+    if (useFrustumCulling) {
+        cullScene(viewProjection);
+    }
+    else {
+        visibleMeshes.clear();
+        for (auto& mesh : scene.meshes) visibleMeshes.push_back(mesh.get());
+    }
 
-    glUseProgram(shaderProgram);
+    // Queue every visible draw with its view depth
+    glm::vec3 eye = camera.position;
+    glm::vec3 forward = glm::normalize(camera.target - camera.position);
+    auto viewDepth = [&](const AABB& bounds) {
+        return glm::dot(bounds.center() - eye, forward);
+    };
 
-    // Set matrices
-    glm::mat4 view = camera.getViewMatrix();
-    glm::mat4 projection = camera.getProjectionMatrix();
+    // Deferred mode sends opaque surfaces to the G-buffer program; the
+    // queue key keeps transparent ones last either way. The indirect path
+    // has its own program variants.
+    bool indirect = useIndirectDraws && indirectDraws.supported;
+    auto programFor = [&](const Mesh& mesh) {
+        bool transparent = mesh.material.transparent || mesh.material.opacity < 1.0f;
+        if (useDeferredShading && !transparent) return indirect ? indirectDraws.gbufferProgram : deferredRenderer.gbufferProgram;
+        return indirect ? indirectDraws.forwardVariants.active : forwardVariants.active;
+    };
 
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-    glUniform3fv(glGetUniformLocation(shaderProgram, "viewPos"), 1, glm::value_ptr(camera.position));
+    // LOD by projected size, for the camera passes only: shadow maps have
+    // already been drawn with the fixed part geometry. The governor's detail
+    // factor picks coarser cylinders sooner.
+    lodStats = Prefab::LodStats();
+    float projectionScale = height * 0.5f / tanf(glm::radians(camera.fov) * 0.5f) * governor.detail();
+    for (const auto& prefab : scene.prefabs) {
+        if (useLods) prefab->updateLods(eye, projectionScale, useLodCrossfade, lodStats);
+        else prefab->lodsSelected = false;
+    }
 
-    // Set lights
-    glUniform1i(glGetUniformLocation(shaderProgram, "numLights"), (int)scene.lights.size());
-    for (size_t i = 0; i < scene.lights.size() && i < 10; ++i) {
-        std::string base = "lights[" + std::to_string(i) + "]";
-        glUniform1i(glGetUniformLocation(shaderProgram, (base + ".type").c_str()), scene.lights[i].type);
-        glUniform3fv(glGetUniformLocation(shaderProgram, (base + ".position").c_str()), 1, glm::value_ptr(scene.lights[i].position));
-        glUniform3fv(glGetUniformLocation(shaderProgram, (base + ".color").c_str()), 1, glm::value_ptr(scene.lights[i].color));
-        glUniform1f(glGetUniformLocation(shaderProgram, (base + ".intensity").c_str()), scene.lights[i].intensity);
+    renderQueue.clear();
+    if (useStaticBatching) {
+        for (const auto& batch : scene.staticBatches) {
+            if (!batch->resident()) continue;
+            AABB bounds = batch->worldBounds();
+            if (useFrustumCulling && frustum.classify(bounds) == Frustum::OUTSIDE) continue;
+            renderQueue.add(*batch, nullptr, programFor(*batch), batch->geometry->VAO, viewDepth(bounds), camera.farPlane);
+        }
+    }
+    for (Mesh* mesh : visibleMeshes) {
+        if ((useStaticBatching && mesh->batched) || !mesh->resident()) continue;
+        renderQueue.add(*mesh, nullptr, programFor(*mesh), mesh->geometry->VAO, viewDepth(mesh->worldBounds()), camera.farPlane);
     }
 
-    // Render meshes
-    for (const auto& mesh : scene.meshes) {
-        glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(mesh->transform));
-        glUniform1f(glGetUniformLocation(shaderProgram, "roughness"), mesh->material.roughness);
-        glUniform1f(glGetUniformLocation(shaderProgram, "metalness"), mesh->material.metalness);
-        glUniform1f(glGetUniformLocation(shaderProgram, "opacity"), mesh->material.opacity);
+    // One instanced draw per prefab part covers every placement; it sorts
+    // by its nearest placement. Indirect draws read placements from their
+    // records and the pool VAO instead.
+    for (const auto& prefab : scene.prefabs) {
+        if (prefab->instances.empty()) continue;
+        GLuint prefabVAO = indirect ? geometryCache.pool.VAO : prefab->lodsSelected ? prefab->prepareLods() : prefab->prepare();
+        for (const auto& part : prefab->parts) {
+            if (!part->resident()) continue;
+            float nearest = FLT_MAX;
+            for (const glm::mat4& placement : prefab->instances) {
+                nearest = std::min(nearest, viewDepth(part->geometry->bounds.transformed(placement * part->transform)));
+            }
+            renderQueue.add(*part, prefab.get(), programFor(*part), prefabVAO, nearest, camera.farPlane);
+        }
+    }
+
+    // Runs split at blend changes only when opaque and transparent draws
+    // get their own passes
+    bool separatePasses = useDeferredShading || useSortedQueue;
+    auto execute = [&](size_t first, size_t last) {
+        if (indirect) indirectDraws.execute(renderQueue, separatePasses, first, last);
+        else renderQueue.execute(uniforms, separatePasses, first, last);
+    };
+
+    // Deferred shading needs the sorted order for its opaque/transparent split
+    if (separatePasses) renderQueue.sort();
+    if (indirect) indirectDraws.beginFrame(renderQueue, uniforms, separatePasses);
+
+    // GPU occlusion culling needs the commands on the GPU, so indirect only
+    if (indirect && useOcclusionCulling && occlusionCuller.supported) {
+        passTimer.begin("occlusion");
+        occlusionCuller.build(scene, viewProjection);
+        indirectDraws.cull(occlusionCuller, viewProjection);
+        glBindFramebuffer(GL_FRAMEBUFFER, sceneTarget.framebuffer);
+        glViewport(0, 0, width, height);
+        passTimer.end();
+    }
+
+    if (useDeferredShading) {
+        size_t opaque = renderQueue.opaqueCount();
+
+        passTimer.begin("gbuffer");
+        deferredRenderer.resize(width, height);
+        deferredRenderer.beginGeometryPass();
+        renderQueue.beginOverdrawQuery();
+        execute(0, opaque);
+        renderQueue.endOverdrawQuery(width, height);
+        passTimer.end();
+
+        passTimer.begin("lighting");
+        deferredRenderer.lightingPass(sceneTarget.framebuffer);
+        passTimer.end();
+
+        passTimer.begin("transparent");
+        execute(opaque, SIZE_MAX);
+        passTimer.end();
+    }
+    else if (useSortedQueue) {
+        size_t opaque = renderQueue.opaqueCount();
+
+        passTimer.begin("opaque");
+        renderQueue.beginOverdrawQuery();
+        execute(0, opaque);
+        passTimer.end();
+
+        passTimer.begin("transparent");
+        execute(opaque, SIZE_MAX);
+        renderQueue.endOverdrawQuery(width, height);
+        passTimer.end();
+    }
+    else {
+        // Insertion order interleaves opaque and transparent draws
+        passTimer.begin("forward");
+        renderQueue.beginOverdrawQuery();
+        execute(0, SIZE_MAX);
+        renderQueue.endOverdrawQuery(width, height);
+        passTimer.end();
+    }
+    if (indirect) indirectDraws.endFrame();
+
+    // Anti-alias or resolve, and upscale; the overlay goes on top at the output size
+    if (postProcess) {
+        passTimer.begin("antialiasing");
+        postAntiAliasing.apply(antiAliasing, sceneTarget, camera.getProjectionMatrix(false) * camera.getViewMatrix(),
+            outputFramebuffer, windowWidth, windowHeight);
+        passTimer.end();
+    }
+    else if (sceneTarget.offscreen()) {
+        passTimer.begin("present");
+        sceneTarget.present(outputFramebuffer, windowWidth, windowHeight);
+        passTimer.end();
+    }
+    if (showPassOverlay) passTimer.drawOverlay(windowWidth, windowHeight);
+    passTimer.endFrame();
+
+    resetConstantAttributes();
+    governor.update(passTimer.frameGpuMs, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - cpuStart).count());
+}
 
-        mesh->draw();
+// Benchmark mode: renders a scripted camera path into an offscreen
+// framebuffer for a fixed number of frames and reports frame-time
+// percentiles as JSON, so every renderer change can be measured the same
+// way on headless build machines (e.g. Mesa llvmpipe)
+struct BenchmarkOptions {
+    bool enabled = false;
+    int width = 1280, height = 720;
+    int frames = 600;
+    int warmupFrames = 30;
+    bool deferred = false;
+    bool checksum = false;  // FNV-1a of the final frame's pixels
+    std::string outputPath; // JSON goes to stdout when empty
+    std::string passLogPath; // per-frame pass timings as JSON lines, interactive runs too
+    std::string tracePath;   // Chrome trace of the CPU zones, written at exit
+    VertexFormat vertexFormat = VERTEX_COMPACT;
+    IndexOrder indexOrder = INDEX_OVERDRAW;
+    bool indirect = true; // multi-draw indirect when supported
+    bool lods = true, lodCrossfade = true;
+    bool occlusion = true; // Hi-Z culling, indirect submission only
+    bool lightVariants = true; // lighting shaders specialized by light counts
+    std::string snapshotPath;   // scene snapshot to map, or to write after generating; empty: always generate
+    std::string programCachePath = "YourSurroundingWorld.programs"; // linked program binaries; empty: always compile
+    bool backgroundUploads = true; // geometry uploads on a worker thread with a shared context
+    bool redrawOnDemand = true; // interactive runs: sleep while nothing changes
+    double maxFps = 0.0;        // interactive runs: frame budget, 0 = uncapped
+    double targetFps = -1.0;    // frame-time governor target, 0 = off; unset: 60 interactive, off in benchmarks
+    AntiAliasingMode antiAliasing = AA_MODE_COUNT; // unset: msaa4 interactive, none in benchmarks
+};
+
+// --benchmark [--size WxH] [--frames N] [--warmup N] [--deferred] [--checksum] [--output FILE] [--pass-log FILE] [--trace FILE]
+// [--vertex-format compact|full] [--index-order original|cache|overdraw] [--submission direct|indirect]
+// [--snapshot FILE|none] [--program-cache FILE|none] [--lod off|on|crossfade] [--occlusion on|off]
+// [--light-variants on|off] [--uploads background|inline] [--redraw on-demand|continuous] [--max-fps N]
+// [--target-fps N] [--aa none|fxaa|smaa|taa|msaa2|msaa4|msaa8]
+bool parseArguments(int argc, char** argv, BenchmarkOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--benchmark") options.enabled = true;
+        else if (arg == "--deferred") options.deferred = true;
+        else if (arg == "--checksum") options.checksum = true;
+        else if (arg == "--size" && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2) return false;
+        }
+        else if (arg == "--frames" && hasValue) options.frames = atoi(argv[++i]);
+        else if (arg == "--warmup" && hasValue) options.warmupFrames = atoi(argv[++i]);
+        else if (arg == "--output" && hasValue) options.outputPath = argv[++i];
+        else if (arg == "--pass-log" && hasValue) options.passLogPath = argv[++i];
+        else if (arg == "--trace" && hasValue) options.tracePath = argv[++i];
+        else if (arg == "--vertex-format" && hasValue) {
+            std::string format = argv[++i];
+            if (format == "compact") options.vertexFormat = VERTEX_COMPACT;
+            else if (format == "full") options.vertexFormat = VERTEX_FULL;
+            else return false;
+        }
+        else if (arg == "--index-order" && hasValue) {
+            std::string order = argv[++i];
+            if (order == "original") options.indexOrder = INDEX_ORIGINAL;
+            else if (order == "cache") options.indexOrder = INDEX_VERTEX_CACHE;
+            else if (order == "overdraw") options.indexOrder = INDEX_OVERDRAW;
+            else return false;
+        }
+        else if (arg == "--submission" && hasValue) {
+            std::string submission = argv[++i];
+            if (submission == "direct") options.indirect = false;
+            else if (submission == "indirect") options.indirect = true;
+            else return false;
+        }
+        else if (arg == "--occlusion" && hasValue) {
+            std::string occlusion = argv[++i];
+            if (occlusion == "on") options.occlusion = true;
+            else if (occlusion == "off") options.occlusion = false;
+            else return false;
+        }
+        else if (arg == "--light-variants" && hasValue) {
+            std::string variants = argv[++i];
+            if (variants == "on") options.lightVariants = true;
+            else if (variants == "off") options.lightVariants = false;
+            else return false;
+        }
+        else if (arg == "--lod" && hasValue) {
+            std::string lod = argv[++i];
+            if (lod == "off") options.lods = false;
+            else if (lod == "on") options.lodCrossfade = false;
+            else if (lod != "crossfade") return false;
+        }
+        else if (arg == "--snapshot" && hasValue) {
+            options.snapshotPath = argv[++i];
+            if (options.snapshotPath == "none") options.snapshotPath.clear();
+        }
+        else if (arg == "--program-cache" && hasValue) {
+            options.programCachePath = argv[++i];
+            if (options.programCachePath == "none") options.programCachePath.clear();
+        }
+        else if (arg == "--uploads" && hasValue) {
+            std::string uploads = argv[++i];
+            if (uploads == "background") options.backgroundUploads = true;
+            else if (uploads == "inline") options.backgroundUploads = false;
+            else return false;
+        }
+        else if (arg == "--redraw" && hasValue) {
+            std::string redrawMode = argv[++i];
+            if (redrawMode == "on-demand") options.redrawOnDemand = true;
+            else if (redrawMode == "continuous") options.redrawOnDemand = false;
+            else return false;
+        }
+        else if (arg == "--max-fps" && hasValue) options.maxFps = atof(argv[++i]);
+        else if (arg == "--target-fps" && hasValue) {
+            options.targetFps = atof(argv[++i]);
+            if (options.targetFps < 0.0) return false;
+        }
+        else if (arg == "--aa" && hasValue) {
+            std::string mode = argv[++i];
+            options.antiAliasing = AA_MODE_COUNT;
+            for (int m = 0; m < AA_MODE_COUNT; ++m) {
+                if (mode == AA_MODE_NAMES[m]) options.antiAliasing = (AntiAliasingMode)m;
+            }
+            if (options.antiAliasing == AA_MODE_COUNT) return false;
+        }
+        else return false;
+    }
+    return options.width > 0 && options.height > 0 && options.frames > 0 && options.warmupFrames >= 0 && options.maxFps >= 0.0;
+}
+
+// Deterministic camera path: six equal segments, one day and one night pass
+// for each camera mode, orbiting once per segment
+void scriptCamera(int frame, int totalFrames) {
+    int segment = std::min(frame * 6 / totalFrames, 5);
+    float t = (float)(frame * 6 - segment * totalFrames) / totalFrames;
+
+    bool night = segment % 2 == 1;
+    if (scene.isNightMode != night) scene.toggleLighting();
+
+    camera.mode = 1 + segment / 2;
+    camera.phi = (float)M_PI / 4.0f + t * 2.0f * (float)M_PI;
+    camera.theta = (float)M_PI / 3.0f + 0.25f * sinf(t * 2.0f * (float)M_PI);
+    camera.updatePosition();
+}
+
+std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        if ((unsigned char)c >= 0x20) escaped += c;
+    }
+    return escaped;
+}
+
+// printf into the end of a string, however long the output turns out
+void appendFormat(std::string& text, const char* format, ...) {
+    va_list args, sizing;
+    va_start(args, format);
+    va_copy(sizing, args);
+    int length = vsnprintf(NULL, 0, format, sizing);
+    va_end(sizing);
+    if (length > 0) {
+        size_t offset = text.size();
+        text.resize(offset + length + 1);
+        vsnprintf(&text[offset], length + 1, format, args);
+        text.resize(offset + length);
+    }
+    va_end(args);
+}
+
+// GPU memory held by vertex data: the geometry pool plus every mesh and
+// batch with its own buffers
+size_t vertexBufferBytes() {
+    size_t bytes = geometryCache.pool.vertexCount * vertexStride();
+    auto add = [&](const Mesh& mesh) {
+        if (mesh.geometry->ownsBuffers) bytes += mesh.geometry->vertexCount * vertexStride();
+    };
+    for (const auto& mesh : scene.meshes) add(*mesh);
+    for (const auto& batch : scene.staticBatches) add(*batch);
+    return bytes;
+}
+
+int runBenchmark(const BenchmarkOptions& options) {
+    // Single-sampled color and depth; MSAA modes (--aa) render into the
+    // scene target and resolve into this, so the default checksum does not
+    // depend on how the driver resolves MSAA
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, options.width, options.height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, options.width, options.height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cout << "Benchmark framebuffer is incomplete" << std::endl;
+        return -1;
+    }
+
+    outputFramebuffer = framebuffer;
+    windowWidth = options.width;
+    windowHeight = options.height;
+    camera.aspect = (float)options.width / (float)options.height;
+    useDeferredShading = options.deferred;
+    useIndirectDraws = options.indirect;
+    useLods = options.lods;
+    useOcclusionCulling = options.occlusion;
+    useLodCrossfade = options.lodCrossfade;
+    useLightVariants = options.lightVariants;
+    if (options.outputPath.empty()) governor.log = &std::cerr; // stdout carries the JSON
+    bool indirect = useIndirectDraws && indirectDraws.supported;
+    selectLightVariants(true); // time the specialized shaders, not the stand-in
+    geometryUploader.finishAll(); // and the whole scene
+
+    for (int frame = 0; frame < options.warmupFrames; ++frame) {
+        scriptCamera(0, options.frames);
+        render();
+    }
+    glFinish();
+
+    // glFinish per frame so each sample covers the GPU work, not just submission
+    std::vector<double> frameMs(options.frames);
+    double antiAliasingMs = 0.0; // GPU time of the post pass or the MSAA resolve, a few frames behind
+    auto start = std::chrono::steady_clock::now();
+    double startCpu = cpuusage::processSeconds();
+    for (int frame = 0; frame < options.frames; ++frame) {
+        PROFILE_SCOPE("benchmark frame");
+        auto frameStart = std::chrono::steady_clock::now();
+        scriptCamera(frame, options.frames);
+        render();
+        glFinish();
+        frameMs[frame] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+        antiAliasingMs += passTimer.gpuMs("antialiasing") + passTimer.gpuMs("present");
+    }
+    double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpuPercent = 100.0 * (cpuusage::processSeconds() - startCpu) / totalSeconds;
+
+    std::vector<double> sorted = frameMs;
+    std::sort(sorted.begin(), sorted.end());
+    auto percentile = [&](double p) {
+        size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+        return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+    };
+    GeometryCache::IndexReport indexReport = geometryCache.totalIndexReport();
+    double mean = 0.0;
+    for (double ms : frameMs) mean += ms;
+    mean /= frameMs.size();
+
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    std::string json = "{\n";
+    json += "  \"renderer\": \"" + jsonEscape(renderer ? renderer : "unknown") + "\",\n";
+    appendFormat(json,
+        "  \"width\": %d,\n  \"height\": %d,\n  \"frames\": %d,\n  \"warmup_frames\": %d,\n  \"shading\": \"%s\",\n"
+        "  \"vertex_format\": \"%s\",\n  \"vertex_buffer_bytes\": %zu,\n"
+        "  \"index_order\": \"%s\",\n  \"acmr\": %.3f,\n  \"atvr\": %.3f,\n"
+        "  \"submission\": \"%s\",\n  \"draws\": %zu,\n  \"gl_draw_calls\": %zu,\n"
+        "  \"lod\": \"%s\",\n  \"triangles\": %zu,\n  \"occlusion\": \"%s\",\n  \"occluded_commands\": %zu,\n"
+        "  \"light_variants\": \"%s\",\n  \"geometry_uploads\": \"%s\",\n"
+        "  \"scene_source\": \"%s\",\n  \"scene_setup_ms\": %.3f,\n"
+        "  \"shader_programs\": %d,\n  \"shader_cache_hits\": %d,\n  \"shader_parallel_compile\": %s,\n"
+        "  \"shader_ms\": %.3f,\n  \"startup\": \"%s\",\n  \"startup_ms\": %.3f,\n"
+        "  \"frame_ms\": { \"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n"
+        "  \"fps\": %.2f,\n  \"megapixels_per_second\": %.2f,\n  \"cpu_percent\": %.1f",
+        options.width, options.height, options.frames, options.warmupFrames, options.deferred ? "deferred" : "forward",
+        vertexFormat == VERTEX_COMPACT ? "compact" : "full", vertexBufferBytes(),
+        indexOrderName(indexOrder), indexReport.after.acmr, indexReport.after.atvr,
+        indirect ? "indirect" : "direct", renderQueue.stats.draws, indirect ? renderQueue.stats.multiDraws : renderQueue.stats.draws,
+        !useLods ? "off" : useLodCrossfade ? "crossfade" : "on", renderQueue.stats.triangles,
+        !indirect || !occlusionCuller.supported ? "unsupported" : useOcclusionCulling ? (occlusionCuller.compact ? "on" : "on-zero-instances") : "off",
+        renderQueue.stats.occlusionCulled, useLightVariants ? "on" : "off", geometryUploader.threaded ? "background" : "inline",
+        sceneFromSnapshot ? "snapshot" : "generated", sceneSetupMs,
+        programCache.stats.programs, programCache.stats.cacheHits, programCache.stats.parallel ? "true" : "false",
+        programCache.stats.requestMs + programCache.stats.finishMs,
+        programCache.stats.cacheHits == programCache.stats.programs ? "warm" : "cold", startupMs,
+        mean, sorted.front(), percentile(50), percentile(95), percentile(99), sorted.back(),
+        options.frames / totalSeconds, (double)options.width * options.height * options.frames / totalSeconds / 1.0e6, cpuPercent);
+
+    if (governor.enabled) {
+        appendFormat(json,
+            ",\n  \"governor\": { \"target_ms\": %.3f, \"changes\": %d, \"render_scale\": %.2f, \"render_size\": \"%dx%d\", \"cylinder_detail\": %.2f }",
+            governor.targetMs, governor.changes, governor.scale(), sceneTarget.width, sceneTarget.height, governor.detail());
+    }
+    else appendFormat(json, ",\n  \"governor\": \"off\"");
+    appendFormat(json, ",\n  \"antialiasing\": \"%s\",\n  \"msaa_samples\": %d,\n  \"aa_ms\": %.3f,\n  \"aa_memory_bytes\": %zu",
+        AA_MODE_NAMES[antiAliasing], sceneTarget.storedSamples, antiAliasingMs / options.frames, sceneTarget.bytes() + postAntiAliasing.bytes());
+
+    if (options.checksum) {
+        std::vector<unsigned char> pixels((size_t)options.width * options.height * 4);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, options.width, options.height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+
+        appendFormat(json, ",\n  \"checksum\": \"%016llx\"", (unsigned long long)shadercache::fnv1a(pixels.data(), pixels.size()));
+    }
+    json += "\n}\n";
+
+    int result = 0;
+    if (options.outputPath.empty()) {
+        std::cout << json;
     }
+    else {
+        std::ofstream file(options.outputPath);
+        file << json;
+        if (!file) {
+            std::cout << "Failed to write " << options.outputPath << std::endl;
+            result = -1;
+        }
+    }
+
+    outputFramebuffer = 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(2, renderbuffers);
+    glDeleteFramebuffers(1, &framebuffer);
+    return result;
 }
 
 // Main function
-int main() {
+int main(int argc, char** argv) {
+    auto startupBegin = std::chrono::steady_clock::now();
+    BenchmarkOptions benchmark;
+    if (!parseArguments(argc, argv, benchmark)) {
+        std::cout << "Usage: " << argv[0] << " [--benchmark [--size WxH] [--frames N] [--warmup N]"
+            << " [--deferred] [--checksum] [--output FILE]] [--pass-log FILE] [--trace FILE]"
+            << " [--vertex-format compact|full] [--index-order original|cache|overdraw]"
+            << " [--submission direct|indirect] [--snapshot FILE|none] [--program-cache FILE|none]"
+            << " [--lod off|on|crossfade] [--occlusion on|off] [--light-variants on|off]"
+            << " [--uploads background|inline] [--redraw on-demand|continuous] [--max-fps N] [--target-fps N]"
+            << " [--aa none|fxaa|smaa|taa|msaa2|msaa4|msaa8]" << std::endl;
+        return -1;
+    }
+    PROFILE_THREAD_NAME("main");
+    PROFILE_TRACE_AT_EXIT(benchmark.tracePath.c_str());
+    vertexFormat = benchmark.vertexFormat;
+    indexOrder = benchmark.indexOrder;
+    redraw.onDemand = benchmark.redrawOnDemand;
+    redraw.frameBudget = benchmark.maxFps > 0.0 ? 1.0 / benchmark.maxFps : 0.0;
+
     // Initialize GLFW
     if (!glfwInit()) {
         std::cout << "Failed to initialize GLFW" << std::endl;
@@ -801,10 +6350,24 @@ int main() {
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_SAMPLES, 4); // 4x MSAA
+    glfwWindowHint(GLFW_SAMPLES, 0); // MSAA happens in the scene target, which is blitted into the window
+    if (benchmark.enabled) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
     // Create window
     GLFWwindow* window = glfwCreateWindow(windowWidth, windowHeight, "Enhanced 3D Office Break Room - C++ OpenGL", NULL, NULL);
+
+    // Headless machines may have no native GL context; benchmarks only
+    // need one, so fall back to EGL and then OSMesa
+    if (!window && benchmark.enabled) {
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+        window = glfwCreateWindow(windowWidth, windowHeight, "benchmark", NULL, NULL);
+    }
+#ifdef GLFW_OSMESA_CONTEXT_API
+    if (!window && benchmark.enabled) {
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+        window = glfwCreateWindow(windowWidth, windowHeight, "benchmark", NULL, NULL);
+    }
+#endif
     if (!window) {
         std::cout << "Failed to create GLFW window" << std::endl;
         glfwTerminate();
@@ -817,6 +6380,7 @@ int main() {
     glfwSetCursorPosCallback(window, cursorPosCallback);
     glfwSetScrollCallback(window, scrollCallback);
     glfwSetKeyCallback(window, keyCallback);
+    glfwSetWindowRefreshCallback(window, windowRefreshCallback);
 
     // Initialize GLEW
     if (glewInit() != GLEW_OK) {
@@ -829,44 +6393,175 @@ int main() {
     glEnable(GL_MULTISAMPLE);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-    // Create shader program
-    shaderProgram = createShaderProgram();
+    if (benchmark.backgroundUploads) geometryUploader.start(window);
+
+    // 4x MSAA interactively until the governor finds it too slow; benchmarks
+    // stay single-sampled unless --aa asks otherwise
+    glGetIntegerv(GL_MAX_SAMPLES, &supportedSamples);
+    setAntiAliasing(benchmark.antiAliasing != AA_MODE_COUNT ? benchmark.antiAliasing : benchmark.enabled ? AA_NONE : AA_MSAA4);
+    double targetFps = benchmark.targetFps >= 0.0 ? benchmark.targetFps : benchmark.enabled ? 0.0 : 60.0;
+    if (targetFps > 0.0) governor.targetMs = 1000.0 / targetFps;
+    governor.enabled = targetFps > 0.0;
+
+    // Request every shader program before configuring any of them
+    programCache.open(benchmark.programCachePath);
+    forwardVariants.request(std::string(shaderVersion) + frameDataSource + objectDataSource + vertexShaderSource, shaderVersion,
+        std::string(frameDataSource) + objectDataSource + lightingSource + lodDitherSource + fragmentShaderSource, configureForwardProgram);
+    shadowMaps.requestPrograms();
+    deferredRenderer.requestPrograms();
+    indirectDraws.requestPrograms();
+    occlusionCuller.requestPrograms();
+    postAntiAliasing.requestPrograms();
+
+    forwardVariants.init();
+    uniforms.init();
+    clusteredLighting.init();
+    shadowMaps.init();
+    deferredRenderer.init();
+    indirectDraws.init();
+    occlusionCuller.init();
+    postAntiAliasing.init();
+    resetConstantAttributes();
+    programCache.finishAll();
+    programCache.save();
+
+    std::ofstream passLog;
+    if (!benchmark.passLogPath.empty()) {
+        passLog.open(benchmark.passLogPath);
+        if (passLog) passTimer.log = &passLog;
+        else std::cout << "Failed to open " << benchmark.passLogPath << std::endl;
+    }
 
     // Initialize scene
     camera.aspect = (float)windowWidth / (float)windowHeight;
     camera.updatePosition();
-    initializeScene();
+    setupScene(benchmark.snapshotPath);
+    startupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupBegin).count();
 
-    std::cout << "Enhanced 3D Office Break Room loaded successfully!" << std::endl;
-    std::cout << "Controls:" << std::endl;
-    std::cout << "- Mouse: Click and drag to rotate" << std::endl;
-    std::cout << "- Mouse wheel: Zoom in/out" << std::endl;
-    std::cout << "- Number keys 1-3: Switch camera views" << std::endl;
-    std::cout << "- L key: Toggle day/night lighting" << std::endl;
-    std::cout << "- R key: Reset camera position" << std::endl;
-    std::cout << "- ESC: Exit application" << std::endl;
+    int exitCode = 0;
+    if (benchmark.enabled) {
+        exitCode = runBenchmark(benchmark);
+        glfwSetWindowShouldClose(window, true);
+    }
+    else {
+        std::cout << "Enhanced 3D Office Break Room loaded successfully!" << std::endl;
+        std::cout << "Scene " << (sceneFromSnapshot ? "mapped from snapshot " + benchmark.snapshotPath : std::string("generated"))
+            << " in " << sceneSetupMs << " ms" << (geometryUploader.threaded ? ", " + std::to_string(geometryUploader.queuedBytes / 1024)
+                + " KB of geometry uploading on a background thread" : std::string()) << std::endl;
+        const shadercache::Stats& programs = programCache.stats;
+        std::cout << "Startup " << startupMs << " ms (" << (programs.cacheHits == programs.programs ? "warm" : "cold")
+            << "): " << programs.programs << " shader programs, " << programs.cacheHits << " from the program cache, "
+            << programs.compiled << " compiled" << (programs.parallel ? " in parallel" : "") << ", "
+            << programs.requestMs + programs.finishMs << " ms blocked on shaders" << std::endl;
+        std::cout << "Geometry cache: " << geometryCache.uniqueShapes() << " unique shapes for "
+            << geometryCache.requests << " meshes, " << geometryCache.pool.sizeInBytes() / 1024 << " KB pooled" << std::endl;
+        std::cout << "Vertex format: " << (vertexFormat == VERTEX_COMPACT ? "compact" : "full") << ", " << vertexStride()
+            << " bytes per vertex, " << vertexBufferBytes() / 1024 << " KB of vertex buffers" << std::endl;
+        geometryCache.printIndexReport();
+        std::cout << "Anti-aliasing " << AA_MODE_NAMES[antiAliasing] << " (" << supportedSamples << "x MSAA supported)" << std::endl;
+        std::cout << "Frame-time governor " << (governor.enabled ? "ON" : "OFF") << ": target " << governor.targetMs
+            << " ms, starting at " << governor.settings() << std::endl;
+        std::cout << "Controls:" << std::endl;
+        std::cout << "- Mouse: Click and drag to rotate" << std::endl;
+        std::cout << "- Mouse wheel: Zoom in/out" << std::endl;
+        std::cout << "- Number keys 1-3: Switch camera views" << std::endl;
+        std::cout << "- L key: Toggle day/night lighting" << std::endl;
+        std::cout << "- Q key: Print render queue stats and toggle sorting" << std::endl;
+        std::cout << "- K key: Toggle clustered forward lighting" << std::endl;
+        std::cout << "- P key: Toggle lighting shaders specialized by light counts (built in the background)" << std::endl;
+        std::cout << "- G key: Toggle forward/deferred shading (pass timings in the window title)" << std::endl;
+        std::cout << "- O key: Toggle the pass timing overlay (GPU bar above CPU bar per pass)" << std::endl;
+        std::cout << "- S key: Toggle shadows" << std::endl;
+        std::cout << "- C key: Toggle frustum culling (stats in the window title)" << std::endl;
+        std::cout << "- M key: Toggle multi-draw indirect submission ("
+            << (indirectDraws.supported ? "supported" : "unsupported, per-draw fallback") << ")" << std::endl;
+        std::cout << "- H key: Toggle GPU Hi-Z occlusion culling behind the walls (needs multi-draw indirect)" << std::endl;
+        std::cout << "- V key: Toggle prefab LOD by screen size (prints triangles and level counts)" << std::endl;
+        std::cout << "- F key: Toggle the dithered LOD crossfade" << std::endl;
+        std::cout << "- B key: Toggle static batching (" << scene.countDrawCalls(true) << " vs "
+            << scene.countDrawCalls(false) << " draw calls)" << std::endl;
+        std::cout << "- R key: Reset camera position" << std::endl;
+        std::cout << "- I key: Toggle render on demand (CPU utilization in the window title)" << std::endl;
+        std::cout << "- A key: Cycle anti-aliasing none/FXAA/SMAA-lite/TAA/MSAA 2x/4x/8x (prints the cost of the mode left)" << std::endl;
+        std::cout << "- D key: Toggle the frame-time governor (resolution, MSAA and cylinder detail in the window title)" << std::endl;
+        std::cout << "- ESC: Exit application" << std::endl;
+    }
 
     // Main loop
     double lastTime = glfwGetTime();
+    double lastStatsTime = lastTime;
+    cpuMeter.sample(lastTime);
     while (!glfwWindowShouldClose(window)) {
         double currentTime = glfwGetTime();
-        double deltaTime = currentTime - lastTime;
-        lastTime = currentTime;
+        bool wanted = redraw.wanted();
+        double budgetLeft = redraw.lastFrameTime + redraw.frameBudget - currentTime;
+
+        if (!wanted || budgetLeft > 0.0) {
+            // Nothing changed, or the frame budget is not spent yet: sleep
+            // until input arrives, the budget runs out or the title is due
+            PROFILE_SCOPE("glfwWaitEventsTimeout");
+            double timeout = lastStatsTime + 0.5 - currentTime;
+            if (wanted) timeout = std::min(timeout, budgetLeft);
+            glfwWaitEventsTimeout(std::max(timeout, 0.0));
+        }
+        else {
+            PROFILE_SCOPE("frame");
+            double deltaTime = std::min(currentTime - lastTime, 0.1); // no jump after idling
+            lastTime = currentTime;
+
+            // Auto-rotation in overview mode, 0.12 rad/s whatever the frame rate
+            if (camera.mode == 1) {
+                camera.phi += 0.12f * (float)deltaTime;
+                camera.updatePosition();
+            }
 
-        // Auto-rotation in overview mode
-        if (camera.mode == 1) {
-            camera.phi += 0.002f;
-            camera.updatePosition();
+            glfwPollEvents();
+            render();
+            {
+                PROFILE_SCOPE("glfwSwapBuffers");
+                glfwSwapBuffers(window);
+            }
+            redraw.dirty = false;
+            redraw.lastFrameTime = currentTime;
+            cpuMeter.frames++;
         }
 
-        glfwPollEvents();
-        render();
-        glfwSwapBuffers(window);
+        // Culling efficiency and CPU utilization, refreshed twice a second
+        if (currentTime - lastStatsTime > 0.5) {
+            cpuMeter.sample(currentTime);
+            std::string title = "Enhanced 3D Office Break Room - C++ OpenGL | cull: "
+                + std::to_string(cullStats.meshesTested) + " tested, "
+                + std::to_string(cullStats.meshesCulled) + " culled, "
+                + std::to_string(cullStats.meshesDrawn) + " drawn, "
+                + std::to_string((int)cullStats.microseconds) + " us | "
+                + cpuMeter.summary() + " | "
+                + governor.summary() + " | aa "
+                + antiAliasingReport() + " | "
+                + passTimer.summary();
+            glfwSetWindowTitle(window, title.c_str());
+            lastStatsTime = currentTime;
+        }
     }
 
-    // Cleanup
-    glDeleteProgram(shaderProgram);
+    // Cleanup (GPU objects must go while the context is still alive)
+    geometryUploader.stop();
+    renderQueue.destroy();
+    passTimer.destroy();
+    passTimer.log = nullptr;
+    deferredRenderer.destroy();
+    sceneTarget.destroy();
+    postAntiAliasing.destroy();
+    indirectDraws.destroy();
+    occlusionCuller.destroy();
+    shadowMaps.destroy();
+    clusteredLighting.destroy();
+    scene.meshes.clear();
+    scene.prefabs.clear();
+    scene.staticBatches.clear();
+    geometryCache.clear();
+    uniforms.destroy();
+    forwardVariants.destroy();
+    programCache.save(); // adds the light variants built during the run
     glfwTerminate();
-    return 0;
+    return exitCode;
 }
@@ -13,6 +13,8 @@ Project 6: Specular Lighting, Objects, Illumination and Shaders
 #include <iostream>
 #include <vector>
 
+#include "../ShaderCache.h"
+
 // Vertex shader source
 const char* vertexShaderSource = R"(
 #version 330 core
@@ -122,50 +124,16 @@ float vertices[] = {
     -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f
 };
 
-unsigned int compileShader(unsigned int type, const char* source) {
-    unsigned int shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, NULL);
-    glCompileShader(shader);
-
-    int success;
-    char infoLog[512];
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        glGetShaderInfoLog(shader, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::COMPILATION_FAILED\n" << infoLog << std::endl;
-    }
-
-    return shader;
-}
-
-unsigned int createShaderProgram() {
-    unsigned int vertexShader = compileShader(GL_VERTEX_SHADER, vertexShaderSource);
-    unsigned int fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentShaderSource);
-
-    unsigned int shaderProgram = glCreateProgram();
-    glAttachShader(shaderProgram, vertexShader);
-    glAttachShader(shaderProgram, fragmentShader);
-    glLinkProgram(shaderProgram);
-
-    int success;
-    char infoLog[512];
-    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
-    }
-
-    glDeleteShader(vertexShader);
-    glDeleteShader(fragmentShader);
-
-    return shaderProgram;
-}
+// Linked program binaries are kept across runs, so a warm launch skips compiling
+shadercache::ProgramCache programCache;
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
     glViewport(0, 0, width, height);
 }
 
 int main() {
+    auto startupBegin = std::chrono::steady_clock::now();
+
     // Initialize GLFW
     glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -191,8 +159,9 @@ int main() {
     // Enable depth testing
     glEnable(GL_DEPTH_TEST);
 
-    // Create shader program
-    unsigned int shaderProgram = createShaderProgram();
+    // Create shader program; the vertex setup below overlaps the compile
+    programCache.open("lighting.programs");
+    unsigned int shaderProgram = programCache.request(vertexShaderSource, fragmentShaderSource);
 
     // Set up vertex data and buffers
     unsigned int VBO, VAO;
@@ -217,6 +186,12 @@ int main() {
     // Set background color - dark to match LearnOpenGL examples
     glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 
+    programCache.finish(shaderProgram);
+    programCache.save();
+    double startupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupBegin).count();
+    std::cout << "Startup " << startupMs << " ms (" << (programCache.stats.cacheHits ? "warm" : "cold") << "), "
+        << programCache.stats.requestMs + programCache.stats.finishMs << " ms blocked on shaders" << std::endl;
+
     // Main render loop
     while (!glfwWindowShouldClose(window)) {
         // Clear screen